@@ -6,19 +6,60 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
-#ifndef ATTENTIVE_AT_UNIX_H
-#define ATTENTIVE_AT_UNIX_H
+#ifndef ATTENTIVE_AT_FREERTOS_H
+#define ATTENTIVE_AT_FREERTOS_H
 
 #include <attentive/at.h>
 
 /**
  * Create an AT channel instance.
  *
- * @param devpath Device path.
- * @param baudrate If non-zero, sets device baudrate (see termios.h).
- * @returns Instance pointer on success, NULL and sets errno on failure.
+ * @param bufsize Response buffer size in bytes; zero picks the default (512).
+ *                Responses that don't fit fail. See also
+ *                at_parser_set_buffer_limit().
+ * @returns Instance pointer on success, NULL on failure.
  */
-struct at *at_alloc_freertos(void);
+#ifndef AT_NO_MALLOC
+struct at *at_alloc_freertos(size_t bufsize);
+#endif
+
+/**
+ * Storage needed by at_init_freertos().
+ *
+ * @param bufsize Response buffer size in bytes; zero picks the default.
+ */
+size_t at_freertos_size(size_t bufsize);
+
+/**
+ * Create an AT channel instance in caller-provided memory, e.g. in fast
+ * SRAM. Works like at_alloc_freertos(), except that the response buffer
+ * can't grow. at_free() tears the channel down but leaves the memory
+ * alone.
+ *
+ * With -DAT_NO_MALLOC the reader task and semaphores are created
+ * statically too, inside the storage; that needs
+ * configSUPPORT_STATIC_ALLOCATION.
+ *
+ * @param storage Memory for the channel, suitably aligned for any type.
+ * @param size Size of storage; at least at_freertos_size(bufsize).
+ * @param bufsize Response buffer size in bytes; zero picks the default.
+ * @returns Instance pointer on success, NULL and sets errno to ENOMEM if
+ *          the storage is too small.
+ */
+struct at *at_init_freertos(void *storage, size_t size, size_t bufsize);
+
+/**
+ * Pass received bytes to an AT channel. Call from the UART receive interrupt
+ * or DMA completion handler; the channel doesn't read the UART itself.
+ *
+ * Bytes are queued in a ring buffer and the reader task is woken up to feed
+ * them to the parser. Bytes that don't fit in the ring are dropped.
+ *
+ * @param at AT channel instance.
+ * @param data Received bytes.
+ * @param len Number of bytes.
+ */
+void at_freertos_rx_isr(struct at *at, const void *data, size_t len);
 
 #endif
 
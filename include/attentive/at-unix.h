@@ -14,13 +14,195 @@
 #include <attentive/at.h>
 
 /**
- * Create an AT channel instance.
+ * Create an AT channel instance. Several threads may issue commands on it;
+ * each gets its own copy of responses, valid until that thread's next
+ * command on the channel. Per-command settings (scanner, data buffer,
+ * priority, dataprompt, data mode, deadline) likewise apply to the setting
+ * thread's next command only. at_set_timeout() applies to the thread's
+ * commands and to those of threads that haven't set a timeout yet.
  *
  * @param devpath Device path.
  * @param baudrate If non-zero, sets device baudrate (see termios.h).
+ * @param bufsize Response buffer size in bytes; zero picks the default (256).
+ *                Responses that don't fit fail with ENOBUFS. See also
+ *                at_parser_set_buffer_limit().
  * @returns Instance pointer on success, NULL and sets errno on failure.
  */
-struct at *at_alloc_unix(const char *devpath, speed_t baudrate);
+struct at *at_alloc_unix(const char *devpath, speed_t baudrate, size_t bufsize);
+
+/**
+ * Storage needed by at_init_unix().
+ *
+ * @param bufsize Response buffer size in bytes; zero picks the default.
+ */
+size_t at_unix_size(size_t bufsize);
+
+/**
+ * Create an AT channel instance in caller-provided memory. Works like
+ * at_alloc_unix(), except that the response buffer can't grow. at_free()
+ * tears the channel down but leaves the memory alone. Queued asynchronous
+ * commands still come from the heap.
+ *
+ * @param storage Memory for the channel, suitably aligned for any type.
+ * @param size Size of storage; at least at_unix_size(bufsize).
+ * @param devpath Device path.
+ * @param baudrate If non-zero, sets device baudrate (see termios.h).
+ * @param bufsize Response buffer size in bytes; zero picks the default.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at *at_init_unix(void *storage, size_t size, const char *devpath, speed_t baudrate, size_t bufsize);
+
+/**
+ * Record serial traffic. Every chunk read from or written to the port is
+ * stored as a "<seconds>.<microseconds> RX|TX <length>" line, followed by
+ * the raw bytes and a newline. Timestamps count from this call. The traces
+ * can be replayed with tests/bench-parser.
+ *
+ * @param at AT channel instance.
+ * @param fd Trace file descriptor, or -1 to stop tracing. Not closed.
+ */
+void at_set_trace_unix(struct at *at, int fd);
+
+/**
+ * Change the port speed of an open (or yet to be opened) channel. Input that
+ * hasn't been read yet is discarded.
+ *
+ * @param at AT channel instance; not a multiplexer channel.
+ * @param baudrate New baudrate (see termios.h).
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_set_baudrate_unix(struct at *at, speed_t baudrate);
+
+/**
+ * Find the baudrate the modem talks at and switch the channel to it. The
+ * rate cached for the device path is tried first, then the candidates, each
+ * with a couple of sub-second "AT"s. A newly found rate is locked with
+ * AT+IPR and AT&W, so the modem doesn't need to autobaud on the next
+ * power-up, and written to the cache.
+ *
+ * @param at AT channel instance, open.
+ * @param candidates Baudrates to try, most likely first; ends with zero.
+ * @param cache Cache file holding "<devpath> <bits/s>" lines, or NULL.
+ * @returns Baudrate found, 0 and sets errno if nothing answered.
+ */
+speed_t at_autobaud_unix(struct at *at, const speed_t *candidates, const char *cache);
+
+/** Arguments of at_autobaud_probe_unix(). */
+struct at_autobaud {
+    const speed_t *candidates;  /**< Baudrates to try; ends with zero. */
+    const char *cache;          /**< Cache file, or NULL. */
+};
+
+/**
+ * at_autobaud_unix() as a cellular_attach_many() probe.
+ *
+ * @param at AT channel instance, open.
+ * @param arg Pointer to a struct at_autobaud.
+ * @returns Zero on success, -1 and sets errno if nothing answered.
+ */
+int at_autobaud_probe_unix(struct at *at, void *arg);
+
+/**
+ * 3GPP TS 27.010 multiplexer: several independent AT channels over a single
+ * serial port. A long transfer on one channel doesn't hold up commands on
+ * the others.
+ */
+struct at_cmux;
+
+/**
+ * Create a multiplexer instance. Nothing is sent until at_cmux_open().
+ *
+ * @param devpath Device path.
+ * @param baudrate If non-zero, sets device baudrate (see termios.h).
+ * @param frame_size Longest information field (N1) in bytes; must match
+ *                   the modem's setting. Zero picks the 27.010 default (31).
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at_cmux *at_cmux_alloc(const char *devpath, speed_t baudrate, size_t frame_size);
+
+/**
+ * Open the port, switch the modem to multiplexer mode and start the
+ * multiplexer thread. The port must not be open as an ordinary channel.
+ *
+ * @param mux Multiplexer instance.
+ * @param command Command that starts multiplexer mode, e.g.
+ *                "AT+CMUX=0,0,5,127"; NULL if the modem is already in it.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_cmux_open(struct at_cmux *mux, const char *command);
+
+/**
+ * Close down multiplexer mode and the port. Pending commands on open
+ * channels fail; the channels still have to be closed and freed.
+ *
+ * @param mux Multiplexer instance.
+ * @returns Zero.
+ */
+int at_cmux_close(struct at_cmux *mux);
+
+/**
+ * Close and free a multiplexer instance. All of its channels must be freed
+ * first.
+ *
+ * @param mux Multiplexer instance.
+ */
+void at_cmux_free(struct at_cmux *mux);
+
+/**
+ * Create an AT channel instance on a multiplexer channel.
+ *
+ * Works like at_alloc_unix(); at_open() and at_close() connect and
+ * disconnect the channel. Each channel has its own parser, queue and
+ * callbacks, all run by the multiplexer thread. Callbacks may close and
+ * free channels of the same multiplexer, their own included; at_open()
+ * needs the thread to wait for the modem and fails there with EDEADLK.
+ *
+ * @param mux Multiplexer instance.
+ * @param dlci Channel number, 1 to 7; which ones exist depends on the modem.
+ * @param bufsize Response buffer size in bytes; zero picks the default.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at *at_alloc_unix_cmux(struct at_cmux *mux, int dlci, size_t bufsize);
+
+#ifdef __linux__
+
+/**
+ * Event loop servicing many AT channels from a single thread.
+ */
+struct at_loop;
+
+/**
+ * Create an event loop and start its thread.
+ *
+ * @returns Loop pointer on success, NULL and sets errno on failure.
+ */
+struct at_loop *at_loop_alloc(void);
+
+/**
+ * Stop and free an event loop. All of its channels must be freed first.
+ *
+ * @param loop Event loop.
+ */
+void at_loop_free(struct at_loop *loop);
+
+/**
+ * Create an AT channel instance serviced by an event loop.
+ *
+ * Works like at_alloc_unix(), except that no reader thread is started; the
+ * loop thread reads from the port, runs the callbacks and handles timeouts.
+ * Callbacks may open, close, allocate and free channels of the loop, their
+ * own included; a channel freed by a callback goes away after the loop's
+ * current round.
+ *
+ * @param loop Event loop.
+ * @param devpath Device path.
+ * @param baudrate If non-zero, sets device baudrate (see termios.h).
+ * @param bufsize Response buffer size in bytes; zero picks the default.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at *at_alloc_unix_loop(struct at_loop *loop, const char *devpath, speed_t baudrate, size_t bufsize);
+
+#endif
 
 #endif
 
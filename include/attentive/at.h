@@ -11,6 +11,60 @@
 
 #include <attentive/parser.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/uio.h>
+#else
+/** Scatter-gather segment, laid out like the POSIX one. */
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+#ifdef AT_STATS
+
+/*
+ * Channel statistics, built in with -DAT_STATS.
+ */
+
+/** Latency histogram size; bucket i counts [2^i, 2^(i+1)) microseconds. */
+#define AT_STATS_BUCKETS        24
+/** Prefixes tracked separately, first come first served; the last slot
+ * collects everything else. */
+#ifndef AT_STATS_PREFIXES
+#define AT_STATS_PREFIXES       16
+#endif
+#ifndef AT_STATS_PREFIX_LENGTH
+#define AT_STATS_PREFIX_LENGTH  16
+#endif
+
+struct at_stats_command {
+    char prefix[AT_STATS_PREFIX_LENGTH];    /**< E.g. "AT+CIPSEND"; "(raw)" for data. */
+    unsigned int count;
+    unsigned int timeouts;
+    unsigned int latency[AT_STATS_BUCKETS];
+};
+
+struct at_stats_urc {
+    char prefix[AT_STATS_PREFIX_LENGTH];    /**< Up to the colon, e.g. "+CIPRXGET". */
+    unsigned int count;
+};
+
+struct at_stats {
+    unsigned int commands;      /**< Commands completed or failed. */
+    unsigned int timeouts;      /**< Commands that got no response in time. */
+    unsigned int urcs;
+    unsigned int truncations;   /**< Responses and URCs that didn't fit. */
+    unsigned int wakeups;       /**< Times the reader woke up for input. */
+    unsigned int rx_dropped;    /**< Bytes lost before reaching the parser. */
+    unsigned long rx_bytes;
+    unsigned long tx_bytes;
+    struct at_stats_command command[AT_STATS_PREFIXES];
+    struct at_stats_urc urc[AT_STATS_PREFIXES];
+};
+
+#endif
+
 /*
  * Publicly accessible fields. Platform-specific implementations may add private
  * fields at the end of this struct.
@@ -20,6 +74,11 @@ struct at {
     const struct at_callbacks *cbs;
     void *arg;
     at_line_scanner_t command_scanner;
+    at_data_handler_t data_handler;
+    void *data_arg;
+#ifdef AT_STATS
+    struct at_stats stats;      /**< Use at_stats_snapshot() to read. */
+#endif
 };
 
 struct at_callbacks {
@@ -27,6 +86,29 @@ struct at_callbacks {
     at_response_handler_t handle_urc;
 };
 
+/**
+ * Command completion callback. Response is NULL (and errno is set) if the
+ * command failed; otherwise it is only valid until the callback returns.
+ */
+typedef void (*at_command_callback_t)(const char *response, size_t len, void *ctx);
+
+/**
+ * Condition polled by at_wait(). Runs with the channel locked against URC
+ * processing; it must be quick and must not call at_* functions.
+ */
+typedef bool (*at_wait_condition_t)(void *arg);
+
+/**
+ * Command priority classes. Queued commands go out highest priority first,
+ * oldest first within a class; a command in flight is never interrupted.
+ */
+enum at_priority {
+    AT_PRIORITY_URGENT,     /**< Replies the modem is waiting for; see at_command_urgent(). */
+    AT_PRIORITY_CONTROL,    /**< Ordinary commands; the default. */
+    AT_PRIORITY_BULK,       /**< Data transfer steps; yield to everything else. */
+    AT_PRIORITIES
+};
+
 /**
  * Create an AT channel instance.
  *
@@ -85,6 +167,28 @@ void at_set_command_scanner(struct at *at, at_line_scanner_t scanner);
  */
 void at_set_character_handler(struct at *at, at_character_handler_t handler);
 
+/**
+ * Store raw data blocks of the next response in a caller-supplied buffer
+ * instead of the response buffer. See at_parser_set_data_buffer().
+ *
+ * @param at AT channel instance.
+ * @param buf Destination buffer.
+ * @param size Buffer size in bytes.
+ */
+void at_set_data_buffer(struct at *at, void *buf, size_t size);
+
+/**
+ * Set the priority of the next command. Bulk transfers split into several
+ * commands should mark each of them AT_PRIORITY_BULK, so that other users
+ * of the channel get their commands in between.
+ *
+ * NOTE: The FreeRTOS backend has no command queue; this is a no-op there.
+ *
+ * @param at AT channel instance.
+ * @param priority Priority class.
+ */
+void at_set_priority(struct at *at, enum at_priority priority);
+
 /**
  * Expect "> " dataprompt as a response for the next command.
  *
@@ -92,6 +196,40 @@ void at_set_character_handler(struct at *at, at_character_handler_t handler);
  */
 void at_expect_dataprompt(struct at *at);
 
+/**
+ * Switch the channel to data mode if the next command succeeds.
+ *
+ * The command scanner must report the line that starts the stream (usually
+ * "CONNECT") as AT_RESPONSE_FINAL_OK. From then on received bytes go to the
+ * data handler and at_send_raw() writes to the stream, until
+ * at_leave_datamode() is called.
+ *
+ * @param at AT channel instance.
+ */
+void at_expect_datamode(struct at *at);
+
+/**
+ * Set the handler receiving the data mode stream. Called from the reader
+ * context.
+ *
+ * @param at AT channel instance.
+ * @param handler Data handler (NULL to drop the data).
+ * @param arg Private argument passed to the handler.
+ */
+void at_set_data_handler(struct at *at, at_data_handler_t handler, void *arg);
+
+/**
+ * Return to command mode with the guarded "+++" escape sequence.
+ *
+ * Nothing may be sent for the guard time before and after the escape, so
+ * this takes a couple of seconds. Data arriving until the modem has switched
+ * over is lost. Changes the channel timeout.
+ *
+ * @param at AT channel instance.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_leave_datamode(struct at *at);
+
 /**
  * Set command timeout.
  *
@@ -100,6 +238,24 @@ void at_expect_dataprompt(struct at *at);
  */
 void at_set_timeout(struct at *at, int timeout);
 
+/**
+ * Set command timeout with millisecond resolution.
+ *
+ * @param at AT channel instance.
+ * @param timeout_ms Timeout in milliseconds (zero to disable).
+ */
+void at_set_timeout_ms(struct at *at, int timeout_ms);
+
+/**
+ * Make all following commands fail with ETIMEDOUT unless they complete within
+ * a time limit counted from now, on top of their own timeouts. Useful for
+ * bounding multi-command operations.
+ *
+ * @param at AT channel instance.
+ * @param timeout_ms Time limit in milliseconds (zero to remove the limit).
+ */
+void at_set_deadline(struct at *at, int timeout_ms);
+
 /**
  * Send an AT command and receive a response. Accepts printf-compatible
  * format and arguments.
@@ -124,6 +280,59 @@ const char *at_command(struct at *at, const char *format, ...);
  */
 const char *at_command_raw(struct at *at, const void *data, size_t size);
 
+/**
+ * Send a command assembled from several buffers, without copying them
+ * together first. Nothing is added: the caller supplies the "AT" prefix
+ * and the trailing "\r" as segments of their own. There is no length
+ * limit, unlike at_command().
+ *
+ * @param at AT channel instance.
+ * @param iov Segments, sent back to back. Must stay valid until the call
+ *            returns.
+ * @param iovcnt Number of segments.
+ * @returns Pointer to response (valid until next at_command) or NULL
+ *          if a timeout occurs.
+ */
+const char *at_command_iov(struct at *at, const struct iovec *iov, int iovcnt);
+
+/**
+ * Queue an AT command and return immediately. Accepts printf-compatible
+ * format and arguments.
+ *
+ * Commands are sent one at a time, in the order they were queued, along with
+ * the per-command settings (scanner, dataprompt, data buffer, timeout) made
+ * before queueing them. The callback runs in the reader context once the
+ * response arrives or the command times out, or from at_close() if the
+ * channel is closed first. It may queue further commands but must not call
+ * at_command().
+ *
+ * NOTE: The FreeRTOS backend has no command queue; there the command runs to
+ *       completion and the callback is called before this returns.
+ *
+ * @param at AT channel instance.
+ * @param cb Completion callback.
+ * @param ctx Private argument passed to the callback.
+ * @param format printf-comaptible format.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+__attribute__ ((format (printf, 4, 5)))
+int at_command_async(struct at *at, at_command_callback_t cb, void *ctx, const char *format, ...);
+
+/**
+ * Queue an AT command ahead of everything else and discard its response.
+ * Unlike at_send(), it doesn't go out in the middle of another command;
+ * unlike at_command_async(), it may be called from URC handlers and leaves
+ * per-command settings made by others alone.
+ *
+ * NOTE: On the FreeRTOS backend the command is written out right away.
+ *
+ * @param at AT channel instance.
+ * @param format printf-comaptible format.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+__attribute__ ((format (printf, 2, 3)))
+int at_command_urgent(struct at *at, const char *format, ...);
+
 /**
  * Send an AT command. Accepts printf-compatible format and arguments.
  *
@@ -144,6 +353,92 @@ bool at_send(struct at *at, const char *format, ...);
  */
 bool at_send_raw(struct at *at, const void *data, size_t size);
 
+/**
+ * Send several buffers back to back over the AT channel, without waiting
+ * for a response. The scatter-gather counterpart of at_send_raw().
+ *
+ * @param at AT channel instance.
+ * @param iov Segments to send.
+ * @param iovcnt Number of segments.
+ * @returns True if success.
+ */
+bool at_send_iov(struct at *at, const struct iovec *iov, int iovcnt);
+
+/**
+ * Send a list of AT commands, combining them into as few command lines as
+ * possible ("AT+A;+B;+C") to save round-trips.
+ *
+ * Meant for setup commands that return nothing but "OK". Commands must start
+ * with "AT" and must be safe to repeat: if a combined line fails, its commands
+ * are sent again one by one to find the failing one.
+ *
+ * @param at AT channel instance.
+ * @param commands NULL-terminated list of commands.
+ * @returns Zero if all commands succeeded, -1 at the first one that didn't.
+ */
+int at_command_batch(struct at *at, const char *const commands[]);
+
+/**
+ * Wake up at_wait() callers so they re-check their conditions. Meant to be
+ * called from the URC handler or a completion callback after it updated
+ * state someone may wait on.
+ *
+ * @param at AT channel instance.
+ */
+void at_notify(struct at *at);
+
+/**
+ * Block until a condition holds, re-checking it after every at_notify().
+ * Replaces sleep-and-poll loops waiting for URCs.
+ *
+ * @param at AT channel instance.
+ * @param cond Condition to wait for, or NULL to return at the first
+ *             notification.
+ * @param arg Private argument passed to the condition.
+ * @param timeout_ms Time limit in milliseconds.
+ * @returns Zero if the condition holds (or a notification arrived),
+ *          -1 and sets errno on timeout.
+ */
+int at_wait(struct at *at, at_wait_condition_t cond, void *arg, int timeout_ms);
+
+/**
+ * Read a monotonic millisecond clock for timekeeping in modem drivers. The
+ * value wraps around; only differences are meaningful.
+ *
+ * @returns Milliseconds since an arbitrary point in time.
+ */
+uint32_t at_clock_ms(void);
+
+#ifdef AT_STATS
+
+/**
+ * Copy the channel statistics. Cheap enough to call periodically; the
+ * counters are copied in one go, so they are consistent with each other.
+ *
+ * @param at AT channel instance.
+ * @param stats Destination.
+ */
+void at_stats_snapshot(struct at *at, struct at_stats *stats);
+
+/*
+ * Statistics bookkeeping for platform implementations. Each counter must
+ * only be updated from one task at a time (or under the channel lock).
+ */
+
+/** Account for a finished command; data is the command line as sent. */
+void at_stats_command(struct at_stats *stats, const void *data, size_t size, uint32_t us, bool timeout);
+/** Account for a URC. */
+void at_stats_urc(struct at_stats *stats, const char *line, size_t len);
+#define at_stats_add(stats, field, n) ((stats)->field += (n))
+
+#else
+
+#define at_stats_command(stats, data, size, us, timeout) ((void) 0)
+#define at_stats_urc(stats, line, len) ((void) 0)
+#define at_stats_add(stats, field, n) ((void) 0)
+
+#endif
+
 /**
  * Send an AT command and return -1 if it doesn't return OK.
  */
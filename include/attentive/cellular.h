@@ -16,7 +16,9 @@
 
 #include <attentive/at.h>
 
-#if defined(__cplusplus) || !defined(__STRICT_ANSI__) || !defined(__ssize_t)
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/types.h>
+#elif defined(__cplusplus) || !defined(__STRICT_ANSI__) || !defined(__ssize_t)
  /* always defined in C++ and non-strict C for consistency of debug info */
   typedef int ssize_t;   /* see <stddef.h> */
   #if !defined(__cplusplus) && defined(__STRICT_ANSI__)
@@ -38,14 +40,57 @@ enum {
     CREG_REGISTERED_ROAMING = 5,
 };
 
+/* Socket events reported by socket_poll(). */
+#define CELLULAR_POLLIN     0x01    /**< Received data is waiting. */
+#define CELLULAR_POLLOUT    0x02    /**< Everything sent was acknowledged. */
+#define CELLULAR_POLLHUP    0x04    /**< Connection closed or failed; always reported. */
+
+struct cellular_pollfd {
+    int connid;
+    short events;           /**< Requested events. */
+    short revents;          /**< Returned events. */
+};
+
+/**
+ * Download data sink. Returns zero to carry on, -1 to abort the download.
+ */
+typedef int (*cellular_sink_t)(const void *data, size_t len, void *ctx);
+
+/**
+ * What the PDP machinery believes about the data context.
+ */
+enum cellular_pdp_state {
+    CELLULAR_PDP_DOWN = 0,      /**< Unknown or inactive; pdp_open() checks. */
+    CELLULAR_PDP_OPENING,       /**< pdp_open() in progress. */
+    CELLULAR_PDP_UP,            /**< Known to work; network commands go ahead. */
+    CELLULAR_PDP_STUCK,         /**< Too many failures; closed before reopening. */
+};
+
+/**
+ * Modem state remembered between queries. Cleared on attach.
+ */
+struct cellular_state {
+    int creg;                   /**< Registration status, -1 if unknown. */
+    int rssi;                   /**< Signal strength, -1 if unknown. */
+    uint32_t creg_time;         /**< at_clock_ms() of the last update. */
+    uint32_t rssi_time;
+    bool creg_live;             /**< Kept up to date by URCs. */
+    bool rssi_live;
+    char imei[CELLULAR_IMEI_LENGTH+1];      /**< Empty until read. */
+    char iccid[CELLULAR_ICCID_LENGTH+2];    /**< Some SIMs have 20 digits. */
+};
+
 struct cellular {
     const struct cellular_ops *ops;
     struct at *at;
 
     /* Private fields. */
     const char *apn;
+    enum cellular_pdp_state pdp_state;
     int pdp_failures;
     int pdp_threshold;
+    int max_age_ms;
+    struct cellular_state state;
 };
 
 struct cellular_ops {
@@ -78,10 +123,49 @@ struct cellular_ops {
     ssize_t (*socket_recv)(struct cellular *modem, int connid, void *buffer, size_t length, int flags);
     int (*socket_waitack)(struct cellular *modem, int connid);
     int (*socket_close)(struct cellular *modem, int connid);
+    /**
+     * Wait for events on several sockets, poll() style. Driven by the
+     * modem's notifications, so only sockets worth servicing are reported.
+     * Timeout is in milliseconds; negative waits forever. Returns the number
+     * of sockets with non-zero revents, zero on timeout or -1 on error.
+     */
+    int (*socket_poll)(struct cellular *modem, struct cellular_pollfd *fds, size_t nfds, int timeout_ms);
+    /**
+     * Coalesce small socket_send() calls into full-sized modem sends. Data
+     * is held until the buffer fills up or delay_ms has passed; the delay is
+     * checked by later calls on the modem, so use socket_flush() (or
+     * socket_poll()) when the application goes quiet. Pass NULL to disable.
+     * The buffer must stay valid until disabled or the socket is closed;
+     * closing flushes and disables it.
+     */
+    int (*socket_set_send_buffer)(struct cellular *modem, int connid, void *buffer, size_t size, int delay_ms);
+    /** Send out whatever the send buffer holds. */
+    int (*socket_flush)(struct cellular *modem, int connid);
+
+    /**
+     * Open a transparent (data mode) connection. The AT channel then carries
+     * the raw stream without per-chunk framing: received data goes to the
+     * handler, at_send_raw() writes. No other ops may be used until
+     * socket_stream_close(). A dropped connection shows up in the stream as
+     * the modem's own notification ("CLOSED", "NO CARRIER").
+     */
+    int (*socket_stream_open)(struct cellular *modem, const char *host, uint16_t port, at_data_handler_t handler, void *arg);
+    /** Escape back to command mode and close the transparent connection. */
+    int (*socket_stream_close)(struct cellular *modem);
 
     int (*ftp_open)(struct cellular *modem, const char *host, uint16_t port, const char *username, const char *password, bool passive);
     int (*ftp_get)(struct cellular *modem, const char *filename);
+    /** Like ftp_get, but start offset bytes into the file (FTP REST). */
+    int (*ftp_get_from)(struct cellular *modem, const char *filename, size_t offset);
+    /** Size of a remote file in bytes (after ftp_open). */
+    ssize_t (*ftp_size)(struct cellular *modem, const char *filename);
     int (*ftp_getdata)(struct cellular *modem, char *buffer, size_t length);
+    /**
+     * Download a whole file (after ftp_open), passing it to the sink chunk by
+     * chunk. The next chunk is requested before the current one is handed
+     * to the sink, so the sink's work overlaps the transfer.
+     */
+    int (*ftp_download)(struct cellular *modem, const char *filename, cellular_sink_t sink, void *ctx);
     int (*ftp_close)(struct cellular *modem);
 
     int (*locate)(struct cellular *modem, float *latitude, float *longitude, float *altitude);
@@ -109,6 +193,33 @@ struct cellular *cellular_alloc(void);
  */
 int cellular_attach(struct cellular *modem, struct at *at, const char *apn);
 
+/** Largest number of modems cellular_attach_many() brings up at once. */
+#ifndef CELLULAR_ATTACH_WORKERS
+#define CELLULAR_ATTACH_WORKERS 8
+#endif
+
+/** Channel setup run before the attach, e.g. at_autobaud_probe_unix(). */
+typedef int (*cellular_probe_t)(struct at *at, void *arg);
+
+/**
+ * Probe and attach several modems at once, up to CELLULAR_ATTACH_WORKERS
+ * at a time, the calling thread included. Give every modem its own channel.
+ * Without threads (FreeRTOS) the modems are brought up one after another.
+ *
+ * @param modems Cellular modem instances.
+ * @param ats AT channel instances, one per modem.
+ * @param apn APN name for all modems. Not copied.
+ * @param count Number of modems.
+ * @param probe Run on each channel first, returning zero or -1 and errno;
+ *              NULL to skip.
+ * @param arg Private argument passed to probe.
+ * @param errors If not NULL, receives zero or an errno value per modem.
+ * @returns Zero if all modems attached, -1 and sets errno to the first
+ *          failure otherwise.
+ */
+int cellular_attach_many(struct cellular *const modems[], struct at *const ats[], const char *apn,
+                         int count, cellular_probe_t probe, void *arg, int errors[]);
+
 /**
  * Detach cellular modem instance.
  * @param modem Cellular modem instance.
@@ -116,6 +227,18 @@ int cellular_attach(struct cellular *modem, struct at *at, const char *apn);
  */
 int cellular_detach(struct cellular *modem);
 
+/**
+ * Let creg() and rssi() answer from the cached state, without touching the
+ * modem, if the value is at most max_age_ms old. Values the modem keeps
+ * up to date with URCs are always fresh. IMEI and ICCID are read only once
+ * per attach regardless.
+ *
+ * @param modem Cellular modem instance.
+ * @param max_age_ms Zero (the default) to ask the modem every time, -1 to
+ *                   trust any cached value.
+ */
+void cellular_set_max_age(struct cellular *modem, int max_age_ms);
+
 /**
  * Free a cellular modem instance.
  *
@@ -124,16 +247,112 @@ int cellular_detach(struct cellular *modem);
 void cellular_free(struct cellular *modem);
 
 
-/* Modem-specific variants below. */
+/*
+ * Modem-specific variants below.
+ *
+ * The *_init() variants construct the instance in caller-provided memory
+ * of at least *_size() bytes, suitably aligned for any type, and fail with
+ * ENOMEM if it's too small. Such instances need no freeing. Builds with
+ * -DAT_NO_MALLOC only have these.
+ */
 
+#ifndef AT_NO_MALLOC
 struct cellular *cellular_generic_alloc(void);
 void cellular_generic_free(struct cellular *modem);
+#endif
+size_t cellular_generic_size(void);
+struct cellular *cellular_generic_init(void *storage, size_t size);
 
+#ifndef AT_NO_MALLOC
 struct cellular *cellular_telit2_alloc(void);
 void cellular_telit2_free(struct cellular *modem);
+#endif
+size_t cellular_telit2_size(void);
+struct cellular *cellular_telit2_init(void *storage, size_t size);
+
+enum cellular_sim800_profile {
+    /** Leave the IP application configured as found. */
+    CELLULAR_SIM800_PROFILE_DEFAULT,
+    /**
+     * Multi-connection mode, manual receive and quick send: socket_send()
+     * returns as soon as the modem has taken the data ("DATA ACCEPT"), and
+     * delivery is confirmed in bulk by socket_waitack().
+     */
+    CELLULAR_SIM800_PROFILE_THROUGHPUT,
+};
 
-struct cellular *cellular_sim800_alloc(void);
+#ifndef AT_NO_MALLOC
+struct cellular *cellular_sim800_alloc(enum cellular_sim800_profile profile);
 void cellular_sim800_free(struct cellular *modem);
+#endif
+size_t cellular_sim800_size(void);
+struct cellular *cellular_sim800_init(void *storage, size_t size, enum cellular_sim800_profile profile);
+
+/**
+ * Bluetooth SPP bytes lost because socket_recv() didn't drain them in time.
+ *
+ * @param modem SIM800 instance.
+ * @returns Bytes dropped since the instance was created.
+ */
+unsigned int cellular_sim800_spp_dropped(struct cellular *modem);
+
+/*
+ * Modem group: several attached modems used as one. Sockets go to the
+ * member with the fewest sockets and the best signal, and are reconnected
+ * elsewhere when a member loses its data context (the failing call then
+ * returns ECONNRESET; data in flight is lost). The group's own at and
+ * state fields are unused: attach and detach the members, not the group.
+ */
+
+/** Largest number of members. */
+#define CELLULAR_GROUP_MEMBERS 4
+/** Group connection ids are 0 to CELLULAR_GROUP_NSOCKETS-1. */
+#define CELLULAR_GROUP_NSOCKETS 16
+/** Longest host name remembered for reconnecting, including the NUL. */
+#define CELLULAR_GROUP_HOST_LENGTH 64
+
+/**
+ * Download data sink taking data at a file offset, pwrite() style. Returns
+ * zero to carry on, -1 to abort the download.
+ */
+typedef int (*cellular_range_sink_t)(size_t offset, const void *data, size_t len, void *ctx);
+
+#ifndef AT_NO_MALLOC
+struct cellular *cellular_group_alloc(void);
+void cellular_group_free(struct cellular *group);
+#endif
+size_t cellular_group_size(void);
+struct cellular *cellular_group_init(void *storage, size_t size);
+
+/**
+ * Add a modem to a group.
+ *
+ * @param group Group instance.
+ * @param modem Member instance, attached or not; must outlive the group.
+ * @param connid_base First connection id the member's sockets use.
+ * @param nsockets Number of connection ids the group may use on it.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int cellular_group_add(struct cellular *group, struct cellular *modem, int connid_base, int nsockets);
+
+/**
+ * Download a whole file (after ftp_open), splitting it into ranges read by
+ * different members when the file is big enough and every member can start
+ * mid-file (ftp_get_from). Otherwise the member with the best signal reads
+ * it all. Ranges arrive interleaved, hence the positional sink. FTP only
+ * lets a member choose where to start, so each one fetches on past the end
+ * of its range until it's stopped; that costs airtime beyond the file's own
+ * size, up to what the members fetch ahead. A member's session is closed as
+ * soon as its range is in, the rest afterwards either way.
+ *
+ * @param group Group instance.
+ * @param filename Remote file name.
+ * @param sink Data sink.
+ * @param ctx Private argument passed to the sink.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int cellular_group_ftp_download(struct cellular *group, const char *filename,
+                                cellular_range_sink_t sink, void *ctx);
 
 #endif
 
@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_CMUX_H
+#define ATTENTIVE_CMUX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * 3GPP TS 27.010 multiplexer framing, basic option. Only encodes and
+ * decodes frames; moving them over a port is up to the backend.
+ */
+
+/** Opening and closing flag of every frame. */
+#define CMUX_FLAG 0xF9
+
+/** Frame types (control field without the P/F bit). */
+enum cmux_frame_type {
+    CMUX_SABM = 0x2F,   /**< Set asynchronous balanced mode; opens a channel. */
+    CMUX_UA = 0x63,     /**< Unnumbered acknowledgement. */
+    CMUX_DM = 0x0F,     /**< Disconnected mode; refuses a channel. */
+    CMUX_DISC = 0x43,   /**< Disconnect; closes a channel. */
+    CMUX_UIH = 0xEF,    /**< Data; the checksum covers the header only. */
+    CMUX_UI = 0x03,     /**< Data; the checksum covers the data too. */
+};
+
+/** Poll/final bit of the control field. */
+#define CMUX_PF 0x10
+
+/** Control channel (DLCI 0) message types, as responses (C/R clear). */
+enum cmux_message_type {
+    CMUX_MSG_NSC = 0x11,    /**< Non-supported command. */
+    CMUX_MSG_TEST = 0x21,   /**< Echo test. */
+    CMUX_MSG_FCON = 0xA1,   /**< Flow control on. */
+    CMUX_MSG_FCOFF = 0x61,  /**< Flow control off. */
+    CMUX_MSG_MSC = 0xE1,    /**< Modem status. */
+    CMUX_MSG_CLD = 0xC1,    /**< Multiplexer close down. */
+};
+
+/** Command/response bit of a control channel message type. */
+#define CMUX_MSG_CR 0x02
+
+/** Modem status signals: EA, RTC, RTR and DV set. */
+#define CMUX_MSC_SIGNALS 0x8D
+
+/** Longest frame header: flag, address, control and two length bytes. */
+#define CMUX_HEADER_MAX 5
+
+/** Frame trailer: checksum and closing flag. */
+#define CMUX_TRAILER_SIZE 2
+
+/** Longest information field the length encoding allows. */
+#define CMUX_DATA_MAX 32767
+
+/**
+ * Encode the header and trailer of a frame sent by the initiator. UA and DM
+ * frames are sent as responses, everything else as commands.
+ *
+ * The data goes in between, untouched; that's what makes UIH frames cheap
+ * to build around caller buffers. Not suitable for UI frames carrying data.
+ *
+ * @param header Header storage, CMUX_HEADER_MAX bytes.
+ * @param trailer Trailer storage, CMUX_TRAILER_SIZE bytes.
+ * @param dlci Channel number (0-63).
+ * @param control Frame type, possibly with CMUX_PF.
+ * @param len Information field length (up to CMUX_DATA_MAX).
+ * @returns Header length.
+ */
+size_t cmux_encode_header(uint8_t *header, uint8_t *trailer, int dlci, uint8_t control, size_t len);
+
+/**
+ * Encode a whole frame sent by the initiator.
+ *
+ * @param frame Frame storage, len + CMUX_HEADER_MAX + CMUX_TRAILER_SIZE bytes.
+ * @param dlci Channel number (0-63).
+ * @param control Frame type, possibly with CMUX_PF.
+ * @param data Information field.
+ * @param len Information field length (up to CMUX_DATA_MAX).
+ * @returns Frame length.
+ */
+size_t cmux_encode(uint8_t *frame, int dlci, uint8_t control, const void *data, size_t len);
+
+/** Frame handler; called for every frame with a valid checksum. */
+typedef void (*cmux_frame_handler_t)(int dlci, uint8_t control, const uint8_t *data, size_t len, void *priv);
+
+/**
+ * Frame decoder. Fed a byte stream, it hunts for frames and passes them on
+ * whole; frames with a bad checksum or not fitting the buffer are dropped.
+ */
+struct cmux_decoder {
+    cmux_frame_handler_t handle_frame;
+    void *priv;
+
+    uint8_t *buf;           /**< Information field of the frame being received. */
+    size_t size;
+
+    int state;
+    uint8_t header[4];      /**< Address, control and length bytes. */
+    size_t header_len;
+    size_t len;             /**< Information field length. */
+    size_t received;        /**< Information field bytes received so far. */
+
+    unsigned int errors;    /**< Number of frames dropped. */
+};
+
+/**
+ * Initialize a frame decoder.
+ *
+ * @param decoder Decoder instance.
+ * @param buf Storage for the information field; must persist.
+ * @param size Buffer size in bytes; the longest frame accepted.
+ * @param handler Frame handler.
+ * @param priv Private argument; passed to the handler.
+ */
+void cmux_decoder_init(struct cmux_decoder *decoder, void *buf, size_t size,
+                       cmux_frame_handler_t handler, void *priv);
+
+/**
+ * Feed a frame decoder. The handler is called from this function's context.
+ *
+ * @param decoder Decoder instance.
+ * @param data Bytes to feed.
+ * @param len Number of bytes in data.
+ */
+void cmux_decode(struct cmux_decoder *decoder, const void *data, size_t len);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
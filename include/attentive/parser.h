@@ -50,12 +50,19 @@ typedef enum at_response_type (*at_line_scanner_t)(const char *line, size_t len,
 /** Response handler. */
 typedef void (*at_response_handler_t)(const char *line, size_t len, void *priv);
 
+/** Raw data handler. */
+typedef void (*at_data_handler_t)(const void *data, size_t len, void *priv);
+
 struct at_parser_callbacks {
     at_line_scanner_t scan_line;
     at_response_handler_t handle_response;
     at_response_handler_t handle_urc;
+    at_data_handler_t handle_data;      /**< Data mode input; optional. */
 };
 
+/* Builds with -DAT_NO_MALLOC leave out every *_alloc() function; use the
+ * *_init() variants instead. */
+#ifndef AT_NO_MALLOC
 /**
  * Allocate a parser instance.
  *
@@ -66,6 +73,30 @@ struct at_parser_callbacks {
  * @returns Parser instance pointer.
  */
 struct at_parser *at_parser_alloc(const struct at_parser_callbacks *cbs, size_t bufsize, void *priv);
+#endif
+
+/**
+ * Storage needed by at_parser_init(), response buffer included.
+ *
+ * @param bufsize Response buffer size in bytes.
+ */
+size_t at_parser_size(size_t bufsize);
+
+/**
+ * Construct a parser instance in caller-provided memory. Works like
+ * at_parser_alloc(), except that the response buffer can't grow.
+ *
+ * @param storage Memory for the parser, suitably aligned for any type. Must
+ *                persist for the lifetime of the parser.
+ * @param size Size of storage; at least at_parser_size(bufsize).
+ * @param cbs Parser callbacks.
+ * @param bufsize Response buffer size in bytes.
+ * @param priv Private argument; passed to callbacks.
+ * @returns Parser instance pointer, or NULL and sets errno to ENOMEM if the
+ *          storage is too small.
+ */
+struct at_parser *at_parser_init(void *storage, size_t size, const struct at_parser_callbacks *cbs,
+                                 size_t bufsize, void *priv);
 
 /**
  * Reset parser instance to initial state.
@@ -82,6 +113,53 @@ void at_parser_reset(struct at_parser *parser);
  */
 void at_parser_set_character_handler(struct at_parser *parser, at_character_handler_t handler);
 
+/**
+ * Store raw and hex data blocks of the next response in a caller-supplied
+ * buffer.
+ *
+ * Blocks announced by AT_RESPONSE_RAWDATA_FOLLOWS/AT_RESPONSE_HEXDATA_FOLLOWS
+ * are written back to back into the buffer instead of being appended to the
+ * response, which then only contains the text lines. Data that doesn't fit is
+ * discarded. The setting is cleared when the response completes.
+ *
+ * @param parser Parser instance.
+ * @param buf Destination buffer. Must stay valid until the response arrives.
+ * @param size Buffer size in bytes.
+ */
+void at_parser_set_data_buffer(struct at_parser *parser, void *buf, size_t size);
+
+/**
+ * Allow the response buffer to grow.
+ *
+ * When a response doesn't fit, the buffer is doubled until it does or the
+ * limit is reached. By default the buffer never grows.
+ *
+ * @param parser Parser instance.
+ * @param limit Maximum buffer size in bytes.
+ */
+void at_parser_set_buffer_limit(struct at_parser *parser, size_t limit);
+
+/**
+ * Check if data was dropped since the last at_parser_await_response().
+ *
+ * Lines that don't fit are truncated; earlier lines of the same response are
+ * dropped to make room for the final response line. Data blocks that don't
+ * fit in their buffer are truncated as well. The response handler should
+ * consider the response corrupt when this returns true.
+ *
+ * @param parser Parser instance.
+ * @returns True if the current response was truncated.
+ */
+bool at_parser_overflowed(struct at_parser *parser);
+
+/**
+ * Get the number of truncated responses and URCs so far.
+ *
+ * @param parser Parser instance.
+ * @returns Overflow count.
+ */
+unsigned int at_parser_overflow_count(struct at_parser *parser);
+
 /**
  * Make the parser expect a dataprompt for the next command.
  *
@@ -93,10 +171,34 @@ void at_parser_set_character_handler(struct at_parser *parser, at_character_hand
  */
 void at_parser_expect_dataprompt(struct at_parser *parser);
 
+/**
+ * Make the parser switch to data mode if the next command succeeds.
+ *
+ * Commands like ATD or AT+CIPSTART in transparent mode answer "CONNECT" and
+ * then turn the line into a raw data stream. In data mode nothing is parsed;
+ * all input goes to the handle_data callback until the next
+ * at_parser_await_response(), i.e. until the next command (normally the
+ * "+++" escape) is sent. The command scanner should report the line that
+ * starts the stream as AT_RESPONSE_FINAL_OK.
+ *
+ * @param parser Parser instance.
+ */
+void at_parser_expect_datamode(struct at_parser *parser);
+
+/**
+ * Check if the parser is in data mode.
+ *
+ * @param parser Parser instance.
+ * @returns True if input is passed through as raw data.
+ */
+bool at_parser_in_datamode(struct at_parser *parser);
+
 /**
  * Inform the parser that a command will be invoked. Causes a response callback
  * at the next command completion.
  *
+ * The previous response stays valid until this is called.
+ *
  * @param parser Parser instance.
  */
 void at_parser_await_response(struct at_parser *parser);
@@ -111,9 +213,10 @@ void at_parser_await_response(struct at_parser *parser);
 void at_parser_feed(struct at_parser *parser, const void *data, size_t len);
 
 /**
- * Deallocate a parser instance.
+ * Deallocate a parser instance. Does nothing for parsers constructed with
+ * at_parser_init(); their storage belongs to the caller.
  *
- * @param parser Parser instance allocated with at_parser_alloc.
+ * @param parser Parser instance.
  */
 void at_parser_free(struct at_parser *parser);
 
@@ -126,6 +229,111 @@ void at_parser_free(struct at_parser *parser);
  */
 bool at_prefix_in_table(const char *line, const char *const table[]);
 
+/** @internal Prefixes are indexed by their (printable ASCII) first character. */
+#define _AT_PREFIX_FIRST ' '
+#define _AT_PREFIX_LAST '~'
+
+/** Prefix matcher entry. Storage is supplied by the matcher's owner. */
+struct at_prefix_entry {
+    const char *prefix;
+    uint8_t len;
+    uint8_t next;       /**< Next entry with the same first character, plus one. */
+    uint8_t value;
+};
+
+/**
+ * Precompiled set of prefix tables.
+ *
+ * Classifies a line with a single lookup on its first character followed by
+ * a comparison against the (few) prefixes starting with it, instead of a
+ * linear scan over every table.
+ */
+struct at_prefix_matcher {
+    uint8_t head[_AT_PREFIX_LAST - _AT_PREFIX_FIRST + 1];   /**< First entry per character, plus one. */
+    struct at_prefix_entry *entries;
+    uint8_t count;
+    uint8_t size;
+};
+
+/**
+ * Initialize an empty prefix matcher.
+ *
+ * @param matcher Matcher instance.
+ * @param entries Entry storage, one per prefix added. Must persist for the
+ *                lifetime of the matcher.
+ * @param size Number of entries (up to 255).
+ */
+void at_prefix_matcher_init(struct at_prefix_matcher *matcher, struct at_prefix_entry *entries, size_t size);
+
+/**
+ * Add a table of prefixes to a matcher.
+ *
+ * Prefixes are matched in the order they were added, so earlier tables take
+ * precedence, just like consecutive at_prefix_in_table() calls.
+ *
+ * @param matcher Matcher instance.
+ * @param table List of prefixes; strings are not copied.
+ * @param value Non-zero value returned by at_prefix_match() for these.
+ * @returns Zero on success, -1 if out of entries or a prefix doesn't start
+ *          with a printable character.
+ */
+int at_prefix_matcher_add(struct at_prefix_matcher *matcher, const char *const table[], uint8_t value);
+
+/**
+ * Find the first prefix a line starts with.
+ *
+ * @param matcher Matcher instance.
+ * @param line AT response line.
+ * @param len Line length.
+ * @returns Value given with the matching prefix's table, zero if none.
+ */
+int at_prefix_match(const struct at_prefix_matcher *matcher, const char *line, size_t len);
+
+/** Maximum number of fields at_fields_parse() splits a line into. */
+#ifndef AT_FIELDS_MAX
+#define AT_FIELDS_MAX 8
+#endif
+
+/** Response line field. Points into the line; not NUL-terminated. */
+struct at_field {
+    const char *str;    /**< Field contents, without the quotes. */
+    size_t len;         /**< Length of str. */
+    long value;         /**< Value of an integer field, zero otherwise. */
+    bool integer;       /**< Field is a decimal integer within int range. */
+    bool quoted;        /**< Field was a quoted string. */
+};
+
+/** Fields of a response line like `+CMD: 1,-2,"a,b"`. */
+struct at_fields {
+    int count;
+    struct at_field field[AT_FIELDS_MAX];
+};
+
+/**
+ * Split a response line into comma-separated fields in a single pass.
+ *
+ * Whitespace around fields is skipped, quoted strings may contain commas and
+ * integers are converted on the way; nothing is copied or allocated.
+ * Fields past AT_FIELDS_MAX are ignored.
+ *
+ * @param fields Parsed fields. Left untouched if the prefix doesn't match.
+ * @param prefix Expected start of the line, e.g. "+CIPRXGET:".
+ * @param line AT response line.
+ * @param len Line length.
+ * @returns Number of fields, or -1 if the line doesn't start with prefix.
+ */
+int at_fields_parse(struct at_fields *fields, const char *prefix, const char *line, size_t len);
+
+/**
+ * Get an integer field.
+ *
+ * @param fields Parsed fields.
+ * @param index Field index.
+ * @param value Set to the field value if it exists and is an integer.
+ * @returns True if value was set.
+ */
+bool at_field_int(const struct at_fields *fields, int index, int *value);
+
 #endif
 
 /* vim: set ts=4 sw=4 et: */
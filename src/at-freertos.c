@@ -7,6 +7,8 @@
  */
 
 #include <attentive/at.h>
+#include <attentive/at-freertos.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -19,19 +21,52 @@
 // Remove once you refactor this out.
 #define AT_COMMAND_LENGTH 80
 
+/* Response buffer size used when the caller doesn't care. */
+#define AT_DEFAULT_BUFFER_SIZE 512
+
+/* Reader task stack depth, in words. */
+#define AT_READER_STACK_SIZE (configMINIMAL_STACK_SIZE * 2)
+
+/* Offset of the parser within in-place storage. */
+#define AT_PARSER_OFFSET ((sizeof(struct at_freertos) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/* Receive ring size; must be a power of two. */
+#define AT_RX_RING_SIZE 512
+#define AT_RX_RING_MASK (AT_RX_RING_SIZE - 1)
+
 struct at_freertos {
     struct at at;
-    int timeout;            /**< Command timeout in seconds. */
+    int timeout;            /**< Command timeout in milliseconds. */
+    bool has_deadline;      /**< Commands must finish by deadline. */
+    TickType_t deadline;
     const char *response;
+    bool overflow;          /**< The response was truncated. */
 
     TaskHandle_t xTask;
     /*SemaphoreHandle_t xMutex;*/
     SemaphoreHandle_t xSem;
+    SemaphoreHandle_t xNotify;      /**< Given by at_notify(). */
+    volatile unsigned int notifications;
     Peripheral_Descriptor_t xUART;
 
+    /* Single producer (UART ISR), single consumer (reader task) ring. The
+     * indices run freely and are masked on access. */
+    uint8_t rx_ring[AT_RX_RING_SIZE];
+    volatile size_t rx_head;        /**< Written by the ISR only. */
+    volatile size_t rx_tail;        /**< Written by the reader task only. */
+    volatile unsigned int rx_dropped; /**< Bytes lost to a full ring. */
+
+#ifdef AT_NO_MALLOC
+    /* Kernel objects live here too; needs configSUPPORT_STATIC_ALLOCATION. */
+    StaticSemaphore_t xSemBuffer;
+    StaticSemaphore_t xNotifyBuffer;
+    StaticTask_t xTaskBuffer;
+    StackType_t xStack[AT_READER_STACK_SIZE];
+#endif
+
+    bool allocated : 1;     /**< Instance is ours to free. */
     bool running : 1;       /**< Reader thread should be running. */
     bool open : 1;          /**< FD is valid. Set/cleared by open()/close(). */
-    bool busy : 1;          /**< FD is in use. Set/cleared by reader thread. */
     bool waiting : 1;       /**< Waiting for response callback to arrive. */
 };
 
@@ -44,14 +79,25 @@ static void handle_response(const char *buf, size_t len, void *arg)
     /* The mutex is held by the reader thread; don't reacquire. */
     priv->response = buf;
     (void) len;
+    priv->overflow = at_parser_overflowed(priv->at.parser);
     priv->waiting = false;
     xSemaphoreGive(priv->xSem);
 }
 
+static void handle_data(const void *data, size_t len, void *arg)
+{
+    struct at *at = (struct at *) arg;
+
+    if (at->data_handler)
+        at->data_handler(data, len, at->data_arg);
+}
+
 static void handle_urc(const char *buf, size_t len, void *arg)
 {
     struct at *at = (struct at *) arg;
 
+    at_stats_urc(&at->stats, buf, len);
+
     /* Forward to caller's URC callback, if any. */
     if (at->cbs->handle_urc)
         at->cbs->handle_urc(buf, len, at->arg);
@@ -73,9 +119,28 @@ static const struct at_parser_callbacks parser_callbacks = {
     .handle_response = handle_response,
     .handle_urc = handle_urc,
     .scan_line = scan_line,
+    .handle_data = handle_data,
 };
 
-struct at *at_alloc_freertos(void)
+static void at_freertos_start(struct at_freertos *priv)
+{
+    /* initialize and start reader thread */
+    priv->running = true;
+    /*priv->xMutex = xSemaphoreCreateBinary();*/
+#ifdef AT_NO_MALLOC
+    priv->xSem = xSemaphoreCreateBinaryStatic(&priv->xSemBuffer);
+    priv->xNotify = xSemaphoreCreateBinaryStatic(&priv->xNotifyBuffer);
+    priv->xTask = xTaskCreateStatic(at_reader_thread, "ATReadTask", AT_READER_STACK_SIZE, priv, 4,
+                                    priv->xStack, &priv->xTaskBuffer);
+#else
+    priv->xSem = xSemaphoreCreateBinary();
+    priv->xNotify = xSemaphoreCreateBinary();
+    xTaskCreate(at_reader_thread, "ATReadTask", AT_READER_STACK_SIZE, priv, 4, &priv->xTask);
+#endif
+}
+
+#ifndef AT_NO_MALLOC
+struct at *at_alloc_freertos(size_t bufsize)
 {
     /* allocate instance */
     struct at_freertos *priv = malloc(sizeof(struct at_freertos));
@@ -83,19 +148,47 @@ struct at *at_alloc_freertos(void)
         return NULL;
     }
     memset(priv, 0, sizeof(struct at_freertos));
+    priv->allocated = true;
 
     /* allocate underlying parser */
-    priv->at.parser = at_parser_alloc(&parser_callbacks, 512, (void *) priv);
+    if (!bufsize)
+        bufsize = AT_DEFAULT_BUFFER_SIZE;
+    priv->at.parser = at_parser_alloc(&parser_callbacks, bufsize, (void *) priv);
     if (!priv->at.parser) {
         free(priv);
         return NULL;
     }
 
-    /* initialize and start reader thread */
-    priv->running = true;
-    /*priv->xMutex = xSemaphoreCreateBinary();*/
-    priv->xSem = xSemaphoreCreateBinary();
-    xTaskCreate(at_reader_thread, "ATReadTask", configMINIMAL_STACK_SIZE * 2, priv, 4, &priv->xTask);
+    at_freertos_start(priv);
+
+    return (struct at *) priv;
+}
+#endif
+
+size_t at_freertos_size(size_t bufsize)
+{
+    if (!bufsize)
+        bufsize = AT_DEFAULT_BUFFER_SIZE;
+    return AT_PARSER_OFFSET + at_parser_size(bufsize);
+}
+
+struct at *at_init_freertos(void *storage, size_t size, size_t bufsize)
+{
+    if (!bufsize)
+        bufsize = AT_DEFAULT_BUFFER_SIZE;
+    if (size < at_freertos_size(bufsize)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct at_freertos *priv = storage;
+    memset(priv, 0, sizeof(struct at_freertos));
+
+    /* the parser goes right behind the instance */
+    priv->at.parser = at_parser_init((char *) storage + AT_PARSER_OFFSET, size - AT_PARSER_OFFSET,
+                                     &parser_callbacks, bufsize, (void *) priv);
+
+    at_freertos_start(priv);
 
     return (struct at *) priv;
 }
@@ -108,12 +201,14 @@ int at_open(struct at *at)
     if(priv->xUART == NULL) {
         return -1;
     } else {
+        /* Reception goes through at_freertos_rx_isr(). */
         FreeRTOS_ioctl(priv->xUART, ioctlUSE_DMA_TX, (void*)0);
-        FreeRTOS_ioctl(priv->xUART, ioctlUSE_CIRCULAR_BUFFER_RX, (void*)512);
         FreeRTOS_ioctl(priv->xUART, ioctlSET_TX_TIMEOUT, (void*)pdMS_TO_TICKS(200));
-        FreeRTOS_ioctl(priv->xUART, ioctlSET_RX_TIMEOUT, (void*)pdMS_TO_TICKS(50));
     }
 
+    /* Start with an empty ring; the ISR doesn't touch it while closed. */
+    priv->rx_tail = priv->rx_head;
+
     priv->open = true;
     /*xSemaphoreGive(priv->xMutex);*/
     xSemaphoreTake(priv->xSem, 0);
@@ -147,8 +242,13 @@ void at_free(struct at *at)
     }
 
     /* free up resources */
-    free(priv->at.parser);
-    free(priv);
+    vSemaphoreDelete(priv->xSem);
+    vSemaphoreDelete(priv->xNotify);
+    at_parser_free(priv->at.parser);
+#ifndef AT_NO_MALLOC
+    if (priv->allocated)
+        free(priv);
+#endif
 }
 
 void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg)
@@ -163,10 +263,23 @@ void at_set_command_scanner(struct at *at, at_line_scanner_t scanner)
 }
 
 void at_set_timeout(struct at *at, int timeout)
+{
+    at_set_timeout_ms(at, timeout * 1000);
+}
+
+void at_set_timeout_ms(struct at *at, int timeout_ms)
 {
     struct at_freertos *priv = (struct at_freertos *) at;
 
-    priv->timeout = timeout;
+    priv->timeout = timeout_ms;
+}
+
+void at_set_deadline(struct at *at, int timeout_ms)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    priv->has_deadline = (timeout_ms != 0);
+    priv->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(timeout_ms);
 }
 
 void at_set_character_handler(struct at *at, at_character_handler_t handler)
@@ -174,12 +287,53 @@ void at_set_character_handler(struct at *at, at_character_handler_t handler)
     at_parser_set_character_handler(at->parser, handler);
 }
 
+void at_set_data_buffer(struct at *at, void *buf, size_t size)
+{
+    at_parser_set_data_buffer(at->parser, buf, size);
+}
+
+void at_set_priority(struct at *at, enum at_priority priority)
+{
+    /* Commands run one at a time, in the order they are issued. */
+    (void) at;
+    (void) priority;
+}
+
 void at_expect_dataprompt(struct at *at)
 {
     at_parser_expect_dataprompt(at->parser);
 }
 
-static const char *_at_command(struct at_freertos *priv, const void *data, size_t size)
+void at_expect_datamode(struct at *at)
+{
+    at_parser_expect_datamode(at->parser);
+}
+
+/**
+ * Write all segments, picking up after short writes. The driver gives up
+ * on a write after its TX timeout, so nothing written at all means the
+ * port is stuck.
+ */
+static bool at_write(struct at_freertos *priv, const struct iovec *iov, int iovcnt)
+{
+    for (int i=0; i<iovcnt; i++) {
+        const uint8_t *p = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            size_t written = FreeRTOS_write(priv->xUART, p, left);
+            if (!written) {
+                errno = ETIMEDOUT;
+                return false;
+            }
+            at_stats_add(&priv->at.stats, tx_bytes, written);
+            p += written;
+            left -= written;
+        }
+    }
+    return true;
+}
+
+static const char *_at_command_iov(struct at_freertos *priv, const struct iovec *iov, int iovcnt)
 {
     /*if(!xSemaphoreTake(priv->xMutex, pdMS_TO_TICKS(1000))) {*/
         /*return NULL;*/
@@ -191,22 +345,41 @@ static const char *_at_command(struct at_freertos *priv, const void *data, size_
         return NULL;
     }
 
+    /* Work out how long to wait, bailing out if that's not at all. */
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = priv->timeout ? pdMS_TO_TICKS(priv->timeout) : portMAX_DELAY;
+    if (priv->has_deadline) {
+        TickType_t left = priv->deadline - start;
+        if (left > portMAX_DELAY / 2) {
+            /* Deadline has passed (tick arithmetic wraps around). */
+            priv->at.command_scanner = NULL;
+            return NULL;
+        }
+        if (left < wait)
+            wait = left;
+    }
+
     /* Prepare parser. */
     at_parser_await_response(priv->at.parser);
 
+    /* Arm the response notification before the response can arrive. */
+    priv->waiting = true;
+    xSemaphoreTake(priv->xSem, 0);
+
     /* Send the command. */
-    // FIXME: handle interrupts, short writes, errors, etc.
-    FreeRTOS_write(priv->xUART, data, size);
+    if (!at_write(priv, iov, iovcnt)) {
+        priv->waiting = false;
+        priv->at.command_scanner = NULL;
+        return NULL;
+    }
 
     /* Wait for the parser thread to collect a response. */
-    priv->waiting = true;
     /*xSemaphoreGive(priv->xMutex);*/
-    xSemaphoreTake(priv->xSem, 0);
-    int timeout = priv->timeout;
-    while (timeout-- && priv->open && priv->waiting) {
-        if (xSemaphoreTake(priv->xSem, pdMS_TO_TICKS(1000))) {
+    while (priv->open && priv->waiting) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (wait != portMAX_DELAY && elapsed >= wait)
             break;
-        }
+        xSemaphoreTake(priv->xSem, wait == portMAX_DELAY ? portMAX_DELAY : wait - elapsed);
     }
 
     /*xSemaphoreTake(priv->xMutex, pdMS_TO_TICKS(1000));*/
@@ -218,11 +391,18 @@ static const char *_at_command(struct at_freertos *priv, const void *data, size_
         /* Timed out waiting for a response. */
         at_parser_reset(priv->at.parser);
         result = NULL;
+    } else if (priv->overflow) {
+        /* Response didn't fit; don't pass on a corrupt one. */
+        result = NULL;
     } else {
         /* Response arrived. */
         result = priv->response;
     }
 
+    at_stats_command(&priv->at.stats, iovcnt ? iov[0].iov_base : NULL, iovcnt ? iov[0].iov_len : 0,
+                     (xTaskGetTickCount() - start) * portTICK_PERIOD_MS * 1000,
+                     priv->open && priv->waiting);
+
     /* Reset per-command settings. */
     priv->at.command_scanner = NULL;
     /*xSemaphoreGive(priv->xMutex);*/
@@ -230,6 +410,12 @@ static const char *_at_command(struct at_freertos *priv, const void *data, size_
     return result;
 }
 
+static const char *_at_command(struct at_freertos *priv, const void *data, size_t size)
+{
+    struct iovec iov = { .iov_base = (void *) data, .iov_len = size };
+    return _at_command_iov(priv, &iov, 1);
+}
+
 const char *at_command(struct at *at, const char *format, ...)
 {
     struct at_freertos *priv = (struct at_freertos *) at;
@@ -264,7 +450,48 @@ const char *at_command_raw(struct at *at, const void *data, size_t size)
     return _at_command(priv, data, size);
 }
 
-bool _at_send(struct at_freertos *priv, const void *data, size_t size)
+const char *at_command_iov(struct at *at, const struct iovec *iov, int iovcnt)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    printf("> [%d segments]\n", iovcnt);
+
+    return _at_command_iov(priv, iov, iovcnt);
+}
+
+int at_command_async(struct at *at, at_command_callback_t cb, void *ctx, const char *format, ...)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    /* Build command string. */
+    va_list ap;
+    va_start(ap, format);
+    char line[AT_COMMAND_LENGTH];
+    int len = vsnprintf(line, sizeof(line)-1, format, ap);
+    va_end(ap);
+
+    /* Bail out if we run out of space. */
+    if (len >= (int)(sizeof(line)-1)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    printf("> %s\n", line);
+
+    /* Append modem-style newline. */
+    line[len++] = '\r';
+
+    /* There's no queue to put it on; run it right away. */
+    errno = 0;
+    const char *response = _at_command(priv, line, len);
+    if (!response && !errno)
+        errno = ETIMEDOUT;
+    cb(response, response ? strlen(response) : 0, ctx);
+
+    return 0;
+}
+
+static bool _at_send_iov(struct at_freertos *priv, const struct iovec *iov, int iovcnt)
 {
     /* Bail out if the channel is closing or closed. */
     if (!priv->open) {
@@ -273,9 +500,13 @@ bool _at_send(struct at_freertos *priv, const void *data, size_t size)
     }
 
     /* Send the command. */
-    // FIXME: handle interrupts, short writes, errors, etc.
-    FreeRTOS_write(priv->xUART, data, size);
-    return true;
+    return at_write(priv, iov, iovcnt);
+}
+
+bool _at_send(struct at_freertos *priv, const void *data, size_t size)
+{
+    struct iovec iov = { .iov_base = (void *) data, .iov_len = size };
+    return _at_send_iov(priv, &iov, 1);
 }
 
 bool at_send(struct at *at, const char *format, ...)
@@ -312,6 +543,125 @@ bool at_send_raw(struct at *at, const void *data, size_t size)
     return _at_send(priv, data, size);
 }
 
+bool at_send_iov(struct at *at, const struct iovec *iov, int iovcnt)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    printf("> [%d segments]\n", iovcnt);
+
+    return _at_send_iov(priv, iov, iovcnt);
+}
+
+int at_command_urgent(struct at *at, const char *format, ...)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    /* Build command string. */
+    va_list ap;
+    va_start(ap, format);
+    char line[AT_COMMAND_LENGTH];
+    int len = vsnprintf(line, sizeof(line)-1, format, ap);
+    va_end(ap);
+
+    /* Bail out if we run out of space. */
+    if (len >= (int)(sizeof(line)-1)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    printf("> %s\n", line);
+
+    /* Append modem-style newline. */
+    line[len++] = '\r';
+
+    /* There's no queue to put it on; write it out right away. */
+    if (!_at_send(priv, line, len)) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+uint32_t at_clock_ms(void)
+{
+    return (uint32_t) xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+#ifdef AT_STATS
+void at_stats_snapshot(struct at *at, struct at_stats *stats)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    /* Counters are bumped from task context only; keep the scheduler off
+     * them while copying. */
+    vTaskSuspendAll();
+    memcpy(stats, &at->stats, sizeof(*stats));
+    stats->truncations = at_parser_overflow_count(at->parser);
+    stats->rx_dropped = priv->rx_dropped;
+    xTaskResumeAll();
+}
+#endif
+
+void at_notify(struct at *at)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    priv->notifications++;
+    xSemaphoreGive(priv->xNotify);
+}
+
+int at_wait(struct at *at, at_wait_condition_t cond, void *arg, int timeout_ms)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+
+    TickType_t start = xTaskGetTickCount();
+    TickType_t wait = pdMS_TO_TICKS(timeout_ms);
+    unsigned int notifications = priv->notifications;
+
+    /* The semaphore only says "something happened"; the condition decides. */
+    for (;;) {
+        if (cond ? cond(arg) : priv->notifications != notifications)
+            return 0;
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= wait)
+            break;
+        xSemaphoreTake(priv->xNotify, wait - elapsed);
+    }
+
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+void at_freertos_rx_isr(struct at *at, const void *data, size_t len)
+{
+    struct at_freertos *priv = (struct at_freertos *) at;
+    const uint8_t *bytes = data;
+
+    if (!priv->open)
+        return;
+
+    /* Copy in whatever fits; excess bytes are lost. */
+    size_t head = priv->rx_head;
+    size_t space = AT_RX_RING_SIZE - (head - priv->rx_tail);
+    if (len > space) {
+        priv->rx_dropped += len - space;
+        len = space;
+    }
+    for (size_t i=0; i<len; i++)
+        priv->rx_ring[(head + i) & AT_RX_RING_MASK] = bytes[i];
+
+    /* Publish the data before moving the head. */
+    __sync_synchronize();
+    priv->rx_head = head + len;
+
+    /* Wake up the reader task. */
+    BaseType_t woken = pdFALSE;
+    if (priv->xTask != NULL)
+        vTaskNotifyGiveFromISR(priv->xTask, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
 void at_reader_thread(void *arg)
 {
     struct at_freertos *priv = (struct at_freertos *)arg;
@@ -319,33 +669,31 @@ void at_reader_thread(void *arg)
 //    printf("at_reader_thread: starting\n");
 
     while (true) {
-        if (!priv->running) {
-            vTaskDelay(pdMS_TO_TICKS(200));
-            continue;
-        }
-        /* Wait for the port descriptor to be valid. */
-        else if(!priv->open) {
-            vTaskDelay(pdMS_TO_TICKS(200));
+        /* Sleep until the ISR has something for us. */
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        if (!priv->running || !priv->open)
             continue;
-        }
 
-        /* Lock access to the port descriptor. */
-        /*xSemaphoreTake(priv->xMutex, pdMS_TO_TICKS(1000));*/
-        priv->busy = true;
+        at_stats_add(&priv->at.stats, wakeups, 1);
 
-        /* Attempt to read some data. */
-        char ch;
-        int result = FreeRTOS_read(priv->xUART, &ch, 1);
+        /* Feed everything there is, in contiguous chunks. */
+        size_t head, tail = priv->rx_tail;
+        while ((head = priv->rx_head) != tail) {
+            __sync_synchronize();
 
-        /* Unlock access to the port descriptor. */
-        priv->busy = false;
-        /* Notify at_close() that the port is now free. */
+            size_t start = tail & AT_RX_RING_MASK;
+            size_t len = head - tail;
+            if (len > AT_RX_RING_SIZE - start)
+                len = AT_RX_RING_SIZE - start;
 
-        if (result == 1) {
-            /* Data received, feed the parser. */
-            at_parser_feed(priv->at.parser, &ch, 1);
+            at_parser_feed(priv->at.parser, priv->rx_ring + start, len);
+            at_stats_add(&priv->at.stats, rx_bytes, len);
+
+            /* Hand the space back to the ISR. */
+            tail += len;
+            priv->rx_tail = tail;
         }
-        /*xSemaphoreGive(priv->xMutex);*/
     }
 
 //    printf("at_reader_thread: finished\n");
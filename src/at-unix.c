@@ -6,12 +6,20 @@
  * published by Sam Hocevar. See the COPYING file for more details.
  */
 
+/* cfsetspeed(), cfmakeraw() and the POSIX clocks. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <attentive/at.h>
+#include <attentive/at-unix.h>
+#include <attentive/cmux.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
-#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -24,34 +32,276 @@
 #include <sys/time.h>
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#ifdef AT_NO_MALLOC
+#error "at-unix queues asynchronous commands on the heap; AT_NO_MALLOC is for embedded targets."
+#endif
+
 // Remove once you refactor this out.
 #define AT_COMMAND_LENGTH 80
 
+/* Maximum number of bytes fetched from the serial port by a single read(). */
+#define AT_READ_BUFFER_SIZE 1024
+
+/* Response buffer size used when the caller doesn't care. */
+#define AT_DEFAULT_BUFFER_SIZE 256
+
+/* Maximum number of events handled by a single epoll_wait(). */
+#define AT_LOOP_MAX_EVENTS 16
+
+/* How long the channel waits for the data following a "> " prompt before
+ * letting other callers in. */
+#define AT_DATAPROMPT_HOLD_MS 1000
+
+/* Baud rate probing: each candidate gets this many "AT"s, this quick. */
+#define AT_AUTOBAUD_ATTEMPTS 2
+#define AT_AUTOBAUD_TIMEOUT_MS 200
+
+/* Longest line in a baud rate cache file. */
+#define AT_AUTOBAUD_LINE_LENGTH 256
+
+/* Multiplexer channels (DLCIs) supported, the control channel included. */
+#define AT_CMUX_CHANNELS 8
+
+/* Information field size used when the caller doesn't care (27.010 N1). */
+#define AT_CMUX_DEFAULT_FRAME_SIZE 31
+
+/* Time to wait for the answer to SABM or DISC (T1), and attempts (N2). */
+#define AT_CMUX_TIMEOUT_MS 1000
+#define AT_CMUX_RETRIES 3
+
+/* Time allowed for the command that starts the multiplexer. */
+#define AT_CMUX_COMMAND_TIMEOUT_MS 5000
+
+/* Segments of caller data gathered into a single frame. */
+#define AT_CMUX_FRAME_SEGMENTS 8
+
+/* Longest control channel command answered. */
+#define AT_CMUX_CONTROL_LENGTH 32
+
+/* Offset of the parser within in-place storage. */
+#define AT_PARSER_OFFSET ((sizeof(struct at_unix) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/**
+ * What a channel keeps for each thread issuing blocking commands on it.
+ * Entries live until the channel is freed; a thread id that gets reused
+ * takes over the old entry.
+ */
+struct at_caller {
+    struct at_caller *next;
+    pthread_t thread;
+
+    char *copy;             /**< Responses handed out by at_command(). */
+    size_t copy_size;
+
+    /* Settings for the thread's commands. Only the thread itself touches
+     * them, so threads sharing the channel can't pick up each other's. */
+    int timeout;            /**< Command timeout in milliseconds. */
+    bool has_deadline;      /**< Commands must finish by deadline. */
+    struct timespec deadline;
+    at_line_scanner_t scanner;  /**< Scanner for the next command. */
+    bool dataprompt;        /**< Next command expects a dataprompt. */
+    bool datamode;          /**< Next command switches to data mode. */
+    void *data_buf;         /**< Data buffer for the next command. */
+    size_t data_size;
+    enum at_priority priority;  /**< Priority of the next command. */
+};
+
+/**
+ * A queued command. Blocking callers keep theirs on the stack; asynchronous
+ * ones are allocated together with a copy of the command.
+ */
+struct at_request {
+    struct at_request *next;
+
+    at_command_callback_t cb;
+    void *ctx;
+    bool allocated;                 /**< Free after completion. */
+    enum at_priority priority;
+    pthread_t owner;                /**< Submitting thread. */
+
+    const struct iovec *iov;
+    int iovcnt;
+    struct iovec line;              /**< Storage for single-buffer commands. */
+
+    /* Per-command settings, captured when the command is queued. */
+    at_line_scanner_t scanner;
+    bool dataprompt;
+    bool datamode;
+    void *data_buf;
+    size_t data_size;
+    int timeout;
+    bool has_deadline;
+    struct timespec deadline;
+#ifdef AT_STATS
+    struct timespec issued;
+#endif
+};
+
 struct at_unix {
     struct at at;
 
     const char *devpath;    /**< Serial port device path. */
     speed_t baudrate;       /**< Serial port baudate. */
 
-    int timeout;            /**< Command timeout in seconds. */
-    const char *response;
+    int timeout;            /**< Timeout of threads that haven't set their own. */
+
+    struct at_loop *loop;   /**< Event loop servicing the channel, if any. */
+    struct at_unix *loop_next;
+    struct at_unix *dead_next;  /**< Next channel the loop or multiplexer is to free. */
+    struct at_cmux *mux;    /**< Multiplexer carrying the channel, if any. */
+    int dlci;
 
-    pthread_t thread;       /**< Reader thread. */
+    pthread_t thread;       /**< Reader thread (or the event loop's). */
     pthread_mutex_t mutex;  /**< Protects variables below and the parser. */
-    pthread_cond_t cond;    /**< For signalling open/busy release. */
+    pthread_cond_t cond;    /**< For signalling open/busy release and completions. */
+    int wakeup[2];          /**< Pipe for interrupting poll() in the reader thread. */
+
+    struct at_request *current;     /**< Command in flight. */
+    struct at_request *queue[AT_PRIORITIES];    /**< Commands waiting to be sent. */
+    struct at_request **queue_tail[AT_PRIORITIES];
+    bool held;                      /**< Prompt answered; holder sends the data. */
+    pthread_t holder;
+    struct timespec held_until;
+    struct timespec expires;        /**< CLOCK_MONOTONIC expiry of current. */
+    bool expiring;                  /**< Current has an expiry time. */
+    bool in_callback;               /**< Completion callback is running. */
+    unsigned int notifications;     /**< Bumped by at_notify(). */
+
+    const char *response;   /**< Response to current, if complete. */
+    size_t response_len;
+    int error;              /**< Non-zero if current failed. */
+
+    struct at_caller *callers;      /**< Per-thread state. */
+
+    int trace;              /**< Trace file descriptor, or -1. */
+    struct timespec trace_start;
 
     int fd;                 /**< Serial port file descriptor. */
-    bool running : 1;       /**< Reader thread should be running. */
+    bool allocated : 1;     /**< Instance is ours to free. */
+    bool running : 1;       /**< Reader thread should be running (or is). */
     bool open : 1;          /**< FD is valid. Set/cleared by open()/close(). */
     bool busy : 1;          /**< FD is in use. Set/cleared by reader thread. */
-    bool waiting : 1;       /**< Waiting for response callback to arrive. */
+    bool lost : 1;          /**< Multiplexer link dropped; pending commands fail next round. */
+    bool done : 1;          /**< Current command has completed. */
+};
+
+/**
+ * Event loop servicing several channels from a single thread.
+ */
+struct at_loop {
+    int epfd;               /**< epoll instance with all open channels. */
+    int wakeup[2];          /**< Pipe for interrupting epoll_wait(). */
+
+    pthread_t thread;       /**< Event loop thread. */
+    pthread_mutex_t mutex;  /**< Protects variables below. */
+    pthread_cond_t cond;    /**< For signalling iteration completion. */
+
+    struct at_unix *channels;
+    struct at_unix *dead;   /**< Freed from the loop thread; gone after the round. */
+    unsigned int iteration; /**< Incremented after each round of events. */
+    bool running;
+};
+
+/**
+ * Link state of a multiplexer channel.
+ */
+enum at_cmux_link {
+    AT_CMUX_DOWN,
+    AT_CMUX_CONNECTING,     /**< SABM sent. */
+    AT_CMUX_UP,
+    AT_CMUX_DISCONNECTING,  /**< DISC sent. */
+};
+
+/**
+ * 27.010 multiplexer. Its thread reads the port and hands the channels
+ * their data; the channels write their own frames.
+ */
+struct at_cmux {
+    const char *devpath;    /**< Serial port device path. */
+    speed_t baudrate;       /**< Serial port baudate. */
+    size_t frame_size;      /**< Longest information field sent or accepted (N1). */
+
+    int fd;                 /**< Serial port file descriptor. */
+    int wakeup[2];          /**< Pipe for interrupting poll(). */
+
+    pthread_t thread;       /**< Multiplexer thread. */
+    pthread_mutex_t mutex;  /**< Protects variables below. */
+    pthread_cond_t cond;    /**< For signalling link state changes. */
+    pthread_mutex_t write_mutex;    /**< Keeps frames in one piece; taken last. */
+
+    struct cmux_decoder decoder;
+    struct at_unix *channels[AT_CMUX_CHANNELS];
+    struct at_unix *dead;   /**< Freed from the multiplexer thread; gone after the round. */
+    unsigned int iteration; /**< Incremented after each round of completions. */
+    enum at_cmux_link link[AT_CMUX_CHANNELS];
+    bool open;              /**< Port is open and the thread started. */
+    bool running;           /**< Thread should be running (or is). */
 };
 
 void *at_reader_thread(void *arg);
+static int at_cmux_writev(struct at_unix *priv, const struct iovec *iov, int iovcnt);
+
+static void gettime(struct timespec *ts)
+{
+#if _POSIX_TIMERS > 0
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    ts->tv_sec = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000;
+#endif
+}
+
+static void timespec_add_ms(struct timespec *ts, int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * Milliseconds from a to b, rounded up.
+ */
+static long long timespec_diff_ms(const struct timespec *a, const struct timespec *b)
+{
+    long long ns = (b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+    return ns > 0 ? (ns + 999999) / 1000000 : ns / 1000000;
+}
+
+static void wake_reader(struct at_unix *priv)
+{
+    /* A full pipe is as good as a written byte. */
+    char ch = 0;
+    if (write(priv->wakeup[1], &ch, 1) == -1) {}
+}
 
-static void handle_sigusr1(int signal)
+/**
+ * Record a chunk of serial traffic. Called with the mutex held.
+ */
+static void at_trace(struct at_unix *priv, const char *dir, const void *data, size_t len)
 {
-    (void)signal;
+    if (priv->trace == -1)
+        return;
+
+    struct timespec now;
+    gettime(&now);
+    long long us = (now.tv_sec - priv->trace_start.tv_sec) * 1000000LL +
+                   (now.tv_nsec - priv->trace_start.tv_nsec) / 1000;
+
+    /* Best effort; a broken trace mustn't break the channel. */
+    char header[48];
+    int n = snprintf(header, sizeof(header), "%lld.%06lld %s %zu\n", us / 1000000, us % 1000000, dir, len);
+    if (write(priv->trace, header, n) == -1 ||
+        write(priv->trace, data, len) == -1 ||
+        write(priv->trace, "\n", 1) == -1) {}
 }
 
 static void handle_response(const char *buf, size_t len, void *arg)
@@ -59,28 +309,43 @@ static void handle_response(const char *buf, size_t len, void *arg)
     struct at_unix *priv = (struct at_unix *) arg;
 
     /* The mutex is held by the reader thread; don't reacquire. */
+    if (!priv->current || priv->done)
+        return;
+
     priv->response = buf;
-    (void) len;
-    priv->waiting = false;
-    pthread_cond_signal(&priv->cond);
+    priv->response_len = len;
+    /* Response didn't fit; don't pass on a corrupt one. */
+    priv->error = at_parser_overflowed(priv->at.parser) ? ENOBUFS : 0;
+    priv->done = true;
 }
 
 static void handle_urc(const char *buf, size_t len, void *arg)
 {
     struct at *at = (struct at *) arg;
 
+    at_stats_urc(&at->stats, buf, len);
+
     /* Forward to caller's URC callback, if any. */
-    if (at->cbs->handle_urc)
+    if (at->cbs && at->cbs->handle_urc)
         at->cbs->handle_urc(buf, len, at->arg);
 }
 
-enum at_response_type scan_line(const char *line, size_t len, void *arg)
+static void handle_data(const void *data, size_t len, void *arg)
 {
     struct at *at = (struct at *) arg;
 
+    if (at->data_handler)
+        at->data_handler(data, len, at->data_arg);
+}
+
+enum at_response_type scan_line(const char *line, size_t len, void *arg)
+{
+    struct at_unix *priv = (struct at_unix *) arg;
+    struct at *at = &priv->at;
+
     enum at_response_type type = AT_RESPONSE_UNKNOWN;
-    if (at->command_scanner)
-        type = at->command_scanner(line, len, at->arg);
+    if (priv->current && priv->current->scanner)
+        type = priv->current->scanner(line, len, at->arg);
     if (!type && at->cbs && at->cbs->scan_line)
         type = at->cbs->scan_line(line, len, at->arg);
     return type;
@@ -90,48 +355,142 @@ static const struct at_parser_callbacks parser_callbacks = {
     .handle_response = handle_response,
     .handle_urc = handle_urc,
     .scan_line = scan_line,
+    .handle_data = handle_data,
 };
 
-struct at *at_alloc_unix(const char *devpath, speed_t baudrate)
+/**
+ * Set up an instance, in storage if given, on the heap otherwise.
+ */
+static struct at_unix *at_unix_alloc(void *storage, size_t size,
+                                     const char *devpath, speed_t baudrate, size_t bufsize)
 {
-    /* allocate instance */
-    struct at_unix *priv = malloc(sizeof(struct at_unix));
-    if (!priv) {
-        errno = ENOMEM;
-        return NULL;
-    }
-    memset(priv, 0, sizeof(struct at_unix));
+    if (!bufsize)
+        bufsize = AT_DEFAULT_BUFFER_SIZE;
+
+    struct at_unix *priv;
+    if (storage) {
+        if (size < at_unix_size(bufsize)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        priv = storage;
+        memset(priv, 0, sizeof(struct at_unix));
 
-    /* allocate underlying parser */
-    priv->at.parser = at_parser_alloc(&parser_callbacks, 256, (void *) priv);
-    if (!priv->at.parser) {
-        free(priv);
-        return NULL;
+        /* the parser goes right behind the instance */
+        priv->at.parser = at_parser_init((char *) storage + AT_PARSER_OFFSET, size - AT_PARSER_OFFSET,
+                                         &parser_callbacks, bufsize, (void *) priv);
+    } else {
+        /* allocate instance */
+        priv = malloc(sizeof(struct at_unix));
+        if (!priv) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        memset(priv, 0, sizeof(struct at_unix));
+        priv->allocated = true;
+
+        /* allocate underlying parser */
+        priv->at.parser = at_parser_alloc(&parser_callbacks, bufsize, (void *) priv);
+        if (!priv->at.parser) {
+            free(priv);
+            return NULL;
+        }
     }
 
     /* copy over device parameters */
     priv->devpath = devpath;
     priv->baudrate = baudrate;
+    for (int i=0; i<AT_PRIORITIES; i++)
+        priv->queue_tail[i] = &priv->queue[i];
+    priv->fd = -1;
+    priv->trace = -1;
 
-    /* install empty SIGUSR1 handler */
-    struct sigaction sa = {
-        .sa_handler = handle_sigusr1,
-    };
-    sigaction(SIGUSR1, &sa, NULL);
-
-    /* initialize and start reader thread */
     priv->running = true;
     pthread_mutex_init(&priv->mutex, NULL);
-    pthread_cond_init(&priv->cond, NULL);
+    /* at_wait() sleeps on the cond; make it use the same clock as gettime(). */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#if _POSIX_TIMERS > 0
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&priv->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return priv;
+}
+
+static void at_unix_free(struct at_unix *priv)
+{
+    pthread_cond_destroy(&priv->cond);
+    pthread_mutex_destroy(&priv->mutex);
+    at_parser_free(priv->at.parser);
+    while (priv->callers) {
+        struct at_caller *caller = priv->callers;
+        priv->callers = caller->next;
+        free(caller->copy);
+        free(caller);
+    }
+    if (priv->allocated)
+        free(priv);
+}
+
+/**
+ * Create a pipe for waking up poll() or epoll_wait().
+ */
+static int wakeup_pipe(int fds[2])
+{
+    if (pipe(fds) == -1)
+        return -1;
+    for (int i=0; i<2; i++)
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+size_t at_unix_size(size_t bufsize)
+{
+    if (!bufsize)
+        bufsize = AT_DEFAULT_BUFFER_SIZE;
+    return AT_PARSER_OFFSET + at_parser_size(bufsize);
+}
+
+static struct at *at_unix_start(struct at_unix *priv)
+{
+    if (!priv)
+        return NULL;
+
+    /* create the reader thread wakeup pipe */
+    if (wakeup_pipe(priv->wakeup) == -1) {
+        at_unix_free(priv);
+        return NULL;
+    }
+
+    /* start reader thread */
     pthread_create(&priv->thread, NULL, at_reader_thread, (void *) priv);
 
     return (struct at *) priv;
 }
 
+struct at *at_alloc_unix(const char *devpath, speed_t baudrate, size_t bufsize)
+{
+    return at_unix_start(at_unix_alloc(NULL, 0, devpath, baudrate, bufsize));
+}
+
+struct at *at_init_unix(void *storage, size_t size, const char *devpath, speed_t baudrate, size_t bufsize)
+{
+    return at_unix_start(at_unix_alloc(storage, size, devpath, baudrate, bufsize));
+}
+
+static int at_cmux_channel_open(struct at_unix *priv);
+static int at_cmux_channel_close(struct at_unix *priv);
+static void at_cmux_sync(struct at_cmux *mux);
+
 int at_open(struct at *at)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
+    if (priv->mux)
+        return at_cmux_channel_open(priv);
+
     pthread_mutex_lock(&priv->mutex);
     if (priv->open) {
         pthread_mutex_unlock(&priv->mutex);
@@ -144,24 +503,169 @@ int at_open(struct at *at)
         return -1;
     }
 
-    if (priv->baudrate) {
-        struct termios attr;
-        tcgetattr(priv->fd, &attr);
-        cfsetspeed(&attr, priv->baudrate);
+    struct termios attr;
+    if (tcgetattr(priv->fd, &attr) == 0) {
+        if (priv->baudrate)
+            cfsetspeed(&attr, priv->baudrate);
+        /* Make read() return as soon as anything arrives, with everything
+         * that is available at that point. */
+        attr.c_cc[VMIN] = 1;
+        attr.c_cc[VTIME] = 0;
         tcsetattr(priv->fd, TCSANOW, &attr);
     }
 
+#ifdef __linux__
+    if (priv->loop) {
+        /* Hand the port over to the event loop. */
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = priv,
+        };
+        if (epoll_ctl(priv->loop->epfd, EPOLL_CTL_ADD, priv->fd, &event) == -1) {
+            int why = errno;
+            close(priv->fd);
+            priv->fd = -1;
+            pthread_mutex_unlock(&priv->mutex);
+            errno = why;
+            return -1;
+        }
+        priv->running = true;
+    }
+#endif
+
     priv->open = true;
-    pthread_cond_signal(&priv->cond);
+    pthread_cond_broadcast(&priv->cond);
     pthread_mutex_unlock(&priv->mutex);
 
     return 0;
 }
 
+#ifdef __linux__
+/**
+ * Wait until the event loop has finished its current round of events.
+ */
+static void at_loop_sync(struct at_loop *loop)
+{
+    /* Callbacks run after the round's events; nothing stale is left. */
+    if (pthread_equal(pthread_self(), loop->thread))
+        return;
+
+    pthread_mutex_lock(&loop->mutex);
+    unsigned int iteration = loop->iteration;
+    if (write(loop->wakeup[1], "", 1) == -1) {}
+    while (loop->running && loop->iteration == iteration)
+        pthread_cond_wait(&loop->cond, &loop->mutex);
+    pthread_mutex_unlock(&loop->mutex);
+}
+#endif
+
+/**
+ * Queue a request behind others of its priority. Called with the mutex held.
+ */
+static void at_enqueue(struct at_unix *priv, struct at_request *req)
+{
+    req->next = NULL;
+    *priv->queue_tail[req->priority] = req;
+    priv->queue_tail[req->priority] = &req->next;
+}
+
+/**
+ * Take the oldest request of the highest priority waiting. Called with the
+ * mutex held.
+ */
+static struct at_request *at_dequeue(struct at_unix *priv)
+{
+    for (int i=0; i<AT_PRIORITIES; i++) {
+        struct at_request **link = &priv->queue[i];
+        struct at_request *req;
+        while ((req = *link)) {
+            /* After a prompt, only its data may go out. */
+            if (!priv->held || pthread_equal(req->owner, priv->holder)) {
+                *link = req->next;
+                if (priv->queue_tail[i] == &req->next)
+                    priv->queue_tail[i] = link;
+                return req;
+            }
+            link = &req->next;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Drop the prompt hold if it has expired. Called with the mutex held.
+ *
+ * @returns Milliseconds until it expires; -1 if the channel isn't held.
+ */
+static int at_hold_left(struct at_unix *priv)
+{
+    if (!priv->held)
+        return -1;
+
+    struct timespec now;
+    gettime(&now);
+    long long ms = timespec_diff_ms(&now, &priv->held_until);
+    if (ms > 0)
+        return ms < INT_MAX ? (int) ms : INT_MAX;
+
+    priv->held = false;
+    return -1;
+}
+
+/**
+ * Complete a request. Called with the mutex held; drops it around the
+ * callback so that it can queue further commands.
+ */
+static void at_complete(struct at_unix *priv, struct at_request *req,
+                        const char *response, size_t len, int error)
+{
+#ifdef AT_STATS
+    struct timespec now;
+    gettime(&now);
+    long long us = (now.tv_sec - req->issued.tv_sec) * 1000000LL +
+                   (now.tv_nsec - req->issued.tv_nsec) / 1000;
+    const struct iovec *first = req->iovcnt ? &req->iov[0] : &(struct iovec) { 0 };
+    at_stats_command(&priv->at.stats, first->iov_base, first->iov_len, us, error == ETIMEDOUT);
+#endif
+
+    priv->in_callback = true;
+    pthread_mutex_unlock(&priv->mutex);
+
+    /* Blocking callers' requests live on their stacks, which may be gone
+     * as soon as the callback has run. */
+    bool allocated = req->allocated;
+
+    errno = error;
+    req->cb(error ? NULL : response, error ? 0 : len, req->ctx);
+    if (allocated)
+        free(req);
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->in_callback = false;
+}
+
+/**
+ * Fail all queued requests. Called with the mutex held.
+ */
+static void at_fail_all(struct at_unix *priv, int error)
+{
+    struct at_request *req = priv->current;
+    priv->current = NULL;
+    priv->held = false;
+    if (req)
+        at_complete(priv, req, NULL, 0, error);
+
+    while ((req = at_dequeue(priv)))
+        at_complete(priv, req, NULL, 0, error);
+}
+
 int at_close(struct at *at)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
+    if (priv->mux)
+        return at_cmux_channel_close(priv);
+
     pthread_mutex_lock(&priv->mutex);
     if (!priv->open) {
         pthread_mutex_unlock(&priv->mutex);
@@ -171,18 +675,34 @@ int at_close(struct at *at)
     /* Mark the port descriptor as invalid. */
     priv->open = false;
 
-    /* Interrupt read() in the reader thread. */
-    pthread_kill(priv->thread, SIGUSR1);
+    /* Interrupt poll() in the reader thread. */
+    wake_reader(priv);
 
     /* Wait for the read operation to complete. */
     while (priv->busy)
         pthread_cond_wait(&priv->cond, &priv->mutex);
 
+#ifdef __linux__
+    if (priv->loop)
+        epoll_ctl(priv->loop->epfd, EPOLL_CTL_DEL, priv->fd, NULL);
+#endif
+
     /* Close the file descriptor. */
     close(priv->fd);
     priv->fd = -1;
 
+    /* Nothing is going to answer pending commands now. */
+    at_parser_reset(priv->at.parser);
+    at_fail_all(priv, ENODEV);
+
     pthread_mutex_unlock(&priv->mutex);
+
+#ifdef __linux__
+    /* Make sure events reported before the removal are gone. */
+    if (priv->loop)
+        at_loop_sync(priv->loop);
+#endif
+
     return 0;
 }
 
@@ -193,20 +713,73 @@ void at_free(struct at *at)
     /* make sure the channel is closed */
     at_close(at);
 
+    if (priv->mux) {
+        /* remove the channel from the multiplexer */
+        struct at_cmux *mux = priv->mux;
+        pthread_mutex_lock(&mux->mutex);
+        mux->channels[priv->dlci] = NULL;
+
+        /* Same as with event loops: from a callback, the multiplexer frees
+         * the channel once the round is over. */
+        if (mux->open && pthread_equal(pthread_self(), mux->thread)) {
+            priv->dead_next = mux->dead;
+            mux->dead = priv;
+            pthread_mutex_unlock(&mux->mutex);
+            return;
+        }
+        pthread_mutex_unlock(&mux->mutex);
+
+        /* Let the multiplexer thread walk past it. */
+        at_cmux_sync(mux);
+
+        at_unix_free(priv);
+        return;
+    }
+
+#ifdef __linux__
+    if (priv->loop) {
+        /* remove the channel from the event loop */
+        struct at_loop *loop = priv->loop;
+        pthread_mutex_lock(&loop->mutex);
+        for (struct at_unix **p = &loop->channels; *p; p = &(*p)->loop_next) {
+            if (*p == priv) {
+                *p = priv->loop_next;
+                break;
+            }
+        }
+
+        /* A callback's own round may still be using the channel; the loop
+         * frees it once the round is over. */
+        if (pthread_equal(pthread_self(), loop->thread)) {
+            priv->dead_next = loop->dead;
+            loop->dead = priv;
+            pthread_mutex_unlock(&loop->mutex);
+            return;
+        }
+        pthread_mutex_unlock(&loop->mutex);
+
+        /* Let the loop walk past it. */
+        at_loop_sync(loop);
+
+        at_unix_free(priv);
+        return;
+    }
+#endif
+
     /* ask the reader thread to terminate */
     pthread_mutex_lock(&priv->mutex);
     priv->running = false;
+    pthread_cond_broadcast(&priv->cond);
     pthread_mutex_unlock(&priv->mutex);
 
     /* wait for the reader thread to terminate */
-    pthread_kill(priv->thread, SIGUSR1);
+    wake_reader(priv);
     pthread_join(priv->thread, NULL);
-    pthread_cond_destroy(&priv->cond);
-    pthread_mutex_destroy(&priv->mutex);
+    close(priv->wakeup[0]);
+    close(priv->wakeup[1]);
 
     /* free up resources */
-    free(priv->at.parser);
-    free(priv);
+    at_unix_free(priv);
 }
 
 void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg)
@@ -215,101 +788,400 @@ void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg)
     at->arg = arg;
 }
 
-void at_set_command_scanner(struct at *at, at_line_scanner_t scanner)
+void at_set_trace_unix(struct at *at, int fd)
 {
-    at->command_scanner = scanner;
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->trace = fd;
+    gettime(&priv->trace_start);
+    pthread_mutex_unlock(&priv->mutex);
 }
 
-void at_set_timeout(struct at *at, int timeout)
+/**
+ * Write all segments to fd, riding out EINTR and short writes. Traffic is
+ * traced and counted on priv, unless it's NULL. Returns 0 or an errno value.
+ */
+static int writev_all(int fd, const struct iovec *iov, int iovcnt, struct at_unix *priv)
 {
-    struct at_unix *priv = (struct at_unix *) at;
-
-    priv->timeout = timeout;
+    /* Position within the vector: segment index and offset into it. */
+    int i = 0;
+    size_t offset = 0;
+
+    for (;;) {
+        /* Zero-length segments would make writev() return 0 forever. */
+        while (i < iovcnt && offset == iov[i].iov_len) {
+            i++;
+            offset = 0;
+        }
+        if (i == iovcnt)
+            return 0;
+
+        /* Finish a partly written segment on its own; the vector is the
+         * caller's and can't be adjusted in place. */
+        ssize_t result;
+        if (offset)
+            result = write(fd, (const char *) iov[i].iov_base + offset,
+                           iov[i].iov_len - offset);
+        else
+            result = writev(fd, iov + i, iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX);
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (result == 0)
+            return EIO;
+
+        if (priv)
+            at_stats_add(&priv->at.stats, tx_bytes, result);
+        for (size_t left = result; left > 0; ) {
+            size_t chunk = iov[i].iov_len - offset;
+            if (chunk > left)
+                chunk = left;
+            if (priv)
+                at_trace(priv, "TX", (const char *) iov[i].iov_base + offset, chunk);
+            offset += chunk;
+            left -= chunk;
+            if (offset == iov[i].iov_len) {
+                i++;
+                offset = 0;
+            }
+        }
+    }
 }
 
-void at_expect_dataprompt(struct at *at)
+/**
+ * Write a command or data to the modem. Called with the mutex held.
+ * Returns 0 or an errno value.
+ */
+static int at_writev(struct at_unix *priv, const struct iovec *iov, int iovcnt)
 {
-    at_parser_expect_dataprompt(at->parser);
+    if (priv->mux)
+        return at_cmux_writev(priv, iov, iovcnt);
+    return writev_all(priv->fd, iov, iovcnt, priv);
 }
 
-static const char *_at_command(struct at_unix *priv, const void *data, size_t size)
+#ifdef AT_STATS
+void at_stats_snapshot(struct at *at, struct at_stats *stats)
 {
+    struct at_unix *priv = (struct at_unix *) at;
+
     pthread_mutex_lock(&priv->mutex);
+    *stats = at->stats;
+    stats->truncations = at_parser_overflow_count(at->parser);
+    pthread_mutex_unlock(&priv->mutex);
+}
+#endif
 
-    /* Bail out if the channel is closing or closed. */
-    if (!priv->open) {
-        pthread_mutex_unlock(&priv->mutex);
-        errno = ENODEV;
-        return NULL;
-    }
+/**
+ * State of the calling thread, created on first use. New threads start out
+ * with the channel's timeout.
+ */
+static struct at_caller *at_caller(struct at_unix *priv)
+{
+    /* URC handlers run with the mutex held by the reader. */
+    bool locked = pthread_equal(pthread_self(), priv->thread) && !priv->in_callback;
+    if (!locked)
+        pthread_mutex_lock(&priv->mutex);
 
-    /* Prepare parser. */
-    at_parser_await_response(priv->at.parser);
+    pthread_t self = pthread_self();
+    struct at_caller *caller;
+    for (caller = priv->callers; caller; caller = caller->next)
+        if (pthread_equal(caller->thread, self))
+            break;
 
-    /* Send the command. */
-    // FIXME: handle interrupts, short writes, errors, etc.
-    write(priv->fd, data, size);
+    if (!caller) {
+        caller = calloc(1, sizeof(struct at_caller));
+        if (caller) {
+            caller->thread = self;
+            caller->timeout = priv->timeout;
+            caller->priority = AT_PRIORITY_CONTROL;
+            caller->next = priv->callers;
+            priv->callers = caller;
+        }
+    }
 
-    /* Wait for the parser thread to collect a response. */
-    priv->waiting = true;
-    if (priv->timeout) {
-        struct timespec ts;
-#if _POSIX_TIMERS > 0
-        clock_gettime(CLOCK_REALTIME, &ts);
-#else
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        ts.tv_sec = tv.tv_sec;
-        ts.tv_nsec = tv.tv_usec * 1000;
-#endif
-        ts.tv_sec += priv->timeout;
+    if (!locked)
+        pthread_mutex_unlock(&priv->mutex);
 
-        while (priv->open && priv->waiting)
-            if (pthread_cond_timedwait(&priv->cond, &priv->mutex, &ts) == ETIMEDOUT)
-                break;
-    } else {
-        while (priv->open && priv->waiting)
-            pthread_cond_wait(&priv->cond, &priv->mutex);
-    }
+    if (!caller)
+        errno = ENOMEM;
+    return caller;
+}
 
-    const char *result;
-    if (!priv->open) {
-        /* The serial port was closed behind our back. */
-        errno = ENODEV;
-        result = NULL;
-    } else if (priv->waiting) {
-        /* Timed out waiting for a response. */
-        at_parser_reset(priv->at.parser);
-        errno = ETIMEDOUT;
-        result = NULL;
-    } else {
-        /* Response arrived. */
-        result = priv->response;
-    }
+void at_set_command_scanner(struct at *at, at_line_scanner_t scanner)
+{
+    struct at_unix *priv = (struct at_unix *) at;
 
-    /* Reset per-command settings. */
-    priv->at.command_scanner = NULL;
+    struct at_caller *caller = at_caller(priv);
+    if (caller)
+        caller->scanner = scanner;
+}
 
-    pthread_mutex_unlock(&priv->mutex);
+void at_set_timeout(struct at *at, int timeout)
+{
+    at_set_timeout_ms(at, timeout * 1000);
+}
 
-    return result;
+void at_set_timeout_ms(struct at *at, int timeout_ms)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Threads that come along later start out with it too. */
+    priv->timeout = timeout_ms;
+    struct at_caller *caller = at_caller(priv);
+    if (caller)
+        caller->timeout = timeout_ms;
 }
 
-const char *at_command(struct at *at, const char *format, ...)
+void at_set_deadline(struct at *at, int timeout_ms)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
-    /* Build command string. */
-    va_list ap;
-    va_start(ap, format);
-    char line[AT_COMMAND_LENGTH];
-    int len = vsnprintf(line, sizeof(line)-1, format, ap);
-    va_end(ap);
+    struct at_caller *caller = at_caller(priv);
+    if (!caller)
+        return;
+    caller->has_deadline = (timeout_ms != 0);
+    if (caller->has_deadline) {
+        gettime(&caller->deadline);
+        timespec_add_ms(&caller->deadline, timeout_ms);
+    }
+}
+
+void at_set_data_buffer(struct at *at, void *buf, size_t size)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    struct at_caller *caller = at_caller(priv);
+    if (caller) {
+        caller->data_buf = buf;
+        caller->data_size = size;
+    }
+}
+
+void at_set_priority(struct at *at, enum at_priority priority)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    struct at_caller *caller = at_caller(priv);
+    if (caller)
+        caller->priority = priority;
+}
+
+void at_expect_dataprompt(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    struct at_caller *caller = at_caller(priv);
+    if (caller)
+        caller->dataprompt = true;
+}
+
+void at_expect_datamode(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    struct at_caller *caller = at_caller(priv);
+    if (caller)
+        caller->datamode = true;
+}
+
+/**
+ * Send the next queued command if the channel is idle. Called with the
+ * mutex held.
+ */
+static void at_dispatch(struct at_unix *priv)
+{
+    if (priv->current || priv->in_callback || !priv->open)
+        return;
+
+    struct at_request *req = at_dequeue(priv);
+    if (!req)
+        return;
+
+    priv->current = req;
+    priv->held = false;
+    priv->done = false;
+
+    /* Don't bother sending it if the deadline has already passed. */
+    struct timespec now;
+    gettime(&now);
+    if (req->has_deadline && timespec_diff_ms(&now, &req->deadline) <= 0) {
+        priv->error = ETIMEDOUT;
+        priv->done = true;
+        wake_reader(priv);
+        return;
+    }
+
+    /* Prepare parser. */
+    if (req->dataprompt)
+        at_parser_expect_dataprompt(priv->at.parser);
+    if (req->datamode)
+        at_parser_expect_datamode(priv->at.parser);
+    if (req->data_buf)
+        at_parser_set_data_buffer(priv->at.parser, req->data_buf, req->data_size);
+    at_parser_await_response(priv->at.parser);
+
+    /* Work out when it expires. */
+    priv->expiring = req->timeout || req->has_deadline;
+    priv->expires = now;
+    timespec_add_ms(&priv->expires, req->timeout);
+    if (req->has_deadline && (!req->timeout ||
+            timespec_diff_ms(&req->deadline, &priv->expires) > 0))
+        priv->expires = req->deadline;
+
+    /* Send the command. */
+    int error = at_writev(priv, req->iov, req->iovcnt);
+    if (error) {
+        priv->error = error;
+        priv->done = true;
+    }
+
+    /* Let the reader thread pick up the new deadline. */
+    wake_reader(priv);
+}
+
+/**
+ * Queue a command. Takes over the calling thread's per-command settings.
+ */
+static int at_submit(struct at_unix *priv, struct at_caller *caller, struct at_request *req)
+{
+    req->priority = caller->priority;
+    req->owner = pthread_self();
+    req->scanner = caller->scanner;
+    req->dataprompt = caller->dataprompt;
+    req->datamode = caller->datamode;
+    req->data_buf = caller->data_buf;
+    req->data_size = caller->data_size;
+    req->timeout = caller->timeout;
+    req->has_deadline = caller->has_deadline;
+    req->deadline = caller->deadline;
+#ifdef AT_STATS
+    gettime(&req->issued);
+#endif
+
+    /* Reset per-command settings. */
+    caller->scanner = NULL;
+    caller->dataprompt = false;
+    caller->datamode = false;
+    caller->data_buf = NULL;
+    caller->data_size = 0;
+    caller->priority = AT_PRIORITY_CONTROL;
+
+    pthread_mutex_lock(&priv->mutex);
+
+    /* Bail out if the channel is closing or closed. */
+    if (!priv->open || !priv->running) {
+        pthread_mutex_unlock(&priv->mutex);
+        errno = ENODEV;
+        return -1;
+    }
+
+    at_enqueue(priv, req);
+    at_dispatch(priv);
+
+    pthread_mutex_unlock(&priv->mutex);
+
+    return 0;
+}
+
+struct at_waiter {
+    struct at_unix *priv;
+    struct at_caller *caller;
+    const char *response;
+    int error;
+    bool done;
+};
+
+static void at_command_done(const char *response, size_t len, void *ctx)
+{
+    struct at_waiter *waiter = ctx;
+    struct at_unix *priv = waiter->priv;
+    struct at_caller *caller = waiter->caller;
+
+    /* The response only lives until the next command is sent; hand out a
+     * copy instead. Each thread gets its own, so one caller's command can't
+     * pull the response from under another. The caller is blocked until
+     * we're done, which makes its buffer ours to touch. */
+    int error = errno;
+    if (response && len >= caller->copy_size) {
+        char *copy = realloc(caller->copy, len + 1);
+        if (copy) {
+            caller->copy = copy;
+            caller->copy_size = len + 1;
+        } else {
+            error = ENOMEM;
+            response = NULL;
+        }
+    }
+    if (response) {
+        memcpy(caller->copy, response, len);
+        caller->copy[len] = '\0';
+    }
+
+    pthread_mutex_lock(&priv->mutex);
+    waiter->response = response ? caller->copy : NULL;
+    waiter->error = error;
+    waiter->done = true;
+    pthread_cond_broadcast(&priv->cond);
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+static const char *_at_command_iov(struct at_unix *priv, const struct iovec *iov, int iovcnt)
+{
+    /* Responses are delivered by the reader thread; it can't wait for one. */
+    if (pthread_equal(pthread_self(), priv->thread)) {
+        errno = EDEADLK;
+        return NULL;
+    }
+
+    /* Fails only if there's no memory; a setting that got lost to that
+     * can't be sent out silently. */
+    struct at_caller *caller = at_caller(priv);
+    if (!caller)
+        return NULL;
+
+    struct at_waiter waiter = {
+        .priv = priv,
+        .caller = caller,
+    };
+    struct at_request req = {
+        .cb = at_command_done,
+        .ctx = &waiter,
+        .iov = iov,
+        .iovcnt = iovcnt,
+    };
+    if (at_submit(priv, caller, &req) == -1)
+        return NULL;
+
+    /* Wait for the reader thread to collect a response or time out. */
+    pthread_mutex_lock(&priv->mutex);
+    while (!waiter.done)
+        pthread_cond_wait(&priv->cond, &priv->mutex);
+    pthread_mutex_unlock(&priv->mutex);
+
+    errno = waiter.error;
+    return waiter.response;
+}
+
+static const char *_at_command(struct at_unix *priv, const void *data, size_t size)
+{
+    struct iovec iov = { .iov_base = (void *) data, .iov_len = size };
+    return _at_command_iov(priv, &iov, 1);
+}
+
+/**
+ * Format a command line. Returns its length or -1 if it doesn't fit.
+ */
+static int at_format(char *line, size_t size, const char *format, va_list ap)
+{
+    int len = vsnprintf(line, size-1, format, ap);
 
     /* Bail out if we run out of space. */
-    if (len >= (int)(sizeof(line)-1)) {
+    if (len >= (int)(size-1)) {
         errno = ENOMEM;
-        return NULL;
+        return -1;
     }
 
     printf("> %s\n", line);
@@ -317,6 +1189,23 @@ const char *at_command(struct at *at, const char *format, ...)
     /* Append modem-style newline. */
     line[len++] = '\r';
 
+    return len;
+}
+
+const char *at_command(struct at *at, const char *format, ...)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Build command string. */
+    va_list ap;
+    va_start(ap, format);
+    char line[AT_COMMAND_LENGTH];
+    int len = at_format(line, sizeof(line), format, ap);
+    va_end(ap);
+
+    if (len == -1)
+        return NULL;
+
     /* Send the command. */
     return _at_command(priv, line, len);
 }
@@ -330,59 +1219,1450 @@ const char *at_command_raw(struct at *at, const void *data, size_t size)
     return _at_command(priv, data, size);
 }
 
+const char *at_command_iov(struct at *at, const struct iovec *iov, int iovcnt)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    printf("> [%d segments]\n", iovcnt);
+
+    return _at_command_iov(priv, iov, iovcnt);
+}
+
+/**
+ * Write data right away, without waiting for a response.
+ */
+static bool _at_send_iov(struct at_unix *priv, const struct iovec *iov, int iovcnt)
+{
+    pthread_mutex_lock(&priv->mutex);
+    int error = priv->open ? at_writev(priv, iov, iovcnt) : ENODEV;
+    pthread_mutex_unlock(&priv->mutex);
+
+    if (error) {
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+static bool _at_send(struct at_unix *priv, const void *data, size_t size)
+{
+    struct iovec iov = { .iov_base = (void *) data, .iov_len = size };
+    return _at_send_iov(priv, &iov, 1);
+}
+
+bool at_send(struct at *at, const char *format, ...)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Build command string. */
+    va_list ap;
+    va_start(ap, format);
+    char line[AT_COMMAND_LENGTH];
+    int len = at_format(line, sizeof(line), format, ap);
+    va_end(ap);
+
+    if (len == -1)
+        return false;
+
+    return _at_send(priv, line, len);
+}
+
+bool at_send_raw(struct at *at, const void *data, size_t size)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    printf("> [%zu bytes]\n", size);
+
+    return _at_send(priv, data, size);
+}
+
+bool at_send_iov(struct at *at, const struct iovec *iov, int iovcnt)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    printf("> [%d segments]\n", iovcnt);
+
+    return _at_send_iov(priv, iov, iovcnt);
+}
+
+int at_command_async(struct at *at, at_command_callback_t cb, void *ctx, const char *format, ...)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Build command string right behind the request. */
+    struct at_request *req = malloc(sizeof(struct at_request) + AT_COMMAND_LENGTH);
+    if (!req) {
+        errno = ENOMEM;
+        return -1;
+    }
+    char *line = (char *) (req + 1);
+
+    va_list ap;
+    va_start(ap, format);
+    int len = at_format(line, AT_COMMAND_LENGTH, format, ap);
+    va_end(ap);
+
+    if (len == -1) {
+        free(req);
+        return -1;
+    }
+
+    req->cb = cb;
+    req->ctx = ctx;
+    req->allocated = true;
+    req->line.iov_base = line;
+    req->line.iov_len = len;
+    req->iov = &req->line;
+    req->iovcnt = 1;
+
+    struct at_caller *caller = at_caller(priv);
+    if (!caller || at_submit(priv, caller, req) == -1) {
+        free(req);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void at_command_urgent_done(const char *response, size_t len, void *ctx)
+{
+    (void) len;
+    (void) ctx;
+
+    if (!response)
+        printf("at_command_urgent: %s\n", strerror(errno));
+}
+
+int at_command_urgent(struct at *at, const char *format, ...)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    struct at_request *req = calloc(1, sizeof(struct at_request) + AT_COMMAND_LENGTH);
+    if (!req) {
+        errno = ENOMEM;
+        return -1;
+    }
+    char *line = (char *) (req + 1);
+
+    va_list ap;
+    va_start(ap, format);
+    int len = at_format(line, AT_COMMAND_LENGTH, format, ap);
+    va_end(ap);
+
+    if (len == -1) {
+        free(req);
+        return -1;
+    }
+
+    /* Per-command settings staged by someone else are left alone. */
+    req->cb = at_command_urgent_done;
+    req->allocated = true;
+    req->priority = AT_PRIORITY_URGENT;
+    req->owner = pthread_self();
+    req->line.iov_base = line;
+    req->line.iov_len = len;
+    req->iov = &req->line;
+    req->iovcnt = 1;
+    req->timeout = priv->timeout;
+#ifdef AT_STATS
+    gettime(&req->issued);
+#endif
+
+    /* URC handlers run with the mutex held by the reader, which sends the
+     * command once the parser is done with the input. Everybody else,
+     * completion callbacks included, has to take it. */
+    bool locked = pthread_equal(pthread_self(), priv->thread) && !priv->in_callback;
+    if (!locked)
+        pthread_mutex_lock(&priv->mutex);
+
+    int error = 0;
+    if (!priv->open || !priv->running) {
+        error = ENODEV;
+    } else {
+        at_enqueue(priv, req);
+        if (!locked)
+            at_dispatch(priv);
+    }
+
+    if (!locked)
+        pthread_mutex_unlock(&priv->mutex);
+
+    if (error) {
+        free(req);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t at_clock_ms(void)
+{
+    struct timespec now;
+    gettime(&now);
+    return (uint32_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void at_notify(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* URC handlers run with the mutex held by the reader; everybody else,
+     * completion callbacks included, has to take it. */
+    bool locked = pthread_equal(pthread_self(), priv->thread) && !priv->in_callback;
+    if (!locked)
+        pthread_mutex_lock(&priv->mutex);
+    priv->notifications++;
+    pthread_cond_broadcast(&priv->cond);
+    if (!locked)
+        pthread_mutex_unlock(&priv->mutex);
+}
+
+int at_wait(struct at *at, at_wait_condition_t cond, void *arg, int timeout_ms)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Notifications come from the reader thread; it can't wait for one. */
+    if (pthread_equal(pthread_self(), priv->thread)) {
+        errno = EDEADLK;
+        return -1;
+    }
+
+    struct timespec expires;
+    gettime(&expires);
+    timespec_add_ms(&expires, timeout_ms);
+
+    pthread_mutex_lock(&priv->mutex);
+    unsigned int notifications = priv->notifications;
+    bool ready, timedout = false;
+    for (;;) {
+        /* Check once more after timing out; it might have just happened. */
+        ready = cond ? cond(arg) : priv->notifications != notifications;
+        if (ready || timedout)
+            break;
+        timedout = pthread_cond_timedwait(&priv->cond, &priv->mutex, &expires) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&priv->mutex);
+
+    if (!ready) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Complete the current command if it got its response or timed out, and
+ * start the next one. Called with the mutex held.
+ *
+ * @returns Milliseconds until the current command times out; -1 if none.
+ */
+static int at_process(struct at_unix *priv)
+{
+    /* Commands queued by URC handlers wait for the parser to be done. */
+    at_hold_left(priv);
+    at_dispatch(priv);
+
+    while (priv->current) {
+        if (!priv->done) {
+            if (!priv->expiring)
+                return -1;
+
+            struct timespec now;
+            gettime(&now);
+            long long ms = timespec_diff_ms(&now, &priv->expires);
+            if (ms > 0)
+                return ms < INT_MAX ? (int) ms : INT_MAX;
+
+            /* Timed out waiting for a response. */
+            at_parser_reset(priv->at.parser);
+            priv->error = ETIMEDOUT;
+            priv->done = true;
+        }
+
+        struct at_request *req = priv->current;
+        priv->current = NULL;
+
+        /* The modem now takes whatever comes next as data; keep other
+         * callers out until the prompting one has sent it. Asynchronous
+         * callers send it from their callback, in the reader thread. */
+        if (req->dataprompt && !priv->error) {
+            priv->held = true;
+            priv->holder = req->cb == at_command_done ? req->owner : priv->thread;
+            gettime(&priv->held_until);
+            timespec_add_ms(&priv->held_until, AT_DATAPROMPT_HOLD_MS);
+        }
+
+        at_complete(priv, req, priv->response, priv->response_len, priv->error);
+
+        /* Move on with the queue. */
+        at_dispatch(priv);
+    }
+
+    return at_hold_left(priv);
+}
+
 void *at_reader_thread(void *arg)
 {
     struct at_unix *priv = (struct at_unix *)arg;
 
     printf("at_reader_thread[%s]: starting\n", priv->devpath);
 
-    while (true) {
-        pthread_mutex_lock(&priv->mutex);
+    /* Reused across reads; the parser copies out whatever it keeps. */
+    char buf[AT_READ_BUFFER_SIZE];
+
+    /* The mutex is held everywhere except around poll() and read(). */
+    pthread_mutex_lock(&priv->mutex);
 
+    while (true) {
         /* Wait for the port descriptor to be valid. */
         while (priv->running && !priv->open)
             pthread_cond_wait(&priv->cond, &priv->mutex);
 
         if (!priv->running) {
             /* Time to die. */
-            pthread_mutex_unlock(&priv->mutex);
             break;
         }
 
+        /* Deliver completions and expire timeouts. */
+        int timeout = at_process(priv);
+        if (!priv->open)
+            continue;
+
         /* Lock access to the port descriptor. */
         priv->busy = true;
         pthread_mutex_unlock(&priv->mutex);
 
-        /* Attempt to read some data. */
-        char ch;
-        int result = read(priv->fd, &ch, 1);
-        int why = errno;
+        /* Wait for data or a wakeup, then drain everything the port has got. */
+        struct pollfd fds[2] = {
+            { .fd = priv->fd, .events = POLLIN },
+            { .fd = priv->wakeup[0], .events = POLLIN },
+        };
+        ssize_t result = -1;
+        int why = EINTR;
+        if (poll(fds, 2, timeout) > 0) {
+            if (fds[1].revents)
+                while (read(priv->wakeup[0], buf, sizeof(buf)) > 0) {}
+            if (fds[0].revents) {
+                result = read(priv->fd, buf, sizeof(buf));
+                why = errno;
+            }
+        }
 
         pthread_mutex_lock(&priv->mutex);
         /* Unlock access to the port descriptor. */
         priv->busy = false;
         /* Notify at_close() that the port is now free. */
-        pthread_cond_signal(&priv->cond);
-        pthread_mutex_unlock(&priv->mutex);
+        pthread_cond_broadcast(&priv->cond);
+
+        if (result > 0) {
+            /* Data received, feed the parser in one go. */
+            at_trace(priv, "RX", buf, result);
+            at_stats_add(&priv->at.stats, wakeups, 1);
+            at_stats_add(&priv->at.stats, rx_bytes, result);
+            at_parser_feed(priv->at.parser, buf, result);
+        } else if (result == -1) {
+            if (why == EINTR || why == EAGAIN)
+                continue;
+            printf("at_reader_thread[%s]: %s\n", priv->devpath, strerror(why));
+            break;
+        } else {
+            printf("at_reader_thread[%s]: received EOF\n", priv->devpath);
+            break;
+        }
+    }
+
+    /* Nobody is going to answer pending commands now. */
+    at_fail_all(priv, priv->running ? EIO : ENODEV);
+    priv->running = false;
+
+    pthread_mutex_unlock(&priv->mutex);
+
+    printf("at_reader_thread[%s]: finished\n", priv->devpath);
+
+    return NULL;
+}
+
+#ifdef __linux__
+
+void *at_loop_thread(void *arg);
+
+struct at_loop *at_loop_alloc(void)
+{
+    struct at_loop *loop = malloc(sizeof(struct at_loop));
+    if (!loop) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(loop, 0, sizeof(struct at_loop));
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        free(loop);
+        return NULL;
+    }
+
+    /* The wakeup pipe is registered with a NULL pointer. */
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = NULL,
+    };
+    if (wakeup_pipe(loop->wakeup) == -1 ||
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakeup[0], &event) == -1) {
+        close(loop->epfd);
+        free(loop);
+        return NULL;
+    }
+
+    loop->running = true;
+    pthread_mutex_init(&loop->mutex, NULL);
+    pthread_cond_init(&loop->cond, NULL);
+    pthread_create(&loop->thread, NULL, at_loop_thread, (void *) loop);
+
+    return loop;
+}
+
+void at_loop_free(struct at_loop *loop)
+{
+    /* ask the loop thread to terminate */
+    pthread_mutex_lock(&loop->mutex);
+    loop->running = false;
+    pthread_mutex_unlock(&loop->mutex);
+
+    /* wait for the loop thread to terminate */
+    if (write(loop->wakeup[1], "", 1) == -1) {}
+    pthread_join(loop->thread, NULL);
+    pthread_cond_destroy(&loop->cond);
+    pthread_mutex_destroy(&loop->mutex);
+
+    /* free up resources */
+    close(loop->wakeup[0]);
+    close(loop->wakeup[1]);
+    close(loop->epfd);
+    free(loop);
+}
+
+struct at *at_alloc_unix_loop(struct at_loop *loop, const char *devpath, speed_t baudrate, size_t bufsize)
+{
+    struct at_unix *priv = at_unix_alloc(NULL, 0, devpath, baudrate, bufsize);
+    if (!priv)
+        return NULL;
+
+    /* Share the loop's thread and wakeup pipe. */
+    priv->loop = loop;
+    priv->thread = loop->thread;
+    priv->wakeup[0] = loop->wakeup[0];
+    priv->wakeup[1] = loop->wakeup[1];
+
+    pthread_mutex_lock(&loop->mutex);
+    priv->loop_next = loop->channels;
+    loop->channels = priv;
+    pthread_mutex_unlock(&loop->mutex);
+
+    return (struct at *) priv;
+}
+
+/**
+ * Read whatever a channel's port has got and feed it to the parser.
+ */
+static void at_loop_read(struct at_unix *priv)
+{
+    char buf[AT_READ_BUFFER_SIZE];
 
-        if (result == 1) {
-            /* Data received, feed the parser. */
+    pthread_mutex_lock(&priv->mutex);
+
+    /* Skip events for channels closed in the meantime. */
+    if (priv->open && priv->running) {
+        /* The port is readable, so this doesn't block. What's left over is
+         * reported again by the (level-triggered) next round. */
+        ssize_t result = read(priv->fd, buf, sizeof(buf));
+        if (result > 0) {
+            at_trace(priv, "RX", buf, result);
+            at_stats_add(&priv->at.stats, wakeups, 1);
+            at_stats_add(&priv->at.stats, rx_bytes, result);
+            at_parser_feed(priv->at.parser, buf, result);
+        } else if (result == 0 || (errno != EINTR && errno != EAGAIN)) {
+            printf("at_loop_thread[%s]: %s\n", priv->devpath,
+                   result ? strerror(errno) : "received EOF");
+
+            /* Stop listening; at_close() takes care of the rest. */
+            epoll_ctl(priv->loop->epfd, EPOLL_CTL_DEL, priv->fd, NULL);
+            priv->running = false;
+            at_fail_all(priv, EIO);
+        }
+    }
+
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+/**
+ * Free the channels at_free() left to the loop thread.
+ */
+static void at_loop_bury(struct at_loop *loop)
+{
+    pthread_mutex_lock(&loop->mutex);
+    struct at_unix *dead = loop->dead;
+    loop->dead = NULL;
+    pthread_mutex_unlock(&loop->mutex);
+
+    while (dead) {
+        struct at_unix *priv = dead;
+        dead = priv->dead_next;
+        at_unix_free(priv);
+    }
+}
+
+void *at_loop_thread(void *arg)
+{
+    struct at_loop *loop = (struct at_loop *) arg;
+
+    printf("at_loop_thread: starting\n");
+
+    struct epoll_event events[AT_LOOP_MAX_EVENTS];
+    char buf[64];
+
+    /* The loop mutex only guards the loop's own fields: callbacks are free
+     * to open, close, allocate and free channels, without deadlocking on
+     * it. Channels freed meanwhile stay around until the round is over. */
+    while (true) {
+        /* Deliver completions and expire timeouts. With a few dozen channels
+         * scanning them all is cheaper than maintaining a timer structure. */
+        int timeout = -1;
+        pthread_mutex_lock(&loop->mutex);
+        struct at_unix *priv = loop->channels;
+        while (priv) {
+            pthread_mutex_unlock(&loop->mutex);
             pthread_mutex_lock(&priv->mutex);
-            at_parser_feed(priv->at.parser, &ch, 1);
+            int left = at_process(priv);
             pthread_mutex_unlock(&priv->mutex);
-        } else if (result == -1) {
-            printf("at_reader_thread[%s]: %s\n", priv->devpath, strerror(why));
-            if (why == EINTR)
-                continue;
+            if (left != -1 && (timeout == -1 || left < timeout))
+                timeout = left;
+            pthread_mutex_lock(&loop->mutex);
+            priv = priv->loop_next;
+        }
+        pthread_mutex_unlock(&loop->mutex);
+
+        at_loop_bury(loop);
+
+        /* Let at_loop_sync() know that the round is over; once the loop
+         * is stopping, that releases everyone. */
+        pthread_mutex_lock(&loop->mutex);
+        loop->iteration++;
+        pthread_cond_broadcast(&loop->cond);
+        bool running = loop->running;
+        pthread_mutex_unlock(&loop->mutex);
+        if (!running)
+            break;
+
+        int count = epoll_wait(loop->epfd, events, AT_LOOP_MAX_EVENTS, timeout);
+
+        for (int i=0; i<count; i++) {
+            struct at_unix *priv = events[i].data.ptr;
+            if (priv)
+                at_loop_read(priv);
             else
+                while (read(loop->wakeup[0], buf, sizeof(buf)) > 0) {}
+        }
+    }
+
+    printf("at_loop_thread: finished\n");
+
+    return NULL;
+}
+
+#endif
+
+/*
+ * Baud rate detection.
+ */
+
+static const struct {
+    speed_t speed;
+    unsigned long rate;
+} at_speeds[] = {
+    { B1200, 1200 },
+    { B2400, 2400 },
+    { B4800, 4800 },
+    { B9600, 9600 },
+    { B19200, 19200 },
+    { B38400, 38400 },
+    { B57600, 57600 },
+    { B115200, 115200 },
+    { B230400, 230400 },
+#ifdef B460800
+    { B460800, 460800 },
+#endif
+#ifdef B921600
+    { B921600, 921600 },
+#endif
+};
+
+#define AT_SPEEDS (sizeof(at_speeds) / sizeof(at_speeds[0]))
+
+static unsigned long at_speed_rate(speed_t speed)
+{
+    for (size_t i=0; i<AT_SPEEDS; i++)
+        if (at_speeds[i].speed == speed)
+            return at_speeds[i].rate;
+    return 0;
+}
+
+static speed_t at_rate_speed(unsigned long rate)
+{
+    for (size_t i=0; i<AT_SPEEDS; i++)
+        if (at_speeds[i].rate == rate)
+            return at_speeds[i].speed;
+    return 0;
+}
+
+int at_set_baudrate_unix(struct at *at, speed_t baudrate)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    if (priv->mux) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->baudrate = baudrate;
+
+    int result = 0;
+    if (priv->open) {
+        struct termios attr;
+        result = tcgetattr(priv->fd, &attr);
+        if (result == 0) {
+            cfsetspeed(&attr, baudrate);
+            /* Whatever came in at the old rate is noise at the new one. */
+            result = tcsetattr(priv->fd, TCSAFLUSH, &attr);
+        }
+        if (result == 0 && !priv->current)
+            at_parser_reset(priv->at.parser);
+    }
+    int error = errno;
+    pthread_mutex_unlock(&priv->mutex);
+
+    errno = error;
+    return result;
+}
+
+/**
+ * Try a baud rate: does anything answer "AT" at it?
+ */
+static bool at_probe_speed(struct at_unix *priv, speed_t speed)
+{
+    if (at_set_baudrate_unix(&priv->at, speed) == -1)
+        return false;
+
+    /* The first command after a change can be eaten by an autobauding
+     * modem syncing up. */
+    for (int i=0; i<AT_AUTOBAUD_ATTEMPTS; i++)
+        if (at_command(&priv->at, "AT"))
+            return true;
+
+    return false;
+}
+
+/**
+ * Look devpath up in the cache file. Returns 0 if it isn't there.
+ */
+static speed_t at_cache_read(const char *cache, const char *devpath)
+{
+    FILE *file = fopen(cache, "r");
+    if (!file)
+        return 0;
+
+    char line[AT_AUTOBAUD_LINE_LENGTH];
+    char path[AT_AUTOBAUD_LINE_LENGTH];
+    unsigned long rate;
+    speed_t speed = 0;
+    while (!speed && fgets(line, sizeof(line), file))
+        if (sscanf(line, "%s %lu", path, &rate) == 2 && !strcmp(path, devpath))
+            speed = at_rate_speed(rate);
+
+    fclose(file);
+    return speed;
+}
+
+/* Channels probed side by side share the cache file and its temporary. */
+static pthread_mutex_t at_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Record the rate for devpath in the cache file, replacing any older entry.
+ * The file is rewritten as a whole so it's never seen half-done.
+ */
+static int at_cache_rewrite(const char *cache, const char *devpath, unsigned long rate)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", cache) >= (int) sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    FILE *out = fopen(tmp, "w");
+    if (!out)
+        return -1;
+
+    FILE *in = fopen(cache, "r");
+    if (in) {
+        char line[AT_AUTOBAUD_LINE_LENGTH];
+        char path[AT_AUTOBAUD_LINE_LENGTH];
+        while (fgets(line, sizeof(line), in))
+            if (sscanf(line, "%s", path) != 1 || strcmp(path, devpath))
+                fputs(line, out);
+        fclose(in);
+    }
+    fprintf(out, "%s %lu\n", devpath, rate);
+
+    if (fclose(out) != 0 || rename(tmp, cache) == -1) {
+        int error = errno;
+        unlink(tmp);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static int at_cache_write(const char *cache, const char *devpath, unsigned long rate)
+{
+    pthread_mutex_lock(&at_cache_mutex);
+    int result = at_cache_rewrite(cache, devpath, rate);
+    int error = errno;
+    pthread_mutex_unlock(&at_cache_mutex);
+    errno = error;
+    return result;
+}
+
+speed_t at_autobaud_unix(struct at *at, const speed_t *candidates, const char *cache)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    struct at_caller *caller = at_caller(priv);
+    if (!caller)
+        return 0;
+    int timeout = caller->timeout;
+    caller->timeout = AT_AUTOBAUD_TIMEOUT_MS;
+
+    /* Last boot's rate first; the modem has most likely kept it. */
+    speed_t cached = cache ? at_cache_read(cache, priv->devpath) : 0;
+    speed_t found = 0;
+    if (cached && at_probe_speed(priv, cached))
+        found = cached;
+    for (const speed_t *speed = candidates; !found && *speed; speed++)
+        if (*speed != cached && at_probe_speed(priv, *speed))
+            found = *speed;
+
+    caller->timeout = timeout;
+
+    if (!found) {
+        errno = ETIMEDOUT;
+        return 0;
+    }
+
+    if (found != cached) {
+        /* Stop the modem from autobauding, so it talks at this rate right
+         * from power-up, and remember that for next time. */
+        unsigned long rate = at_speed_rate(found);
+        if (!at_command(at, "AT+IPR=%lu", rate) || !at_command(at, "AT&W"))
+            printf("at_autobaud_unix[%s]: can't lock the rate: %s\n", priv->devpath, strerror(errno));
+        else if (cache && at_cache_write(cache, priv->devpath, rate) == -1)
+            printf("at_autobaud_unix[%s]: can't update %s: %s\n", priv->devpath, cache, strerror(errno));
+    }
+
+    return found;
+}
+
+int at_autobaud_probe_unix(struct at *at, void *arg)
+{
+    const struct at_autobaud *autobaud = arg;
+
+    return at_autobaud_unix(at, autobaud->candidates, autobaud->cache) ? 0 : -1;
+}
+
+/*
+ * 27.010 multiplexer.
+ */
+
+void *at_cmux_thread(void *arg);
+
+/**
+ * Send a frame. Returns 0 or an errno value.
+ */
+static int at_cmux_frame(struct at_cmux *mux, int dlci, uint8_t control, const void *data, size_t len)
+{
+    uint8_t header[CMUX_HEADER_MAX], trailer[CMUX_TRAILER_SIZE];
+    struct iovec iov[3] = {
+        { .iov_base = header },
+        { .iov_base = (void *) data, .iov_len = len },
+        { .iov_base = trailer, .iov_len = sizeof(trailer) },
+    };
+    iov[0].iov_len = cmux_encode_header(header, trailer, dlci, control, len);
+
+    pthread_mutex_lock(&mux->write_mutex);
+    int error = writev_all(mux->fd, iov, 3, NULL);
+    pthread_mutex_unlock(&mux->write_mutex);
+
+    return error;
+}
+
+/**
+ * Split data into frames for a channel. Called with the channel's mutex
+ * held. Returns 0 or an errno value.
+ */
+static int at_cmux_writev(struct at_unix *priv, const struct iovec *iov, int iovcnt)
+{
+    struct at_cmux *mux = priv->mux;
+
+    /* Position within the vector: segment index and offset into it. */
+    int i = 0;
+    size_t offset = 0;
+
+    while (i < iovcnt) {
+        /* Gather up to a frame's worth of data in place. */
+        struct iovec frame[AT_CMUX_FRAME_SEGMENTS + 2];
+        int n = 1;
+        size_t len = 0;
+        while (i < iovcnt && n <= AT_CMUX_FRAME_SEGMENTS && len < mux->frame_size) {
+            size_t chunk = iov[i].iov_len - offset;
+            if (chunk > mux->frame_size - len)
+                chunk = mux->frame_size - len;
+            if (chunk) {
+                frame[n].iov_base = (char *) iov[i].iov_base + offset;
+                frame[n].iov_len = chunk;
+                n++;
+                len += chunk;
+                offset += chunk;
+            }
+            if (offset == iov[i].iov_len) {
+                i++;
+                offset = 0;
+            }
+        }
+        if (!len)
+            break;
+
+        uint8_t header[CMUX_HEADER_MAX], trailer[CMUX_TRAILER_SIZE];
+        frame[0].iov_base = header;
+        frame[0].iov_len = cmux_encode_header(header, trailer, priv->dlci, CMUX_UIH, len);
+        frame[n].iov_base = trailer;
+        frame[n].iov_len = sizeof(trailer);
+
+        pthread_mutex_lock(&mux->write_mutex);
+        int error = writev_all(mux->fd, frame, n + 1, NULL);
+        pthread_mutex_unlock(&mux->write_mutex);
+        if (error)
+            return error;
+
+        /* The channel's trace shows what it sent, not the framing. */
+        at_stats_add(&priv->at.stats, tx_bytes, len);
+        for (int j=1; j<n; j++)
+            at_trace(priv, "TX", frame[j].iov_base, frame[j].iov_len);
+    }
+
+    return 0;
+}
+
+/**
+ * Bring a channel's link up or down. Called with the multiplexer's mutex
+ * held.
+ */
+static int at_cmux_link(struct at_cmux *mux, int dlci, bool up)
+{
+    enum at_cmux_link want = up ? AT_CMUX_UP : AT_CMUX_DOWN;
+
+    for (int i=0; i<AT_CMUX_RETRIES && mux->running; i++) {
+        if (mux->link[dlci] == want)
+            return 0;
+
+        mux->link[dlci] = up ? AT_CMUX_CONNECTING : AT_CMUX_DISCONNECTING;
+        int error = at_cmux_frame(mux, dlci, (up ? CMUX_SABM : CMUX_DISC) | CMUX_PF, NULL, 0);
+        if (error) {
+            mux->link[dlci] = AT_CMUX_DOWN;
+            errno = error;
+            return -1;
+        }
+
+        struct timespec expires;
+        gettime(&expires);
+        timespec_add_ms(&expires, AT_CMUX_TIMEOUT_MS);
+        while (mux->running && (mux->link[dlci] == AT_CMUX_CONNECTING ||
+                                mux->link[dlci] == AT_CMUX_DISCONNECTING))
+            if (pthread_cond_timedwait(&mux->cond, &mux->mutex, &expires) == ETIMEDOUT)
                 break;
+
+        if (mux->link[dlci] == want)
+            return 0;
+        if (mux->link[dlci] == AT_CMUX_DOWN) {
+            /* Answered with DM. */
+            errno = ECONNREFUSED;
+            return -1;
+        }
+    }
+
+    mux->link[dlci] = AT_CMUX_DOWN;
+    errno = mux->running ? ETIMEDOUT : EIO;
+    return -1;
+}
+
+/**
+ * A channel's link went down on the modem's side. Called with the
+ * multiplexer's mutex held.
+ */
+static void at_cmux_lost(struct at_cmux *mux, int dlci)
+{
+    struct at_unix *priv = mux->channels[dlci];
+
+    mux->link[dlci] = AT_CMUX_DOWN;
+    pthread_cond_broadcast(&mux->cond);
+    if (!priv)
+        return;
+
+    /* Nobody is going to answer pending commands now. They're failed by
+     * the next round, without our mutex; at_close() takes care of the
+     * rest. */
+    pthread_mutex_lock(&priv->mutex);
+    if (priv->open && priv->running) {
+        priv->running = false;
+        priv->lost = true;
+        at_parser_reset(priv->at.parser);
+    }
+    pthread_mutex_unlock(&priv->mutex);
+    if (write(mux->wakeup[1], "", 1) == -1) {}
+}
+
+/**
+ * Handle a control channel message. Called with the multiplexer's mutex
+ * held.
+ */
+static void at_cmux_control(struct at_cmux *mux, const uint8_t *data, size_t len)
+{
+    if (len < 2)
+        return;
+
+    if (!(data[0] & CMUX_MSG_CR)) {
+        /* Responses need no action, except for our close down. */
+        if (data[0] == CMUX_MSG_CLD) {
+            mux->link[0] = AT_CMUX_DOWN;
+            pthread_cond_broadcast(&mux->cond);
+        }
+        return;
+    }
+
+    /* Commands are answered with a copy, C/R cleared. That's right for
+     * modem status, test and flow control alike. Flow control itself isn't
+     * enforced; commands are small and the modems don't send it unasked. */
+    uint8_t reply[AT_CMUX_CONTROL_LENGTH];
+    if (len > sizeof(reply))
+        len = sizeof(reply);
+    memcpy(reply, data, len);
+    reply[0] &= ~CMUX_MSG_CR;
+    at_cmux_frame(mux, 0, CMUX_UIH, reply, len);
+
+    if (reply[0] == CMUX_MSG_CLD)
+        for (int dlci=0; dlci<AT_CMUX_CHANNELS; dlci++)
+            at_cmux_lost(mux, dlci);
+}
+
+/**
+ * Pass on data received for a channel. Called without the multiplexer's
+ * mutex, so that URC handlers can use it.
+ */
+static void at_cmux_deliver(struct at_cmux *mux, int dlci, const uint8_t *data, size_t len)
+{
+    pthread_mutex_lock(&mux->mutex);
+    struct at_unix *priv = mux->channels[dlci];
+    pthread_mutex_unlock(&mux->mutex);
+    if (!priv)
+        return;
+
+    pthread_mutex_lock(&priv->mutex);
+    if (priv->open && priv->running) {
+        at_trace(priv, "RX", data, len);
+        at_stats_add(&priv->at.stats, wakeups, 1);
+        at_stats_add(&priv->at.stats, rx_bytes, len);
+        at_parser_feed(priv->at.parser, data, len);
+    }
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+static void at_cmux_handle_frame(int dlci, uint8_t control, const uint8_t *data, size_t len, void *arg)
+{
+    struct at_cmux *mux = arg;
+
+    if (dlci >= AT_CMUX_CHANNELS)
+        return;
+
+    if (dlci != 0 && ((control & ~CMUX_PF) == CMUX_UIH || (control & ~CMUX_PF) == CMUX_UI)) {
+        at_cmux_deliver(mux, dlci, data, len);
+        return;
+    }
+
+    pthread_mutex_lock(&mux->mutex);
+
+    switch (control & ~CMUX_PF) {
+        case CMUX_UA: {
+            if (mux->link[dlci] == AT_CMUX_CONNECTING)
+                mux->link[dlci] = AT_CMUX_UP;
+            else if (mux->link[dlci] == AT_CMUX_DISCONNECTING)
+                mux->link[dlci] = AT_CMUX_DOWN;
+            pthread_cond_broadcast(&mux->cond);
+        } break;
+
+        case CMUX_DM: {
+            at_cmux_lost(mux, dlci);
+        } break;
+
+        case CMUX_DISC: {
+            at_cmux_frame(mux, dlci, CMUX_UA | CMUX_PF, NULL, 0);
+            if (dlci == 0) {
+                /* Same as a close down. */
+                for (int i=0; i<AT_CMUX_CHANNELS; i++)
+                    at_cmux_lost(mux, i);
+            } else {
+                at_cmux_lost(mux, dlci);
+            }
+        } break;
+
+        case CMUX_SABM: {
+            /* Channels are only ever opened from this side. */
+            at_cmux_frame(mux, dlci, CMUX_DM | CMUX_PF, NULL, 0);
+        } break;
+
+        case CMUX_UIH:
+        case CMUX_UI: {
+            at_cmux_control(mux, data, len);
+        } break;
+    }
+
+    pthread_mutex_unlock(&mux->mutex);
+}
+
+struct at_cmux *at_cmux_alloc(const char *devpath, speed_t baudrate, size_t frame_size)
+{
+    if (!frame_size)
+        frame_size = AT_CMUX_DEFAULT_FRAME_SIZE;
+    if (frame_size > CMUX_DATA_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct at_cmux *mux = malloc(sizeof(struct at_cmux));
+    if (!mux) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(mux, 0, sizeof(struct at_cmux));
+
+    void *buf = malloc(frame_size);
+    if (!buf || wakeup_pipe(mux->wakeup) == -1) {
+        free(buf);
+        free(mux);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    mux->devpath = devpath;
+    mux->baudrate = baudrate;
+    mux->frame_size = frame_size;
+    mux->fd = -1;
+    cmux_decoder_init(&mux->decoder, buf, frame_size, at_cmux_handle_frame, mux);
+
+    pthread_mutex_init(&mux->mutex, NULL);
+    pthread_mutex_init(&mux->write_mutex, NULL);
+    /* Link timeouts use the same clock as gettime(). */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#if _POSIX_TIMERS > 0
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&mux->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return mux;
+}
+
+/**
+ * Send the command that switches the modem to multiplexer mode and wait
+ * for its OK. Returns 0 or -1 and sets errno.
+ */
+static int at_cmux_start(struct at_cmux *mux, const char *command)
+{
+    struct iovec iov[2] = {
+        { .iov_base = (void *) command, .iov_len = strlen(command) },
+        { .iov_base = "\r", .iov_len = 1 },
+    };
+    int error = writev_all(mux->fd, iov, 2, NULL);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+
+    struct timespec expires;
+    gettime(&expires);
+    timespec_add_ms(&expires, AT_CMUX_COMMAND_TIMEOUT_MS);
+
+    /* The echo, if any, comes first; only the tail matters. */
+    char buf[128];
+    size_t len = 0;
+    for (;;) {
+        struct timespec now;
+        gettime(&now);
+        long long timeout = timespec_diff_ms(&now, &expires);
+        struct pollfd fds = { .fd = mux->fd, .events = POLLIN };
+        if (timeout <= 0 || poll(&fds, 1, timeout) == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        if (len == sizeof(buf) - 1) {
+            memmove(buf, buf + len / 2, len - len / 2);
+            len -= len / 2;
+        }
+        ssize_t result = read(mux->fd, buf + len, sizeof(buf) - 1 - len);
+        if (result == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (result <= 0) {
+            errno = result ? errno : EIO;
+            return -1;
+        }
+        len += result;
+        buf[len] = '\0';
+
+        if (strstr(buf, "\nOK\r"))
+            return 0;
+        if (strstr(buf, "ERROR")) {
+            errno = EPROTO;
+            return -1;
+        }
+    }
+}
+
+int at_cmux_open(struct at_cmux *mux, const char *command)
+{
+    pthread_mutex_lock(&mux->mutex);
+    if (mux->open) {
+        pthread_mutex_unlock(&mux->mutex);
+        return 0;
+    }
+
+    mux->fd = open(mux->devpath, O_RDWR);
+    if (mux->fd == -1) {
+        pthread_mutex_unlock(&mux->mutex);
+        return -1;
+    }
+
+    /* Frames are binary; nothing may be translated. */
+    struct termios attr;
+    if (tcgetattr(mux->fd, &attr) == 0) {
+        cfmakeraw(&attr);
+        if (mux->baudrate)
+            cfsetspeed(&attr, mux->baudrate);
+        attr.c_cc[VMIN] = 1;
+        attr.c_cc[VTIME] = 0;
+        tcsetattr(mux->fd, TCSANOW, &attr);
+    }
+
+    if (command && at_cmux_start(mux, command) == -1) {
+        int why = errno;
+        close(mux->fd);
+        mux->fd = -1;
+        pthread_mutex_unlock(&mux->mutex);
+        errno = why;
+        return -1;
+    }
+
+    /* Start the thread, then the control channel. */
+    cmux_decoder_init(&mux->decoder, mux->decoder.buf, mux->frame_size, at_cmux_handle_frame, mux);
+    mux->running = true;
+    mux->open = true;
+    pthread_create(&mux->thread, NULL, at_cmux_thread, (void *) mux);
+    int result = at_cmux_link(mux, 0, true);
+    pthread_mutex_unlock(&mux->mutex);
+
+    if (result == -1) {
+        int why = errno;
+        at_cmux_close(mux);
+        errno = why;
+    }
+    return result;
+}
+
+int at_cmux_close(struct at_cmux *mux)
+{
+    pthread_mutex_lock(&mux->mutex);
+    if (!mux->open) {
+        pthread_mutex_unlock(&mux->mutex);
+        return 0;
+    }
+
+    /* Return the modem to command mode; best effort. */
+    if (mux->link[0] == AT_CMUX_UP)
+        at_cmux_link(mux, 0, false);
+    for (int dlci=0; dlci<AT_CMUX_CHANNELS; dlci++)
+        at_cmux_lost(mux, dlci);
+
+    /* ask the thread to terminate */
+    mux->running = false;
+    pthread_mutex_unlock(&mux->mutex);
+
+    /* wait for the thread to terminate */
+    if (write(mux->wakeup[1], "", 1) == -1) {}
+    pthread_join(mux->thread, NULL);
+
+    pthread_mutex_lock(&mux->mutex);
+    close(mux->fd);
+    mux->fd = -1;
+    mux->open = false;
+    pthread_mutex_unlock(&mux->mutex);
+
+    return 0;
+}
+
+void at_cmux_free(struct at_cmux *mux)
+{
+    at_cmux_close(mux);
+
+    pthread_cond_destroy(&mux->cond);
+    pthread_mutex_destroy(&mux->write_mutex);
+    pthread_mutex_destroy(&mux->mutex);
+    close(mux->wakeup[0]);
+    close(mux->wakeup[1]);
+    free(mux->decoder.buf);
+    free(mux);
+}
+
+struct at *at_alloc_unix_cmux(struct at_cmux *mux, int dlci, size_t bufsize)
+{
+    if (dlci < 1 || dlci >= AT_CMUX_CHANNELS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct at_unix *priv = at_unix_alloc(NULL, 0, mux->devpath, 0, bufsize);
+    if (!priv)
+        return NULL;
+
+    /* Share the multiplexer's wakeup pipe; the thread is known once the
+     * multiplexer is open. */
+    priv->mux = mux;
+    priv->dlci = dlci;
+    priv->wakeup[0] = mux->wakeup[0];
+    priv->wakeup[1] = mux->wakeup[1];
+
+    pthread_mutex_lock(&mux->mutex);
+    if (mux->channels[dlci]) {
+        pthread_mutex_unlock(&mux->mutex);
+        at_unix_free(priv);
+        errno = EBUSY;
+        return NULL;
+    }
+    mux->channels[dlci] = priv;
+    pthread_mutex_unlock(&mux->mutex);
+
+    return (struct at *) priv;
+}
+
+static int at_cmux_channel_open(struct at_unix *priv)
+{
+    struct at_cmux *mux = priv->mux;
+
+    pthread_mutex_lock(&mux->mutex);
+    if (!mux->running) {
+        pthread_mutex_unlock(&mux->mutex);
+        errno = ENODEV;
+        return -1;
+    }
+
+    /* The modem's answer comes through the multiplexer thread. */
+    if (pthread_equal(pthread_self(), mux->thread)) {
+        pthread_mutex_unlock(&mux->mutex);
+        errno = EDEADLK;
+        return -1;
+    }
+
+    pthread_mutex_lock(&priv->mutex);
+    bool open = priv->open && priv->running;
+    pthread_mutex_unlock(&priv->mutex);
+    if (open) {
+        pthread_mutex_unlock(&mux->mutex);
+        return 0;
+    }
+
+    if (at_cmux_link(mux, priv->dlci, true) == -1) {
+        pthread_mutex_unlock(&mux->mutex);
+        return -1;
+    }
+
+    /* Tell the modem we're ready for data. */
+    uint8_t msc[] = { CMUX_MSG_MSC | CMUX_MSG_CR, 0x05, (priv->dlci << 2) | 0x03, CMUX_MSC_SIGNALS };
+    at_cmux_frame(mux, 0, CMUX_UIH, msc, sizeof(msc));
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->thread = mux->thread;
+    priv->open = true;
+    priv->running = true;
+    priv->lost = false;
+    pthread_cond_broadcast(&priv->cond);
+    pthread_mutex_unlock(&priv->mutex);
+
+    pthread_mutex_unlock(&mux->mutex);
+
+    return 0;
+}
+
+static int at_cmux_channel_close(struct at_unix *priv)
+{
+    struct at_cmux *mux = priv->mux;
+
+    /* Callbacks may close channels; they mustn't find our mutex taken. */
+    pthread_mutex_lock(&priv->mutex);
+    bool open = priv->open;
+    if (open) {
+        /* Nothing is going to answer pending commands now. */
+        priv->open = false;
+        priv->lost = false;
+        at_parser_reset(priv->at.parser);
+        at_fail_all(priv, ENODEV);
+    }
+    pthread_mutex_unlock(&priv->mutex);
+
+    if (!open)
+        return 0;
+
+    /* A link already dropped by the modem needs no DISC. On the
+     * multiplexer thread, the UA can't arrive while we wait for it; it's
+     * picked up later. */
+    pthread_mutex_lock(&mux->mutex);
+    if (mux->link[priv->dlci] == AT_CMUX_UP) {
+        if (pthread_equal(pthread_self(), mux->thread)) {
+            mux->link[priv->dlci] = AT_CMUX_DISCONNECTING;
+            at_cmux_frame(mux, priv->dlci, CMUX_DISC | CMUX_PF, NULL, 0);
         } else {
-            printf("at_reader_thread[%s]: received EOF\n", priv->devpath);
+            at_cmux_link(mux, priv->dlci, false);
+        }
+    }
+    pthread_mutex_unlock(&mux->mutex);
+
+    return 0;
+}
+
+/**
+ * Wait until the multiplexer thread has finished its current round of
+ * completions.
+ */
+static void at_cmux_sync(struct at_cmux *mux)
+{
+    pthread_mutex_lock(&mux->mutex);
+    unsigned int iteration = mux->iteration;
+    if (write(mux->wakeup[1], "", 1) == -1) {}
+    while (mux->running && mux->iteration == iteration)
+        pthread_cond_wait(&mux->cond, &mux->mutex);
+    pthread_mutex_unlock(&mux->mutex);
+}
+
+/**
+ * Deliver completions, expire timeouts and fail the commands of channels
+ * whose link went down, then free the channels at_free() left to us.
+ * Called without the mutex: callbacks may close and free channels.
+ *
+ * @returns Milliseconds until the next timeout, -1 if there's none.
+ */
+static int at_cmux_round(struct at_cmux *mux)
+{
+    int timeout = -1;
+    for (int dlci=1; dlci<AT_CMUX_CHANNELS; dlci++) {
+        pthread_mutex_lock(&mux->mutex);
+        struct at_unix *priv = mux->channels[dlci];
+        pthread_mutex_unlock(&mux->mutex);
+        if (!priv)
+            continue;
+
+        pthread_mutex_lock(&priv->mutex);
+        if (priv->lost) {
+            priv->lost = false;
+            at_fail_all(priv, EIO);
+        }
+        int left = at_process(priv);
+        pthread_mutex_unlock(&priv->mutex);
+        if (left != -1 && (timeout == -1 || left < timeout))
+            timeout = left;
+    }
+
+    pthread_mutex_lock(&mux->mutex);
+    struct at_unix *dead = mux->dead;
+    mux->dead = NULL;
+    pthread_mutex_unlock(&mux->mutex);
+    while (dead) {
+        struct at_unix *priv = dead;
+        dead = priv->dead_next;
+        at_unix_free(priv);
+    }
+
+    /* Let at_cmux_sync() know that the round is over. */
+    pthread_mutex_lock(&mux->mutex);
+    mux->iteration++;
+    pthread_cond_broadcast(&mux->cond);
+    pthread_mutex_unlock(&mux->mutex);
+
+    return timeout;
+}
+
+void *at_cmux_thread(void *arg)
+{
+    struct at_cmux *mux = (struct at_cmux *) arg;
+
+    printf("at_cmux_thread[%s]: starting\n", mux->devpath);
+
+    char buf[AT_READ_BUFFER_SIZE];
+
+    /* The decoder is ours alone; the mutex is only taken for link state and
+     * the channel table, never around callbacks. */
+    while (true) {
+        int timeout = at_cmux_round(mux);
+
+        pthread_mutex_lock(&mux->mutex);
+        bool running = mux->running;
+        pthread_mutex_unlock(&mux->mutex);
+        if (!running)
+            break;
+
+        /* Wait for data or a wakeup. */
+        struct pollfd fds[2] = {
+            { .fd = mux->fd, .events = POLLIN },
+            { .fd = mux->wakeup[0], .events = POLLIN },
+        };
+        ssize_t result = -1;
+        int why = EINTR;
+        if (poll(fds, 2, timeout) > 0) {
+            if (fds[1].revents)
+                while (read(mux->wakeup[0], buf, sizeof(buf)) > 0) {}
+            if (fds[0].revents) {
+                result = read(mux->fd, buf, sizeof(buf));
+                why = errno;
+            }
+        }
+
+        if (result > 0) {
+            cmux_decode(&mux->decoder, buf, result);
+        } else if (result == -1) {
+            if (why == EINTR || why == EAGAIN)
+                continue;
+            printf("at_cmux_thread[%s]: %s\n", mux->devpath, strerror(why));
+            break;
+        } else {
+            printf("at_cmux_thread[%s]: received EOF\n", mux->devpath);
             break;
         }
     }
 
-    printf("at_reader_thread[%s]: finished\n", priv->devpath);
+    /* Take all channels down with us. */
+    pthread_mutex_lock(&mux->mutex);
+    mux->running = false;
+    for (int dlci=0; dlci<AT_CMUX_CHANNELS; dlci++)
+        at_cmux_lost(mux, dlci);
+    pthread_mutex_unlock(&mux->mutex);
+    at_cmux_round(mux);
+
+    printf("at_cmux_thread[%s]: finished\n", mux->devpath);
 
     return NULL;
 }
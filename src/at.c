@@ -0,0 +1,174 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Platform-independent helpers built on top of the at_* primitives.
+ */
+
+#include <attentive/at.h>
+
+#include <stdio.h>
+#include <string.h>
+#define printf(...)
+
+/* Longest command line built by at_command_batch(); must fit at_command(). */
+#define AT_BATCH_LINE_LENGTH 64
+
+/* Silence required around the "+++" escape (the S12 default). */
+#define AT_DATAMODE_GUARD_MS 1000
+
+static bool at_command_ok(struct at *at, const char *command)
+{
+    const char *response = at_command(at, "%s", command);
+    return response && !strcmp(response, "");
+}
+
+int at_command_batch(struct at *at, const char *const commands[])
+{
+    const char *const *next = commands;
+
+    while (*next) {
+        /* Pack as many commands as fit on a single command line. */
+        char line[AT_BATCH_LINE_LENGTH];
+        size_t len = strlen(*next);
+        const char *const *group = next;
+
+        if (len < sizeof(line)) {
+            memcpy(line, *next++, len);
+            while (*next) {
+                /* Drop the "AT" prefix and separate with a semicolon. */
+                size_t cmdlen = strlen(*next) - 2;
+                if (len + 1 + cmdlen >= sizeof(line))
+                    break;
+                line[len++] = ';';
+                memcpy(line + len, *next++ + 2, cmdlen);
+                len += cmdlen;
+            }
+            line[len] = '\0';
+        } else {
+            /* Too long to be combined with anything; send it as is. */
+            line[0] = '\0';
+            next++;
+        }
+
+        if (at_command_ok(at, *line ? line : *group))
+            continue;
+
+        /* The modem stops at the first failing command, but we can't tell
+         * which one it was. Redo the group one by one to find out. */
+        if (next - group == 1)
+            return -1;
+        for (; group < next; group++)
+            if (!at_command_ok(at, *group))
+                return -1;
+    }
+
+    return 0;
+}
+
+void at_set_data_handler(struct at *at, at_data_handler_t handler, void *arg)
+{
+    at->data_handler = handler;
+    at->data_arg = arg;
+}
+
+static bool at_never(void *arg)
+{
+    (void) arg;
+    return false;
+}
+
+int at_leave_datamode(struct at *at)
+{
+    /* Keep quiet for the guard time; at_wait() doubles as a sleep. */
+    at_wait(at, at_never, NULL, AT_DATAMODE_GUARD_MS);
+
+    /* The modem answers OK once the trailing guard time has passed.
+     * Sending the escape as a command also takes the parser out of data
+     * mode. */
+    at_set_timeout_ms(at, 3 * AT_DATAMODE_GUARD_MS);
+    if (!at_command_raw(at, "+++", 3))
+        return -1;
+
+    return 0;
+}
+
+#ifdef AT_STATS
+
+/**
+ * Copy a prefix up to the first stop character. Returns its length.
+ */
+static size_t at_stats_prefix(char *prefix, const char *line, size_t len, const char *stop)
+{
+    size_t n = 0;
+    while (n < len && n < AT_STATS_PREFIX_LENGTH-1 && !strchr(stop, line[n]))
+        n++;
+    memcpy(prefix, line, n);
+    prefix[n] = '\0';
+    return n;
+}
+
+/**
+ * Find the slot for a prefix, claiming a free one if needed.
+ */
+static size_t at_stats_slot(char *first, size_t stride, const char *prefix)
+{
+    size_t i;
+    for (i=0; i<AT_STATS_PREFIXES-1; i++) {
+        char *slot = first + i * stride;
+        if (!*slot) {
+            strcpy(slot, prefix);
+            break;
+        }
+        if (!strcmp(slot, prefix))
+            break;
+    }
+    return i;
+}
+
+void at_stats_command(struct at_stats *stats, const void *data, size_t size, uint32_t us, bool timeout)
+{
+    const char *line = data;
+    char prefix[AT_STATS_PREFIX_LENGTH];
+
+    /* Raw data sent after a prompt isn't interesting on its own. */
+    if (size >= 2 && (line[0] == 'A' || line[0] == 'a') && (line[1] == 'T' || line[1] == 't'))
+        at_stats_prefix(prefix, line, size, "=?;\r");
+    else
+        strcpy(prefix, "(raw)");
+
+    struct at_stats_command *command = &stats->command[
+        at_stats_slot(stats->command[0].prefix, sizeof(*command), prefix)];
+
+    int bucket = 0;
+    while (us > 1 && bucket < AT_STATS_BUCKETS-1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    stats->commands++;
+    command->count++;
+    command->latency[bucket]++;
+    if (timeout) {
+        stats->timeouts++;
+        command->timeouts++;
+    }
+}
+
+void at_stats_urc(struct at_stats *stats, const char *line, size_t len)
+{
+    char prefix[AT_STATS_PREFIX_LENGTH];
+    at_stats_prefix(prefix, line, len, ":");
+
+    stats->urcs++;
+    stats->urc[at_stats_slot(stats->urc[0].prefix, sizeof(stats->urc[0]), prefix)].count++;
+}
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -8,6 +8,12 @@
 
 #include <attentive/cellular.h>
 
+#include <errno.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#endif
+
 #include "modem/at-common.h"
 #define printf(...)
 
@@ -22,11 +28,133 @@ int cellular_attach(struct cellular *modem, struct at *at, const char *apn)
     modem->apn = apn;
 
     /* Reset PDP failure counters. */
+    modem->pdp_state = CELLULAR_PDP_DOWN;
     cellular_pdp_success(modem);
 
+    /* Whatever we knew may be about a different modem. */
+    cellular_state_reset(modem);
+
     return modem->ops->attach ? modem->ops->attach(modem) : 0;
 }
 
+/**
+ * Probe a modem's channel and attach it.
+ *
+ * @returns Zero on success, errno value on failure.
+ */
+static int cellular_bringup(struct cellular *modem, struct at *at, const char *apn,
+                            cellular_probe_t probe, void *arg)
+{
+    if (probe && probe(at, arg) != 0)
+        return errno;
+    return cellular_attach(modem, at, apn) == 0 ? 0 : errno;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+/** Work shared by cellular_attach_many() workers. */
+struct cellular_attach_pool {
+    struct cellular *const *modems;
+    struct at *const *ats;
+    const char *apn;
+    cellular_probe_t probe;
+    void *arg;
+    int *errors;
+    int count;
+
+    pthread_mutex_t mutex;
+    int next;                   /**< Next modem to bring up. */
+    int failed;                 /**< First modem that failed, count if none. */
+    int error;                  /**< Its errno value. */
+};
+
+static void *cellular_attach_worker(void *ctx)
+{
+    struct cellular_attach_pool *pool = ctx;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->next < pool->count) {
+        int i = pool->next++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        int error = cellular_bringup(pool->modems[i], pool->ats[i], pool->apn, pool->probe, pool->arg);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (pool->errors)
+            pool->errors[i] = error;
+        if (error && i < pool->failed) {
+            pool->failed = i;
+            pool->error = error;
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+int cellular_attach_many(struct cellular *const modems[], struct at *const ats[], const char *apn,
+                         int count, cellular_probe_t probe, void *arg, int errors[])
+{
+    if (count <= 0)
+        return 0;
+
+    struct cellular_attach_pool pool = {
+        .modems = modems,
+        .ats = ats,
+        .apn = apn,
+        .probe = probe,
+        .arg = arg,
+        .errors = errors,
+        .count = count,
+        .failed = count,
+    };
+    pthread_mutex_init(&pool.mutex, NULL);
+
+    /* Bring-up mostly waits for the modems; wait for several at once. The
+     * calling thread works too, so threads that can't be started only cost
+     * speed. */
+    pthread_t threads[CELLULAR_ATTACH_WORKERS];
+    int workers = count < CELLULAR_ATTACH_WORKERS ? count : CELLULAR_ATTACH_WORKERS;
+    int started = 0;
+    while (started < workers - 1 &&
+           pthread_create(&threads[started], NULL, cellular_attach_worker, &pool) == 0)
+        started++;
+
+    cellular_attach_worker(&pool);
+    for (int i=0; i<started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.mutex);
+
+    if (pool.failed < count) {
+        errno = pool.error;
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+int cellular_attach_many(struct cellular *const modems[], struct at *const ats[], const char *apn,
+                         int count, cellular_probe_t probe, void *arg, int errors[])
+{
+    int error = 0;
+    for (int i=0; i<count; i++) {
+        int result = cellular_bringup(modems[i], ats[i], apn, probe, arg);
+        if (errors)
+            errors[i] = result;
+        if (!error)
+            error = result;
+    }
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+#endif
+
 int cellular_detach(struct cellular *modem)
 {
     /* Do nothing if we're not attached. */
@@ -38,4 +166,9 @@ int cellular_detach(struct cellular *modem)
     return result;
 }
 
+void cellular_set_max_age(struct cellular *modem, int max_age_ms)
+{
+    modem->max_age_ms = max_age_ms;
+}
+
 /* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,189 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/cmux.h>
+
+#include <string.h>
+
+/* Checksum of a good frame, including the received FCS byte. */
+#define CMUX_FCS_GOOD 0xCF
+
+enum cmux_decoder_state {
+    STATE_HUNT,         /**< Waiting for a flag. */
+    STATE_ADDRESS,
+    STATE_CONTROL,
+    STATE_LENGTH,
+    STATE_LENGTH2,
+    STATE_DATA,
+    STATE_FCS,
+    STATE_CLOSE,        /**< Waiting for the closing flag. */
+};
+
+/**
+ * Helper, runs the reflected CRC-8 (x^8 + x^2 + x + 1) of 27.010 over data.
+ */
+static uint8_t cmux_crc(uint8_t crc, const uint8_t *data, size_t len)
+{
+    while (len--) {
+        crc ^= *data++;
+        for (int i=0; i<8; i++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xE0 : crc >> 1;
+    }
+    return crc;
+}
+
+size_t cmux_encode_header(uint8_t *header, uint8_t *trailer, int dlci, uint8_t control, size_t len)
+{
+    uint8_t type = control & ~CMUX_PF;
+    bool command = type != CMUX_UA && type != CMUX_DM;
+
+    size_t n = 0;
+    header[n++] = CMUX_FLAG;
+    header[n++] = (dlci << 2) | (command ? 0x02 : 0) | 0x01;
+    header[n++] = control;
+    if (len < 128) {
+        header[n++] = (len << 1) | 0x01;
+    } else {
+        header[n++] = (len & 0x7F) << 1;
+        header[n++] = len >> 7;
+    }
+
+    trailer[0] = 0xFF - cmux_crc(0xFF, header + 1, n - 1);
+    trailer[1] = CMUX_FLAG;
+
+    return n;
+}
+
+size_t cmux_encode(uint8_t *frame, int dlci, uint8_t control, const void *data, size_t len)
+{
+    uint8_t trailer[CMUX_TRAILER_SIZE];
+    size_t n = cmux_encode_header(frame, trailer, dlci, control, len);
+
+    if (len)
+        memcpy(frame + n, data, len);
+    n += len;
+    memcpy(frame + n, trailer, CMUX_TRAILER_SIZE);
+
+    return n + CMUX_TRAILER_SIZE;
+}
+
+void cmux_decoder_init(struct cmux_decoder *decoder, void *buf, size_t size,
+                       cmux_frame_handler_t handler, void *priv)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->handle_frame = handler;
+    decoder->priv = priv;
+    decoder->buf = buf;
+    decoder->size = size;
+    decoder->state = STATE_HUNT;
+}
+
+/**
+ * Helper, sets up for the information field once the length is known.
+ */
+static void cmux_decoder_length(struct cmux_decoder *decoder, size_t len)
+{
+    if (len > decoder->size) {
+        decoder->errors++;
+        decoder->state = STATE_HUNT;
+        return;
+    }
+
+    decoder->len = len;
+    decoder->received = 0;
+    decoder->state = len ? STATE_DATA : STATE_FCS;
+}
+
+void cmux_decode(struct cmux_decoder *decoder, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = p + len;
+
+    while (p < end) {
+        /* The information field is copied in bulk. */
+        if (decoder->state == STATE_DATA) {
+            size_t n = decoder->len - decoder->received;
+            if (n > (size_t) (end - p))
+                n = end - p;
+            memcpy(decoder->buf + decoder->received, p, n);
+            decoder->received += n;
+            p += n;
+            if (decoder->received == decoder->len)
+                decoder->state = STATE_FCS;
+            continue;
+        }
+
+        uint8_t ch = *p++;
+        switch (decoder->state) {
+            case STATE_HUNT: {
+                if (ch == CMUX_FLAG)
+                    decoder->state = STATE_ADDRESS;
+            } break;
+
+            case STATE_ADDRESS: {
+                /* Consecutive flags are allowed between frames. */
+                if (ch == CMUX_FLAG)
+                    break;
+                /* Only single-byte addresses exist in the basic option. */
+                if (!(ch & 0x01)) {
+                    decoder->errors++;
+                    decoder->state = STATE_HUNT;
+                    break;
+                }
+                decoder->header[0] = ch;
+                decoder->header_len = 1;
+                decoder->state = STATE_CONTROL;
+            } break;
+
+            case STATE_CONTROL: {
+                decoder->header[decoder->header_len++] = ch;
+                decoder->state = STATE_LENGTH;
+            } break;
+
+            case STATE_LENGTH: {
+                decoder->header[decoder->header_len++] = ch;
+                if (ch & 0x01)
+                    cmux_decoder_length(decoder, ch >> 1);
+                else
+                    decoder->state = STATE_LENGTH2;
+            } break;
+
+            case STATE_LENGTH2: {
+                decoder->header[decoder->header_len++] = ch;
+                cmux_decoder_length(decoder, (decoder->header[2] >> 1) | ((size_t) ch << 7));
+            } break;
+
+            case STATE_FCS: {
+                uint8_t crc = cmux_crc(0xFF, decoder->header, decoder->header_len);
+                if ((decoder->header[1] & ~CMUX_PF) == CMUX_UI)
+                    crc = cmux_crc(crc, decoder->buf, decoder->len);
+                crc = cmux_crc(crc, &ch, 1);
+                if (crc == CMUX_FCS_GOOD) {
+                    decoder->state = STATE_CLOSE;
+                } else {
+                    decoder->errors++;
+                    decoder->state = STATE_HUNT;
+                }
+            } break;
+
+            case STATE_CLOSE: {
+                if (ch != CMUX_FLAG) {
+                    decoder->errors++;
+                    decoder->state = STATE_HUNT;
+                    break;
+                }
+                /* The closing flag may open the next frame as well. */
+                decoder->state = STATE_ADDRESS;
+                decoder->handle_frame(decoder->header[0] >> 2, decoder->header[1],
+                                      decoder->buf, decoder->len, decoder->priv);
+            } break;
+        }
+    }
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -29,7 +29,7 @@ int main(int argc, char *argv[])
     const char *devpath = argv[1];
 
     printf("allocating channel...\n");
-    struct at *at = at_alloc_unix(devpath, B115200);
+    struct at *at = at_alloc_unix(devpath, B115200, 0);
 
     printf("opening port...\n");
     assert(at_open(at) == 0);
@@ -22,8 +22,8 @@ int main(int argc, char *argv[])
     const char *devpath = argv[1];
     const char *apn = argv[2];
 
-    struct at *at = at_alloc_unix(devpath, B115200);
-    struct cellular *modem = cellular_sim800_alloc();
+    struct at *at = at_alloc_unix(devpath, B115200, 0);
+    struct cellular *modem = cellular_sim800_alloc(CELLULAR_SIM800_PROFILE_DEFAULT);
 
     assert(at_open(at) == 0);
     assert(cellular_attach(modem, at, apn) == 0);
@@ -8,7 +8,9 @@
 
 #include <attentive/cellular.h>
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "at-common.h"
@@ -30,22 +32,35 @@
  *    data can be transmitted. Telit modems are especially prone to this if
  *    AT+CGDCONT is invoked while the context is active. Our logic should handle
  *    this after a few connection failures.
+ *
+ * 3. Checking the context costs several round trips (AT+CIPSTATUS and friends
+ *    on SIM800, AT#SGACT on Telit). Once it has worked it's assumed UP until a
+ *    network command fails or the modem says it's gone; any failure sends us
+ *    through pdp_open() again, and enough of them mark it STUCK.
  */
 
 int cellular_pdp_request(struct cellular *modem)
 {
-    if (modem->pdp_failures >= modem->pdp_threshold) {
+    if (modem->pdp_state == CELLULAR_PDP_UP)
+        return 0;
+
+    if (modem->pdp_state == CELLULAR_PDP_STUCK) {
         /* Possibly stuck PDP context; close it. */
         modem->ops->pdp_close(modem);
         /* Perform exponential backoff. */
         modem->pdp_threshold *= (1+PDP_RETRY_THRESHOLD_MULTIPLIER);
     }
 
+    modem->pdp_state = CELLULAR_PDP_OPENING;
     if (modem->ops->pdp_open(modem, modem->apn) != 0) {
         cellular_pdp_failure(modem);
         return -1;
     }
 
+    /* A deactivation URC may have arrived in the meantime. */
+    if (modem->pdp_state == CELLULAR_PDP_OPENING)
+        modem->pdp_state = CELLULAR_PDP_UP;
+
     return 0;
 }
 
@@ -58,58 +73,164 @@ void cellular_pdp_success(struct cellular *modem)
 void cellular_pdp_failure(struct cellular *modem)
 {
     modem->pdp_failures++;
+    modem->pdp_state = modem->pdp_failures >= modem->pdp_threshold ?
+        CELLULAR_PDP_STUCK : CELLULAR_PDP_DOWN;
+}
+
+void cellular_pdp_lost(struct cellular *modem)
+{
+    /* Leave STUCK alone; the context still wants closing before reuse. */
+    if (modem->pdp_state != CELLULAR_PDP_STUCK)
+        modem->pdp_state = CELLULAR_PDP_DOWN;
+}
+
+
+/*
+ * Cached state.
+ *
+ * Registration and signal strength are answered from the cache if URCs keep
+ * them up to date or they're recent enough for the caller's taste (see
+ * cellular_set_max_age()). Identifiers don't change while attached, so they
+ * are read once.
+ */
+
+void cellular_state_reset(struct cellular *modem)
+{
+    modem->state = (struct cellular_state) {
+        .creg = -1,
+        .rssi = -1,
+    };
+}
+
+static bool cellular_state_fresh(struct cellular *modem, int value, uint32_t time, bool live)
+{
+    if (value == -1)
+        return false;
+    if (live || modem->max_age_ms == -1)
+        return true;
+    return at_clock_ms() - time < (uint32_t) modem->max_age_ms;
+}
+
+bool cellular_state_scan(const char *line, size_t len)
+{
+    (void) len;
+
+    /* Unsolicited: "+CREG: <stat>[,<lac>,<ci>]". Solicited by AT+CREG?:
+     * "+CREG: <n>,<stat>[,<lac>,<ci>]", with a number after the comma. */
+    if (!strncmp(line, "+CREG: ", 7)) {
+        const char *comma = strchr(line, ',');
+        return !comma || comma[1] == '"';
+    }
+
+    return !strncmp(line, "+CSQN: ", 7);
+}
+
+bool cellular_state_urc(struct cellular *modem, const char *line, size_t len)
+{
+    if (!cellular_state_scan(line, len))
+        return false;
+
+    struct at_fields fields;
+    int value;
+    if (at_fields_parse(&fields, "+CREG: ", line, len) >= 1 && at_field_int(&fields, 0, &value)) {
+        modem->state.creg = value;
+        modem->state.creg_time = at_clock_ms();
+    } else if (at_fields_parse(&fields, "+CSQN: ", line, len) >= 1 && at_field_int(&fields, 0, &value)) {
+        modem->state.rssi = value;
+        modem->state.rssi_time = at_clock_ms();
+    }
+
+    return true;
+}
+
+void cellular_state_subscribe(struct cellular *modem, const char *creg, const char *rssi)
+{
+    at_set_timeout(modem->at, 1);
+
+    const char *response;
+    if (creg && (response = at_command(modem->at, "%s", creg)) && !strcmp(response, ""))
+        modem->state.creg_live = true;
+    if (rssi && (response = at_command(modem->at, "%s", rssi)) && !strcmp(response, ""))
+        modem->state.rssi_live = true;
 }
 
+int cellular_state_copy(const char *cached, char *buf, size_t len)
+{
+    if (!*cached)
+        return -1;
+
+    size_t n = strlen(cached);
+    if (n > len-1)
+        n = len-1;
+    memcpy(buf, cached, n);
+    buf[n] = '\0';
+
+    return 0;
+}
 
 int cellular_op_imei(struct cellular *modem, char *buf, size_t len)
 {
+    if (cellular_state_copy(modem->state.imei, buf, len) == 0)
+        return 0;
+
     char fmt[16];
-    if (snprintf(fmt, sizeof(fmt), "%%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
-        return -1;
-    }
+    snprintf(fmt, sizeof(fmt), "%%%d[0-9]", (int) sizeof(modem->state.imei)-1);
 
     at_set_timeout(modem->at, 1);
     const char *response = at_command(modem->at, "AT+CGSN");
-    at_simple_scanf(response, fmt, buf);
-    buf[len-1] = '\0';
+    at_simple_scanf(response, fmt, modem->state.imei);
 
-    return 0;
+    return cellular_state_copy(modem->state.imei, buf, len);
 }
 
 int cellular_op_iccid(struct cellular *modem, char *buf, size_t len)
 {
+    if (cellular_state_copy(modem->state.iccid, buf, len) == 0)
+        return 0;
+
     char fmt[16];
-    if (snprintf(fmt, sizeof(fmt), "%%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
-        return -1;
-    }
+    snprintf(fmt, sizeof(fmt), "%%%d[0-9]", (int) sizeof(modem->state.iccid)-1);
 
     at_set_timeout(modem->at, 5);
     const char *response = at_command(modem->at, "AT+CCID");
-    at_simple_scanf(response, fmt, buf);
-    buf[len-1] = '\0';
+    at_simple_scanf(response, fmt, modem->state.iccid);
 
-    return 0;
+    return cellular_state_copy(modem->state.iccid, buf, len);
 }
 
 int cellular_op_creg(struct cellular *modem)
 {
+    struct cellular_state *state = &modem->state;
+    if (cellular_state_fresh(modem, state->creg, state->creg_time, state->creg_live))
+        return state->creg;
+
     int creg;
 
     at_set_timeout(modem->at, 1);
     const char *response = at_command(modem->at, "AT+CREG?");
     at_simple_scanf(response, "+CREG: %*d,%d", &creg);
 
+    state->creg = creg;
+    state->creg_time = at_clock_ms();
+
     return creg;
 }
 
 int cellular_op_rssi(struct cellular *modem)
 {
+    struct cellular_state *state = &modem->state;
+    if (cellular_state_fresh(modem, state->rssi, state->rssi_time, state->rssi_live))
+        return state->rssi;
+
     int rssi;
 
     at_set_timeout(modem->at, 1);
     const char *response = at_command(modem->at, "AT+CSQ");
     at_simple_scanf(response, "+CSQ: %d,%*d", &rssi);
 
+    state->rssi = rssi;
+    state->rssi_time = at_clock_ms();
+
     return rssi;
 }
 
@@ -163,4 +284,218 @@ int cellular_op_rssi(struct cellular *modem)
 //    return 0;
 //}
 
+void cellular_sendbuf_init(struct cellular_sendbuf *sb, void *data, size_t size, int delay_ms)
+{
+    sb->data = data;
+    sb->size = data ? size : 0;
+    sb->used = 0;
+    sb->delay_ms = delay_ms;
+}
+
+int cellular_sendbuf_flush(struct cellular_sendbuf *sb, struct cellular *modem, int connid,
+                           cellular_send_t send)
+{
+    size_t sent = 0;
+    int result = 0;
+
+    /* The modem may take less than offered; keep going. */
+    while (sent < sb->used) {
+        ssize_t amount = send(modem, connid, sb->data + sent, sb->used - sent);
+        if (amount <= 0) {
+            result = -1;
+            break;
+        }
+        sent += amount;
+    }
+
+    /* Keep whatever didn't make it for the next attempt. */
+    memmove(sb->data, sb->data + sent, sb->used - sent);
+    sb->used -= sent;
+    sb->since = at_clock_ms();
+
+    return result;
+}
+
+int cellular_sendbuf_due(const struct cellular_sendbuf *sb)
+{
+    if (!sb->used)
+        return -1;
+
+    int32_t age = (int32_t) (at_clock_ms() - sb->since);
+    return age >= sb->delay_ms ? 0 : sb->delay_ms - age;
+}
+
+ssize_t cellular_sendbuf_write(struct cellular_sendbuf *sb, struct cellular *modem, int connid,
+                               const void *buffer, size_t amount, cellular_send_t send)
+{
+    if (!sb->data)
+        return send(modem, connid, buffer, amount);
+
+    /* Big writes gain nothing from a detour through the buffer. */
+    if (!sb->used && amount >= sb->size)
+        return send(modem, connid, buffer, amount);
+
+    /* Still full from a failed flush? Report it now. */
+    if (sb->used == sb->size && cellular_sendbuf_flush(sb, modem, connid, send) != 0)
+        return -1;
+
+    size_t space = sb->size - sb->used;
+    if (amount > space)
+        amount = space;
+    if (!sb->used)
+        sb->since = at_clock_ms();
+    memcpy(sb->data + sb->used, buffer, amount);
+    sb->used += amount;
+
+    /* A full or stale buffer goes out now. The data has been taken either
+     * way; a failure is reported by the next call. */
+    if (sb->used == sb->size || cellular_sendbuf_due(sb) == 0)
+        cellular_sendbuf_flush(sb, modem, connid, send);
+
+    return amount;
+}
+
+/** One chunk request and its buffer. */
+struct download_slot {
+    struct cellular *modem;
+    const struct cellular_download_ops *ops;
+    char *buf;
+    int len;            /**< Result of ops->parse(). */
+    int error;          /**< Non-zero if the request failed. */
+    bool busy;          /**< Request issued and not consumed yet. */
+    bool done;          /**< Response arrived. */
+};
+
+static void download_done(const char *response, size_t len, void *ctx)
+{
+    (void) len;
+    struct download_slot *slot = ctx;
+
+    slot->error = response ? 0 : (errno ? errno : EIO);
+    slot->len = response ? slot->ops->parse(response) : -1;
+    slot->done = true;
+    at_notify(slot->modem->at);
+}
+
+static bool download_slot_done(void *arg)
+{
+    const struct download_slot *slot = arg;
+    return slot->done;
+}
+
+static int download_issue(struct download_slot *slot)
+{
+    struct at *at = slot->modem->at;
+
+    slot->busy = true;
+    slot->done = false;
+    at_set_timeout_ms(at, slot->ops->timeout_ms);
+    at_set_command_scanner(at, slot->ops->scanner);
+    at_set_data_buffer(at, slot->buf, slot->ops->chunk);
+    at_set_priority(at, AT_PRIORITY_BULK);
+    if (at_command_async(at, download_done, slot, slot->ops->command, (int) slot->ops->chunk) == -1) {
+        slot->busy = false;
+        return -1;
+    }
+    return 0;
+}
+
+static void download_collect(struct download_slot *slot)
+{
+    /* The request times out on its own; this is just a safety net. */
+    if (at_wait(slot->modem->at, download_slot_done, slot, 2 * slot->ops->timeout_ms) == -1) {
+        slot->error = ETIMEDOUT;
+        slot->len = -1;
+    }
+}
+
+int cellular_download(struct cellular *modem, const struct cellular_download_ops *ops,
+                      void *storage, cellular_sink_t sink, void *ctx)
+{
+    char *bufs = storage;
+#ifndef AT_NO_MALLOC
+    if (!bufs)
+        bufs = malloc(2 * ops->chunk);
+#endif
+    if (!bufs) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct download_slot slots[2];
+    for (int i=0; i<2; i++) {
+        slots[i] = (struct download_slot) {
+            .modem = modem,
+            .ops = ops,
+            .buf = bufs + i * ops->chunk,
+        };
+    }
+
+    int result = 0, error = 0, empty = 0;
+    int cur = 0;
+    if (download_issue(&slots[cur]) == -1) {
+        error = errno;
+        result = -1;
+    }
+
+    while (result == 0) {
+        struct download_slot *slot = &slots[cur], *next = &slots[cur ^ 1];
+        download_collect(slot);
+
+        if (slot->error) {
+            error = slot->error;
+            result = -1;
+        } else if (slot->len > 0) {
+            /* Keep the UART busy while the sink does its thing. */
+            empty = 0;
+            download_issue(next);
+
+            size_t len = (size_t) slot->len > ops->chunk ? ops->chunk : (size_t) slot->len;
+            if (sink(slot->buf, len, ctx) != 0) {
+                error = ECANCELED;
+                result = -1;
+            }
+        } else if (slot->len == 0) {
+            /* Nothing yet; give the network some time. */
+            if (++empty > ops->retries) {
+                error = ETIMEDOUT;
+                result = -1;
+            } else {
+                ops->wait(modem);
+            }
+        } else if (!ops->finished(modem)) {
+            error = EPROTO;
+            result = -1;
+        } else {
+            /* End of file. */
+            break;
+        }
+        slot->busy = false;
+
+        if (result == -1)
+            break;
+
+        /* Move on to the prefetched request, or issue it now. */
+        if (!next->busy && download_issue(next) == -1) {
+            error = errno;
+            result = -1;
+            break;
+        }
+        cur ^= 1;
+    }
+
+    /* Don't free buffers the reader may still write to. */
+    for (int i=0; i<2; i++)
+        if (slots[i].busy && !slots[i].done)
+            download_collect(&slots[i]);
+#ifndef AT_NO_MALLOC
+    if (bufs != storage)
+        free(bufs);
+#endif
+
+    if (result == -1)
+        errno = error;
+    return result;
+}
+
 /* vim: set ts=4 sw=4 et: */
@@ -28,6 +28,12 @@ void cellular_pdp_success(struct cellular *modem);
  */
 void cellular_pdp_failure(struct cellular *modem);
 
+/**
+ * Signal that the PDP context is gone: deactivation URCs, explicit closes.
+ * Safe to call from URC handlers.
+ */
+void cellular_pdp_lost(struct cellular *modem);
+
 /**
  * Perform a network command, requesting a PDP context and signalling success
  * or failure to the PDP machinery. Returns -1 on failure.
@@ -58,6 +64,124 @@ int cellular_op_rssi(struct cellular *modem);
 //int cellular_op_clock_gettime(struct cellular *modem, struct timespec *ts);
 //int cellular_op_clock_settime(struct cellular *modem, const struct timespec *ts);
 
+/*
+ * Cached state, fed by URCs where the modem has them.
+ */
+
+/**
+ * Forget everything cached about the modem.
+ */
+void cellular_state_reset(struct cellular *modem);
+
+/**
+ * Tell whether a line is a state URC. "+CREG: " counts only in its
+ * unsolicited forms, so that AT+CREG? responses aren't taken away from it.
+ * For line scanners.
+ */
+bool cellular_state_scan(const char *line, size_t len);
+
+/**
+ * Update the cached state from a URC. For URC handlers.
+ *
+ * @returns True if the line was a state URC.
+ */
+bool cellular_state_urc(struct cellular *modem, const char *line, size_t len);
+
+/**
+ * Turn on state URCs, marking the values live if the modem agrees. Either
+ * command may be NULL if the modem has no such URC.
+ */
+void cellular_state_subscribe(struct cellular *modem, const char *creg, const char *rssi);
+
+/**
+ * Hand out a cached identifier, truncated to fit like a fresh read would be.
+ *
+ * @returns Zero, or -1 if nothing is cached yet.
+ */
+int cellular_state_copy(const char *cached, char *buf, size_t len);
+
+/*
+ * Send coalescing.
+ */
+
+/** Sends data to the modem right away; returns bytes taken or -1. */
+typedef ssize_t (*cellular_send_t)(struct cellular *modem, int connid, const void *buffer, size_t amount);
+
+/** Per-socket buffer collecting small writes into full-sized modem sends. */
+struct cellular_sendbuf {
+    char *data;         /**< Caller-supplied storage; NULL if disabled. */
+    size_t size;
+    size_t used;
+    int delay_ms;       /**< How long data may sit in the buffer. */
+    uint32_t since;     /**< at_clock_ms() of the oldest buffered byte. */
+};
+
+/**
+ * Enable (or, with NULL data, disable) coalescing. Pending data is dropped.
+ */
+void cellular_sendbuf_init(struct cellular_sendbuf *sb, void *data, size_t size, int delay_ms);
+
+/**
+ * Buffer a write, sending the buffer out once it fills up or the delay has
+ * passed. Writes that wouldn't fit an empty buffer bypass it.
+ *
+ * @returns Bytes taken, -1 and sets errno on failure.
+ */
+ssize_t cellular_sendbuf_write(struct cellular_sendbuf *sb, struct cellular *modem, int connid,
+                               const void *buffer, size_t amount, cellular_send_t send);
+
+/**
+ * Send out everything buffered.
+ *
+ * @returns Zero on success, -1 and sets errno on failure. Unsent data stays
+ *          buffered.
+ */
+int cellular_sendbuf_flush(struct cellular_sendbuf *sb, struct cellular *modem, int connid,
+                           cellular_send_t send);
+
+/**
+ * Milliseconds until the buffer is due for flushing; zero if overdue, -1 if
+ * empty.
+ */
+int cellular_sendbuf_due(const struct cellular_sendbuf *sb);
+
+/*
+ * Pipelined downloads.
+ */
+
+/** Modem-specific parts of a chunked download. */
+struct cellular_download_ops {
+    const char *command;            /**< Chunk request format; takes the chunk size. */
+    at_line_scanner_t scanner;      /**< Announces the chunk's raw data. */
+    size_t chunk;                   /**< Largest chunk the modem returns. */
+    int timeout_ms;                 /**< Per-request timeout. */
+    int retries;                    /**< Empty responses in a row before giving up. */
+
+    /**
+     * Parse a request's response. Runs in the reader context; must not call
+     * at_* functions.
+     *
+     * @returns Payload length, zero if the modem has nothing yet, -1 if the
+     *          response isn't a chunk at all.
+     */
+    int (*parse)(const char *response);
+    /** Wait a little for more data after an empty response. */
+    void (*wait)(struct cellular *modem);
+    /** Tell whether a non-chunk response means the file is complete. */
+    bool (*finished)(struct cellular *modem);
+};
+
+/**
+ * Fetch chunks until the end of file, keeping the next request in flight
+ * while the previous chunk is passed to the sink.
+ *
+ * @param bufs Room for two chunks, or NULL to allocate it for the duration
+ *             (not in AT_NO_MALLOC builds).
+ * @returns Zero at end of file, -1 and sets errno on failure.
+ */
+int cellular_download(struct cellular *modem, const struct cellular_download_ops *ops,
+                      void *bufs, cellular_sink_t sink, void *ctx);
+
 #endif
 
 /* vim: set ts=4 sw=4 et: */
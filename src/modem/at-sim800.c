@@ -8,12 +8,10 @@
 
 #include <attentive/cellular.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 
-#include "FreeRTOS.h"
-#include "task.h"
-
 #include "at-common.h"
 #define printf(...)
 
@@ -33,8 +31,11 @@
  */
 
 #define SIM800_AUTOBAUD_ATTEMPTS 10
+#define SIM800_AUTOBAUD_TIMEOUT_MS 300
 #define SIM800_WAITACK_TIMEOUT   40
+#define SIM800_WAITACK_POLL_MS   1000
 #define SIM800_FTP_TIMEOUT       60
+#define SIM800_FTP_POLL_MS       1000
 #define SET_TIMEOUT              10
 #define GET_TIMEOUT              2
 #define NTP_BUF_SIZE             4
@@ -49,8 +50,13 @@ enum sim800_socket_status {
 #define SIM800_NSOCKETS                 6
 #define SIM800_CONNECT_TIMEOUT          20
 #define SIM800_CIPCFG_RETRIES           10
+#define SIM800_MAX_RECV                 1460
+#define SIM800_MAX_SEND                 1460
+
+/* Bluetooth SPP receive ring size; must be a power of two. */
+#define SIM800_SPP_RING_SIZE            2048
+#define SIM800_SPP_RING_MASK            (SIM800_SPP_RING_SIZE - 1)
 
-static char spp_recv_buf[1024] = {0};
 static const char *const sim800_urc_responses[] = {
     "=>",               /* BT data received via the spp channel */
     "+BTPAIRING: ",     /* BT pairing request notification */
@@ -61,6 +67,7 @@ static const char *const sim800_urc_responses[] = {
     "+BTSPPMAN: ",      /* incoming BT SPP data notification */
     "+CIPRXGET: 1,",    /* incoming socket data notification */
     "+FTPGET: 1,",      /* FTP state change notification */
+    "+FTPSIZE: 1,",     /* FTP file size */
     "+PDP: DEACT",      /* PDP disconnected */
     "+SAPBR 1: DEACT",  /* PDP disconnected (for SAPBR apps) */
     "*PSNWID: ",        /* AT+CLTS network name */
@@ -83,18 +90,39 @@ static const char *const sim800_urc_responses[] = {
 struct cellular_sim800 {
     struct cellular dev;
 
+    enum cellular_sim800_profile profile;
+
+    struct at_prefix_matcher urc_matcher;
+    struct at_prefix_entry urc_entries[sizeof(sim800_urc_responses) / sizeof(*sim800_urc_responses)];
+
     int ftpget1_status;
+    unsigned int ftpget1_events;    /**< Count of "+FTPGET: 1," URCs. */
+    int ftpsize_status;             /**< Error code of "+FTPSIZE: 1,", -1 until reported. */
+    long ftpsize;
+    bool ftp_rest;                  /**< A restart offset is set. */
     enum sim800_socket_status socket_status[SIM800_NSOCKETS];
+    bool socket_readable[SIM800_NSOCKETS];  /**< Modem reported pending data. */
+    bool socket_unacked[SIM800_NSOCKETS];   /**< Sent data may be unacknowledged. */
+    struct cellular_sendbuf sendbuf[SIM800_NSOCKETS];
     enum sim800_socket_status spp_status;
     int spp_connid;
+
+    /* SPP payload; filled by the URC handler, drained by socket_recv(). The
+     * indices run freely and are masked on access. */
+    char spp_ring[SIM800_SPP_RING_SIZE];
+    volatile size_t spp_head;       /**< Written by the URC handler only. */
+    volatile size_t spp_tail;       /**< Written by socket_recv() only. */
+    volatile unsigned int spp_dropped;  /**< Bytes lost to a full ring. */
+#ifdef AT_NO_MALLOC
+    char download_buf[2 * SIM800_MAX_RECV];
+#endif
 };
 
 static enum at_response_type scan_line(const char *line, size_t len, void *arg)
 {
-    (void) len;
     struct cellular_sim800 *priv = arg;
 
-    if (at_prefix_in_table(line, sim800_urc_responses))
+    if (at_prefix_match(&priv->urc_matcher, line, len) || cellular_state_scan(line, len))
         return AT_RESPONSE_URC;
 
     /* Socket status notifications in form of "%d, <status>". */
@@ -121,18 +149,66 @@ static enum at_response_type scan_line(const char *line, size_t len, void *arg)
     return AT_RESPONSE_UNKNOWN;
 }
 
+/**
+ * Queue SPP payload for socket_recv(). Whatever doesn't fit is dropped.
+ */
+static void sim800_spp_queue(struct cellular_sim800 *priv, const char *data, size_t len)
+{
+    size_t head = priv->spp_head;
+    size_t space = SIM800_SPP_RING_SIZE - (head - priv->spp_tail);
+    if (len > space) {
+        printf("[sim800@%p] spp: dropping %zu bytes\n", priv, len - space);
+        priv->spp_dropped += len - space;
+        len = space;
+    }
+
+    size_t start = head & SIM800_SPP_RING_MASK;
+    size_t first = len < SIM800_SPP_RING_SIZE - start ? len : SIM800_SPP_RING_SIZE - start;
+    memcpy(priv->spp_ring + start, data, first);
+    memcpy(priv->spp_ring, data + first, len - first);
+
+    /* Publish the data before moving the head. */
+    __sync_synchronize();
+    priv->spp_head = head + len;
+}
+
+/**
+ * Move queued SPP payload to the caller's buffer.
+ */
+static size_t sim800_spp_drain(struct cellular_sim800 *priv, void *buffer, size_t length)
+{
+    size_t tail = priv->spp_tail;
+    size_t len = priv->spp_head - tail;
+    __sync_synchronize();
+    if (len > length)
+        len = length;
+
+    size_t start = tail & SIM800_SPP_RING_MASK;
+    size_t first = len < SIM800_SPP_RING_SIZE - start ? len : SIM800_SPP_RING_SIZE - start;
+    memcpy(buffer, priv->spp_ring + start, first);
+    memcpy((char *) buffer + first, priv->spp_ring, len - first);
+
+    /* Hand the space back to the URC handler. */
+    __sync_synchronize();
+    priv->spp_tail = tail + len;
+
+    return len;
+}
+
 static void handle_urc(const char *line, size_t len, void *arg)
 {
     struct cellular_sim800 *priv = arg;
 
     printf("[sim800@%p] urc: %.*s\n", priv, (int) len, line);
-    if(sscanf(line, "=>%s", &spp_recv_buf[0]) == 1) {
-
+    int connid;
+    if (len >= 2 && !strncmp(line, "=>", 2)) {
+      /* The whole line is payload, whitespace included. */
+      sim800_spp_queue(priv, line + 2, len - 2);
     } else if (!strncmp(line, "+BTPAIRING: \"Druid_Tech\"", strlen("+BTPAIRING: \"Druid_Tech\""))) {
-      at_send(priv->dev.at, "AT+BTPAIR=1,1");
+      at_command_urgent(priv->dev.at, "AT+BTPAIR=1,1");
     } else if(!strncmp(line, "+BTCONNECTING: ", strlen("+BTCONNECTING: "))) {
       if(strstr(line, "\"SPP\"")) {
-        at_send(priv->dev.at, "AT+BTACPT=1");
+        at_command_urgent(priv->dev.at, "AT+BTACPT=1");
       }
     } else if(sscanf(line, "+BTCONNECT: %d,\"Druid_Tech\",%*s,\"SPP\"", &priv->spp_connid) == 1) {
       priv->spp_status = SIM800_SOCKET_STATUS_PENDING;
@@ -141,10 +217,50 @@ static void handle_urc(const char *line, size_t len, void *arg)
     } else if(!strncmp(line, "+BTDISCONN: \"Druid_Tech\"", strlen("+BTDISCONN: \"Druid_Tech\""))) {
       priv->spp_status = SIM800_SOCKET_STATUS_UNKNOWN;
     } else if (sscanf(line, "+FTPGET: 1,%d", &priv->ftpget1_status) == 1) {
-
+      priv->ftpget1_events++;
+    } else if (sscanf(line, "+FTPSIZE: 1,%d,%ld", &priv->ftpsize_status, &priv->ftpsize) >= 1) {
+      /* Picked up by sim800_ftp_size(). */
+    } else if (sscanf(line, "+CIPRXGET: 1,%d", &connid) == 1) {
+      if (connid >= 0 && connid < SIM800_NSOCKETS)
+        priv->socket_readable[connid] = true;
+    } else if (!strncmp(line, "+PDP: DEACT", strlen("+PDP: DEACT")) ||
+               !strncmp(line, "+SAPBR 1: DEACT", strlen("+SAPBR 1: DEACT"))) {
+      cellular_pdp_lost(&priv->dev);
+    } else if (cellular_state_urc(&priv->dev, line, len)) {
+      /* Cached for creg() and rssi(). */
     }
 
-    return;
+    /* Someone may be waiting for this one; socket status changes included. */
+    at_notify(priv->dev.at);
+}
+
+static bool sim800_socket_settled(void *arg)
+{
+    const enum sim800_socket_status *status = arg;
+    return *status != SIM800_SOCKET_STATUS_UNKNOWN;
+}
+
+static bool sim800_socket_failed(void *arg)
+{
+    const enum sim800_socket_status *status = arg;
+    return *status == SIM800_SOCKET_STATUS_ERROR;
+}
+
+static bool sim800_ftpget1_reported(void *arg)
+{
+    const struct cellular_sim800 *priv = arg;
+    return priv->ftpget1_status != -1;
+}
+
+struct sim800_ftpget1_wait {
+    const struct cellular_sim800 *priv;
+    unsigned int events;
+};
+
+static bool sim800_ftpget1_changed(void *arg)
+{
+    const struct sim800_ftpget1_wait *wait = arg;
+    return wait->priv->ftpget1_events != wait->events;
 }
 
 static const struct at_callbacks sim800_callbacks = {
@@ -180,7 +296,8 @@ static int sim800_config(struct cellular *modem, const char *option, const char
         if (!strcmp(response, expected))
             return 0;
 
-        vTaskDelay(pdMS_TO_TICKS(1000));
+        /* Give the IP application a moment; any URC ends the pause early. */
+        at_wait(modem->at, NULL, NULL, 1000);
     }
 
     return -1;
@@ -189,11 +306,13 @@ static int sim800_config(struct cellular *modem, const char *option, const char
 
 static int sim800_attach(struct cellular *modem)
 {
-    at_set_callbacks(modem->at, &sim800_callbacks, (void *) modem);
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
 
-    at_set_timeout(modem->at, 2);
+    at_set_callbacks(modem->at, &sim800_callbacks, (void *) modem);
 
-    /* Perform autobauding. */
+    /* Perform autobauding. The modem answers within milliseconds once it
+     * has locked on, so don't wait long for each attempt. */
+    at_set_timeout_ms(modem->at, SIM800_AUTOBAUD_TIMEOUT_MS);
     for (int i=0; i<SIM800_AUTOBAUD_ATTEMPTS; i++) {
         const char *response = at_command(modem->at, "AT");
         if (response != NULL)
@@ -201,6 +320,8 @@ static int sim800_attach(struct cellular *modem)
             break;
     }
 
+    at_set_timeout(modem->at, 2);
+
     /* Disable local echo. */
     at_command(modem->at, "ATE0");
 
@@ -221,20 +342,24 @@ static int sim800_attach(struct cellular *modem)
         "AT+BTPOWER=1",
         NULL
     };
-    for (const char *const *command=init_strings; *command; command++)
-        at_command_simple(modem->at, "%s", *command);
+    if (at_command_batch(modem->at, init_strings) != 0)
+        return -1;
 
-    /* Configure IP application. */
+    /* Have registration and signal changes reported. */
+    cellular_state_subscribe(modem, "AT+CREG=2", "AT+EXUNSOL=\"SQ\",1");
 
-//    /* Switch to multiple connections mode; it's less buggy. */
-//    if (sim800_config(modem, "CIPMUX", "1", SIM800_CIPCFG_RETRIES) != 0)
-//        return -1;
-//    /* Receive data manually. */
-//    if (sim800_config(modem, "CIPRXGET", "1", SIM800_CIPCFG_RETRIES) != 0)
-//        return -1;
-//    /* Enable quick send mode. */
-//    if (sim800_config(modem, "CIPQSEND", "1", SIM800_CIPCFG_RETRIES) != 0)
-//        return -1;
+    /* Configure IP application. */
+    if (priv->profile == CELLULAR_SIM800_PROFILE_THROUGHPUT) {
+        /* Switch to multiple connections mode; it's less buggy. */
+        if (sim800_config(modem, "CIPMUX", "1", SIM800_CIPCFG_RETRIES) != 0)
+            return -1;
+        /* Receive data manually. */
+        if (sim800_config(modem, "CIPRXGET", "1", SIM800_CIPCFG_RETRIES) != 0)
+            return -1;
+        /* Enable quick send mode; socket_waitack() confirms delivery. */
+        if (sim800_config(modem, "CIPQSEND", "1", SIM800_CIPCFG_RETRIES) != 0)
+            return -1;
+    }
 
     return 0;
 }
@@ -412,6 +537,8 @@ static enum at_response_type scanner_cipshut(const char *line, size_t len, void
 
 static int sim800_pdp_close(struct cellular *modem)
 {
+    cellular_pdp_lost(modem);
+
     at_set_timeout(modem->at, SET_TIMEOUT);
     at_set_command_scanner(modem->at, scanner_cipshut);
     at_command_simple(modem->at, "AT+CIPSHUT");
@@ -430,17 +557,16 @@ static int sim800_socket_connect(struct cellular *modem, int connid, const char
       /* Send connection request. */
       at_set_timeout(modem->at, SET_TIMEOUT);
       priv->socket_status[connid] = SIM800_SOCKET_STATUS_UNKNOWN;
+      priv->socket_readable[connid] = false;
+      priv->socket_unacked[connid] = false;
       cellular_command_simple_pdp(modem, "AT+CIPSTART=%d,TCP,\"%s\",%d", connid, host, port);
 
       /* Wait for socket status URC. */
-      for (int i=0; i<SIM800_CONNECT_TIMEOUT; i++) {
-          if (priv->socket_status[connid] == SIM800_SOCKET_STATUS_CONNECTED) {
-              return 0;
-          } else if (priv->socket_status[connid] == SIM800_SOCKET_STATUS_ERROR) {
-              return -1;
-          }
-          vTaskDelay(pdMS_TO_TICKS(1000));
-      }
+      if (at_wait(modem->at, sim800_socket_settled, &priv->socket_status[connid],
+                  SIM800_CONNECT_TIMEOUT * 1000) == -1)
+          return -1;
+      if (priv->socket_status[connid] == SIM800_SOCKET_STATUS_CONNECTED)
+          return 0;
     }
 
     return -1;
@@ -448,12 +574,12 @@ static int sim800_socket_connect(struct cellular *modem, int connid, const char
 
 static enum at_response_type scanner_cipsend(const char *line, size_t len, void *arg)
 {
-    (void) len;
     (void) arg;
 
-    int connid, amount;
+    struct at_fields fields;
+    int connid;
     char last;
-    if (sscanf(line, "DATA ACCEPT:%d,%d", &connid, &amount) == 2)
+    if (at_fields_parse(&fields, "DATA ACCEPT:", line, len) == 2)
         return AT_RESPONSE_FINAL_OK;
     if (sscanf(line, "%d, SEND O%c", &connid, &last) == 2 && last == 'K')
         return AT_RESPONSE_FINAL_OK;
@@ -466,6 +592,24 @@ static enum at_response_type scanner_cipsend(const char *line, size_t len, void
     return AT_RESPONSE_UNKNOWN;
 }
 
+static ssize_t sim800_cipsend(struct cellular *modem, int connid, const void *buffer, size_t amount)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    amount = amount > SIM800_MAX_SEND ? SIM800_MAX_SEND : amount;
+    /* Request transmission. */
+    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_expect_dataprompt(modem->at);
+    at_command_simple(modem->at, "AT+CIPSEND=%d,%zu", connid, amount);
+
+    /* Send raw data. */
+    priv->socket_unacked[connid] = true;
+    at_set_command_scanner(modem->at, scanner_cipsend);
+    at_command_raw_simple(modem->at, buffer, amount);
+
+    return amount;
+}
+
 static ssize_t sim800_socket_send(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
@@ -484,31 +628,62 @@ static ssize_t sim800_socket_send(struct cellular *modem, int connid, const void
       if(priv->socket_status[connid] != SIM800_SOCKET_STATUS_CONNECTED) {
         return -1;
       }
-      amount = amount > 1460 ? 1460 : amount;
-      /* Request transmission. */
-      at_set_timeout(modem->at, SET_TIMEOUT);
-      at_expect_dataprompt(modem->at);
-      at_command_simple(modem->at, "AT+CIPSEND=%d,%zu", connid, amount);
+      return cellular_sendbuf_write(&priv->sendbuf[connid], modem, connid, buffer, amount, sim800_cipsend);
+    }
 
-      /* Send raw data. */
-      at_set_command_scanner(modem->at, scanner_cipsend);
-      at_command_raw_simple(modem->at, buffer, amount);
-    } else {
-      return 0;
+    return 0;
+}
+
+static int sim800_socket_set_send_buffer(struct cellular *modem, int connid, void *buffer, size_t size, int delay_ms)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    if (connid < 0 || connid >= SIM800_NSOCKETS) {
+        errno = EINVAL;
+        return -1;
     }
 
-    return amount;
+    /* Anything bigger can't go out in one CIPSEND anyway. */
+    if (size > SIM800_MAX_SEND)
+        size = SIM800_MAX_SEND;
+    cellular_sendbuf_init(&priv->sendbuf[connid], buffer, size, delay_ms);
+
+    return 0;
+}
+
+static int sim800_socket_flush(struct cellular *modem, int connid)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    if (connid < 0 || connid >= SIM800_NSOCKETS)
+        return 0;
+
+    return cellular_sendbuf_flush(&priv->sendbuf[connid], modem, connid, sim800_cipsend);
+}
+
+/**
+ * Get the payload length from a "+CIPRXGET: 2,<connid>,<requested>,<confirmed>"
+ * line.
+ *
+ * @returns Payload length, -1 if it's some other line.
+ */
+static int sim800_ciprxget_length(const char *line, size_t len)
+{
+    struct at_fields fields;
+    int confirmed;
+    if (at_fields_parse(&fields, "+CIPRXGET: 2,", line, len) >= 3 &&
+        at_field_int(&fields, 2, &confirmed))
+        return confirmed;
+    return -1;
 }
 
 static enum at_response_type scanner_ciprxget(const char *line, size_t len, void *arg)
 {
-    (void) len;
     (void) arg;
 
-    int requested, confirmed;
-    if (sscanf(line, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed) == 2)
-        if (confirmed > 0)
-            return AT_RESPONSE_RAWDATA_FOLLOWS(confirmed);
+    int confirmed = sim800_ciprxget_length(line, len);
+    if (confirmed > 0)
+        return AT_RESPONSE_RAWDATA_FOLLOWS(confirmed);
 
     return AT_RESPONSE_UNKNOWN;
 }
@@ -526,57 +701,64 @@ static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buff
         return -1;
       }
 
-      /* Copy payload to result buffer. */
-      cnt = strlen(spp_recv_buf);
-      if(cnt) {
-          memcpy(buffer, spp_recv_buf, cnt);
-          *(((char*)buffer) + cnt) = '\0';
-          spp_recv_buf[0] = '\0';
-      }
+      /* Everything received so far, up to length bytes. */
+      cnt = sim800_spp_drain(priv, buffer, length);
     }
     else if(connid < SIM800_NSOCKETS) {
       if(priv->socket_status[connid] != SIM800_SOCKET_STATUS_CONNECTED) {
         return -1;
       }
+      /* Nothing arrived since the modem was last drained; don't ask. */
+      if (!priv->socket_readable[connid])
+        return 0;
       char tries = 4;
       while ( (cnt < (int) length) && tries-- ){
           int chunk = (int) length - cnt;
-          /* Limit read size to avoid overflowing AT response buffer. */
-          chunk = chunk > 480 ? 480 : chunk;
+          /* Limit read size to what the modem can return at once. */
+          chunk = chunk > SIM800_MAX_RECV ? SIM800_MAX_RECV : chunk;
+
+          /* Data arriving after the read is announced by a fresh URC,
+           * so clear the flag before asking, not after. */
+          priv->socket_readable[connid] = false;
 
-          /* Perform the read. */
+          /* Perform the read. Payload goes straight to the result buffer. */
           at_set_timeout(modem->at, SET_TIMEOUT);
           at_set_command_scanner(modem->at, scanner_ciprxget);
+          at_set_data_buffer(modem->at, (char *) buffer + cnt, chunk);
+          at_set_priority(modem->at, AT_PRIORITY_BULK);
           const char *response = at_command(modem->at, "AT+CIPRXGET=2,%d,%d", connid, chunk);
-          if (response == NULL)
-              return -1;
 
           /* Find the header line. */
-          int requested, confirmed;
+          int confirmed = -1;
           // TODO:
           // 1. connid is not checked
-          // 2. there is possible a bug here. if not all data are ready (confirmed < requested)
-          // then wierd things can happen. see memcpy
           // requested should be equal to chunk
           // confirmed is that what can be read
-          at_simple_scanf(response, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed);
+          if (response)
+              confirmed = sim800_ciprxget_length(response, strcspn(response, "\n"));
+          if (response && confirmed < 0) {
+              response = NULL;
+              errno = EPROTO;
+          }
+          if (response == NULL) {
+              /* The data may still be there, and no URC announces it
+               * again until the modem has been drained. */
+              priv->socket_readable[connid] = true;
+              return cnt ? cnt : -1;
+          }
 
           /* Bail out if we're out of data. */
           /* FIXME: We should maybe block until we receive something? */
           if (confirmed == 0)
               break;
 
-          /* Locate the payload. */
-          /* TODO: what if no \n is in input stream?
-           * should use strnchr at least */
-          const char *data = strchr(response, '\n');
-          if (data++ == NULL) {
-              return -1;
-          }
+          /* Anything beyond the chunk size was discarded by the parser. */
+          cnt += confirmed > chunk ? chunk : confirmed;
 
-          /* Copy payload to result buffer. */
-          memcpy((char *)buffer + cnt, data, confirmed);
-          cnt += confirmed;
+          /* A short read drained the modem's buffer. */
+          if (confirmed < chunk)
+              break;
+          priv->socket_readable[connid] = true;
       }
     }
 
@@ -585,11 +767,18 @@ static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buff
 
 static int sim800_socket_waitack(struct cellular *modem, int connid)
 {
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
     const char *response;
     if(connid == SIM800_NSOCKETS) {
       return 0;
     } else if(connid < SIM800_NSOCKETS) {
+      /* Buffered data has to go out before it can be acknowledged. */
+      if (sim800_socket_flush(modem, connid) != 0)
+          return -1;
+
       at_set_timeout(modem->at, 5);
+      /* There's no URC for acknowledgements, so this has to poll; the
+       * "CLOSED" URC cuts the wait short, though. */
       for (int i=0; i<SIM800_WAITACK_TIMEOUT; i++) {
           /* Read number of bytes waiting. */
           int nacklen;
@@ -597,15 +786,130 @@ static int sim800_socket_waitack(struct cellular *modem, int connid)
           at_simple_scanf(response, "+CIPACK: %*d,%*d,%d", &nacklen);
 
           /* Return if all bytes were acknowledged. */
-          if (nacklen == 0)
+          if (nacklen == 0) {
+              priv->socket_unacked[connid] = false;
               return 0;
+          }
 
-          vTaskDelay(pdMS_TO_TICKS(1000));
+          if (at_wait(modem->at, sim800_socket_failed, &priv->socket_status[connid],
+                      SIM800_WAITACK_POLL_MS) == 0) {
+              errno = ECONNRESET;
+              return -1;
+          }
       }
+      errno = ETIMEDOUT;
     }
     return -1;
 }
 
+/**
+ * Fill in revents from what the URCs told us so far. Doesn't talk to the
+ * modem, so it's usable as an at_wait() condition.
+ */
+static int sim800_poll_scan(struct cellular_sim800 *priv, struct cellular_pollfd *fds, size_t nfds)
+{
+    int count = 0;
+
+    for (size_t i=0; i<nfds; i++) {
+        int connid = fds[i].connid;
+        short revents = 0;
+
+        if (connid == SIM800_NSOCKETS) {
+            if (priv->spp_status != SIM800_SOCKET_STATUS_CONNECTED)
+                revents |= CELLULAR_POLLHUP;
+            else
+                revents |= CELLULAR_POLLOUT | (priv->spp_head != priv->spp_tail ? CELLULAR_POLLIN : 0);
+        } else if (connid >= 0 && connid < SIM800_NSOCKETS) {
+            if (priv->socket_status[connid] != SIM800_SOCKET_STATUS_CONNECTED)
+                revents |= CELLULAR_POLLHUP;
+            if (priv->socket_readable[connid])
+                revents |= CELLULAR_POLLIN;
+            if (!priv->socket_unacked[connid] && !priv->sendbuf[connid].used &&
+                !(revents & CELLULAR_POLLHUP))
+                revents |= CELLULAR_POLLOUT;
+        } else {
+            revents |= CELLULAR_POLLHUP;
+        }
+
+        fds[i].revents = revents & (fds[i].events | CELLULAR_POLLHUP);
+        if (fds[i].revents)
+            count++;
+    }
+
+    return count;
+}
+
+struct sim800_poll_wait {
+    struct cellular_sim800 *priv;
+    struct cellular_pollfd *fds;
+    size_t nfds;
+};
+
+static bool sim800_poll_ready(void *arg)
+{
+    struct sim800_poll_wait *wait = arg;
+    return sim800_poll_scan(wait->priv, wait->fds, wait->nfds) > 0;
+}
+
+static int sim800_socket_poll(struct cellular *modem, struct cellular_pollfd *fds, size_t nfds, int timeout_ms)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+    struct sim800_poll_wait wait = { .priv = priv, .fds = fds, .nfds = nfds };
+
+    for (;;) {
+        /* There's no URC for acknowledgements; ask about the sockets that
+         * want them. Everything else is known without a round trip. */
+        bool acking = false;
+        int flush_ms = -1;
+        for (size_t i=0; i<nfds; i++) {
+            int connid = fds[i].connid;
+            if (connid < 0 || connid >= SIM800_NSOCKETS ||
+                priv->socket_status[connid] != SIM800_SOCKET_STATUS_CONNECTED)
+                continue;
+
+            /* Push out send buffers that are due (or block POLLOUT). */
+            int due = cellular_sendbuf_due(&priv->sendbuf[connid]);
+            if (due == 0 || (due > 0 && (fds[i].events & CELLULAR_POLLOUT))) {
+                sim800_socket_flush(modem, connid);
+                due = cellular_sendbuf_due(&priv->sendbuf[connid]);
+                /* Still there? Sending failed; don't spin on it. */
+                if (due == 0)
+                    due = SIM800_WAITACK_POLL_MS;
+            }
+            if (due >= 0 && (flush_ms == -1 || due < flush_ms))
+                flush_ms = due;
+
+            if (!(fds[i].events & CELLULAR_POLLOUT) || !priv->socket_unacked[connid])
+                continue;
+
+            int nacklen;
+            at_set_timeout(modem->at, 5);
+            const char *response = at_command(modem->at, "AT+CIPACK=%d", connid);
+            at_simple_scanf(response, "+CIPACK: %*d,%*d,%d", &nacklen);
+            if (nacklen == 0)
+                priv->socket_unacked[connid] = false;
+            else
+                acking = true;
+        }
+
+        int count = sim800_poll_scan(priv, fds, nfds);
+        if (count || timeout_ms == 0)
+            return count;
+
+        /* Sleep until a URC changes something, waking up now and then to
+         * re-check acknowledgements. */
+        int slice = acking ? SIM800_WAITACK_POLL_MS : 1000;
+        if (flush_ms >= 0 && flush_ms < slice)
+            slice = flush_ms ? flush_ms : 1;
+        if (timeout_ms > 0 && timeout_ms < slice)
+            slice = timeout_ms;
+        if (at_wait(modem->at, sim800_poll_ready, &wait, slice) == 0)
+            return sim800_poll_scan(priv, fds, nfds);
+        if (timeout_ms > 0)
+            timeout_ms -= slice;
+    }
+}
+
 static enum at_response_type scanner_cipclose(const char *line, size_t len, void *arg)
 {
     (void) len;
@@ -615,6 +919,8 @@ static enum at_response_type scanner_cipclose(const char *line, size_t len, void
     char last;
     if (sscanf(line, "%d, CLOSE O%c", &connid, &last) == 2 && last == 'K')
         return AT_RESPONSE_FINAL_OK;
+    if (!strcmp(line, "CLOSE OK"))
+        return AT_RESPONSE_FINAL_OK;
     return AT_RESPONSE_UNKNOWN;
 }
 
@@ -625,101 +931,287 @@ int sim800_socket_close(struct cellular *modem, int connid)
     if(connid == SIM800_NSOCKETS) {
       at_command_simple(modem->at, "AT+BTDISCONN=%d", priv->spp_connid);
     } else if(connid < SIM800_NSOCKETS) {
+      /* Don't lose buffered data, then let go of the caller's buffer. */
+      if (priv->socket_status[connid] == SIM800_SOCKET_STATUS_CONNECTED)
+          sim800_socket_flush(modem, connid);
+      cellular_sendbuf_init(&priv->sendbuf[connid], NULL, 0, 0);
+
       at_set_timeout(modem->at, SET_TIMEOUT);
       at_set_command_scanner(modem->at, scanner_cipclose);
       at_command_simple(modem->at, "AT+CIPCLOSE=%d", connid);
+      priv->socket_status[connid] = SIM800_SOCKET_STATUS_UNKNOWN;
+    }
+    return 0;
+}
+
+static enum at_response_type scanner_cipstart_transparent(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
+
+    /* The connection result follows the OK. */
+    if (!strcmp(line, "OK"))
+        return AT_RESPONSE_INTERMEDIATE;
+    if (!strcmp(line, "CONNECT"))
+        return AT_RESPONSE_FINAL_OK;
+    if (!strcmp(line, "CONNECT FAIL") || !strcmp(line, "ALREADY CONNECT"))
+        return AT_RESPONSE_FINAL;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+/**
+ * Switch between single and multiple connection modes. Both CIPMUX and
+ * CIPMODE only change while the IP application is down.
+ */
+static int sim800_set_transparent(struct cellular *modem, bool transparent)
+{
+    const char *mux = transparent ? "0" : "1";
+    const char *mode = transparent ? "1" : "0";
+
+    /* Order matters: CIPMODE=1 requires CIPMUX=0. */
+    if (transparent &&
+        sim800_config(modem, "CIPMUX", mux, 1) == 0 &&
+        sim800_config(modem, "CIPMODE", mode, 1) == 0)
+        return 0;
+    if (!transparent &&
+        sim800_config(modem, "CIPMODE", mode, 1) == 0 &&
+        sim800_config(modem, "CIPMUX", mux, 1) == 0)
+        return 0;
+
+    sim800_pdp_close(modem);
+    if (transparent) {
+        if (sim800_config(modem, "CIPMUX", mux, SIM800_CIPCFG_RETRIES) != 0 ||
+            sim800_config(modem, "CIPMODE", mode, SIM800_CIPCFG_RETRIES) != 0)
+            return -1;
+    } else {
+        if (sim800_config(modem, "CIPMODE", mode, SIM800_CIPCFG_RETRIES) != 0 ||
+            sim800_config(modem, "CIPMUX", mux, SIM800_CIPCFG_RETRIES) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int sim800_socket_stream_open(struct cellular *modem, const char *host, uint16_t port, at_data_handler_t handler, void *arg)
+{
+    /* Transparent mode only works with a single connection. */
+    if (sim800_set_transparent(modem, true) != 0)
+        return -1;
+
+    if (cellular_pdp_request(modem) != 0)
+        return -1;
+
+    at_set_data_handler(modem->at, handler, arg);
+    at_set_timeout(modem->at, SIM800_CONNECT_TIMEOUT);
+    at_set_command_scanner(modem->at, scanner_cipstart_transparent);
+    at_expect_datamode(modem->at);
+    const char *response = at_command(modem->at, "AT+CIPSTART=\"TCP\",\"%s\",%d", host, port);
+    if (response == NULL || strcmp(response, "OK")) {
+        cellular_pdp_failure(modem);
+        return -1;
     }
+    cellular_pdp_success(modem);
+
+    return 0;
+}
+
+static int sim800_socket_stream_close(struct cellular *modem)
+{
+    int result = 0;
+
+    if (at_leave_datamode(modem->at) != 0)
+        result = -1;
+
+    /* Fails harmlessly if the remote end has already closed. */
+    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_set_command_scanner(modem->at, scanner_cipclose);
+    at_command(modem->at, "AT+CIPCLOSE");
+    at_set_data_handler(modem->at, NULL, NULL);
+
+    /* The socket ops need multiple connection mode back. */
+    if (sim800_set_transparent(modem, false) != 0)
+        result = -1;
+
+    return result;
+}
+
+/**
+ * Set a quoted string parameter, e.g. AT+FTPSERV="host". The value goes
+ * out as is, so there's no limit on its length.
+ */
+static int sim800_set_string(struct cellular *modem, const char *command, const char *value)
+{
+    const struct iovec iov[] = {
+        { (void *) command, strlen(command) },
+        { (void *) "=\"", 2 },
+        { (void *) value, strlen(value) },
+        { (void *) "\"\r", 2 },
+    };
+    const char *response = at_command_iov(modem->at, iov, 4);
+    if (!response || strcmp(response, ""))
+        return -1;
     return 0;
 }
 
 static int sim800_ftp_open(struct cellular *modem, const char *host, uint16_t port, const char *username, const char *password, bool passive)
 {
     /* Configure server parameters. */
-    at_command_simple(modem->at, "AT+FTPCID=1");
-    at_command_simple(modem->at, "AT+FTPSERV=\"%s\"", host);
-    at_command_simple(modem->at, "AT+FTPPORT=%d", port);
-    at_command_simple(modem->at, "AT+FTPUN=\"%s\"", username);
-    at_command_simple(modem->at, "AT+FTPPW=\"%s\"", password);
-    at_command_simple(modem->at, "AT+FTPMODE=%d", (int) passive);
-    at_command_simple(modem->at, "AT+FTPTYPE=I");
+    char port_str[24], mode[16];
+    snprintf(port_str, sizeof(port_str), "AT+FTPPORT=%d", port);
+    snprintf(mode, sizeof(mode), "AT+FTPMODE=%d", (int) passive);
+
+    const char *const commands[] = {
+        "AT+FTPCID=1",
+        port_str,
+        mode,
+        "AT+FTPTYPE=I",
+        NULL
+    };
+    if (at_command_batch(modem->at, commands) != 0)
+        return -1;
+
+    /* Hosts and credentials are too long to be combined safely. */
+    if (sim800_set_string(modem, "AT+FTPSERV", host) != 0 ||
+        sim800_set_string(modem, "AT+FTPUN", username) != 0 ||
+        sim800_set_string(modem, "AT+FTPPW", password) != 0)
+        return -1;
 
     return 0;
 }
 
-static int sim800_ftp_get(struct cellular *modem, const char *filename)
+static int sim800_ftp_name(struct cellular *modem, const char *filename)
 {
-    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
-
-    /* Configure filename. */
     at_command_simple(modem->at, "AT+FTPGETPATH=\"/\"");
     at_command_simple(modem->at, "AT+FTPGETNAME=\"%s\"", filename);
 
+    return 0;
+}
+
+static bool sim800_ftpsize_reported(void *arg)
+{
+    const struct cellular_sim800 *priv = arg;
+    return priv->ftpsize_status != -1;
+}
+
+static ssize_t sim800_ftp_size(struct cellular *modem, const char *filename)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    if (sim800_ftp_name(modem, filename) != 0)
+        return -1;
+
+    /* The size comes in a "+FTPSIZE: 1,<error>,<size>" URC. */
+    priv->ftpsize_status = -1;
+    cellular_command_simple_pdp(modem, "AT+FTPSIZE");
+    if (at_wait(modem->at, sim800_ftpsize_reported, priv, SIM800_FTP_TIMEOUT * 1000) == -1)
+        return -1;
+
+    if (priv->ftpsize_status != 0 || priv->ftpsize < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    return priv->ftpsize;
+}
+
+static int sim800_ftp_start(struct cellular *modem, const char *filename, size_t offset)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    /* Configure filename and where to start. The offset sticks, so only
+     * bother when it changes. */
+    if (sim800_ftp_name(modem, filename) != 0)
+        return -1;
+    if (offset || priv->ftp_rest) {
+        at_command_simple(modem->at, "AT+FTPREST=%zu", offset);
+        priv->ftp_rest = offset != 0;
+    }
+
     /* Try to open the connection. */
     priv->ftpget1_status = -1;
     cellular_command_simple_pdp(modem, "AT+FTPGET=1");
 
     /* Wait for the operation result. */
-    for (int i=0; i<SIM800_FTP_TIMEOUT; i++) {
-        if (priv->ftpget1_status == 1)
-            return 0;
+    if (at_wait(modem->at, sim800_ftpget1_reported, priv, SIM800_FTP_TIMEOUT * 1000) == -1)
+        return -1;
 
-        if (priv->ftpget1_status != -1) {
-            return -1;
-        }
+    return priv->ftpget1_status == 1 ? 0 : -1;
+}
 
-        vTaskDelay(pdMS_TO_TICKS(1000));
-    }
+static int sim800_ftp_get(struct cellular *modem, const char *filename)
+{
+    return sim800_ftp_start(modem, filename, 0);
+}
 
+static int sim800_ftp_get_from(struct cellular *modem, const char *filename, size_t offset)
+{
+    return sim800_ftp_start(modem, filename, offset);
+}
+
+/**
+ * Get the payload length from a "+FTPGET: 2,<cnflength>" line.
+ *
+ * @returns Payload length, -1 if it's some other line.
+ */
+static int sim800_ftpget2_length(const char *line, size_t len)
+{
+    struct at_fields fields;
+    int cnflength;
+    if (at_fields_parse(&fields, "+FTPGET: 2,", line, len) >= 1 &&
+        at_field_int(&fields, 0, &cnflength))
+        return cnflength;
     return -1;
 }
 
 static enum at_response_type scanner_ftpget2(const char *line, size_t len, void *arg)
 {
-    (void) len;
     (void) arg;
 
-    int cnflength;
     /* TODO: Verify if cnflength is indeed the size of raw payload. */
-    if (sscanf(line, "+FTPGET: 2,%d", &cnflength) == 1)
+    int cnflength = sim800_ftpget2_length(line, len);
+    if (cnflength >= 0)
         return AT_RESPONSE_RAWDATA_FOLLOWS(cnflength);
     return AT_RESPONSE_UNKNOWN;
 }
 
+static int sim800_ftp_parse(const char *response)
+{
+    return sim800_ftpget2_length(response, strcspn(response, "\n"));
+}
+
 static int sim800_ftp_getdata(struct cellular *modem, char *buffer, size_t length)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
 
-    int retries = 0;
+    /* Limit read size to what the modem can return at once. */
+    if (length > SIM800_MAX_RECV)
+        length = SIM800_MAX_RECV;
+
+    struct sim800_ftpget1_wait wait = { .priv = priv };
 retry:
+    /* Remember where we were, so an URC arriving mid-read isn't missed. */
+    wait.events = priv->ftpget1_events;
+
     at_set_timeout(modem->at, SET_TIMEOUT);
     at_set_command_scanner(modem->at, scanner_ftpget2);
+    at_set_data_buffer(modem->at, buffer, length);
+    at_set_priority(modem->at, AT_PRIORITY_BULK);
     const char *response = at_command(modem->at, "AT+FTPGET=2,%zu", length);
 
     if (response == NULL)
         return -1;
 
-    int cnflength;
-    if (sscanf(response, "+FTPGET: 2,%d", &cnflength) == 1) {
-        /* Zero means no data is available. Wait for it. */
+    int cnflength = sim800_ftp_parse(response);
+    if (cnflength >= 0) {
+        /* Zero means no data is available. Wait for the modem to say
+         * there's more (or that the transfer is over). */
         if (cnflength == 0) {
-            /* Bail out on timeout. */
-            if (++retries >= SIM800_FTP_TIMEOUT) {
+            if (at_wait(modem->at, sim800_ftpget1_changed, &wait, SIM800_FTP_TIMEOUT * 1000) == -1)
                 return -1;
-            }
-            vTaskDelay(pdMS_TO_TICKS(1000));
             goto retry;
         }
 
-        /* Locate the payload. */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
-            return -1;
-        }
-        data += 1;
-
-        /* Copy payload to result buffer. */
-        memcpy((char *)buffer, data, cnflength);
-        return cnflength;
+        /* Payload was stored in the result buffer by the parser. */
+        return cnflength > (int) length ? (int) length : cnflength;
     } else if (priv->ftpget1_status == 0) {
         /* Transfer finished. */
         return 0;
@@ -728,6 +1220,48 @@ retry:
     }
 }
 
+static void sim800_ftp_wait(struct cellular *modem)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+    struct sim800_ftpget1_wait wait = {
+        .priv = priv,
+        .events = priv->ftpget1_events,
+    };
+
+    /* Short wait; the engine bounds the number of attempts. */
+    at_wait(modem->at, sim800_ftpget1_changed, &wait, SIM800_FTP_POLL_MS);
+}
+
+static bool sim800_ftp_finished(struct cellular *modem)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+    return priv->ftpget1_status == 0;
+}
+
+static const struct cellular_download_ops sim800_ftp_download_ops = {
+    .command = "AT+FTPGET=2,%d",
+    .scanner = scanner_ftpget2,
+    .chunk = SIM800_MAX_RECV,
+    .timeout_ms = SET_TIMEOUT * 1000,
+    .retries = SIM800_FTP_TIMEOUT * 1000 / SIM800_FTP_POLL_MS,
+    .parse = sim800_ftp_parse,
+    .wait = sim800_ftp_wait,
+    .finished = sim800_ftp_finished,
+};
+
+static int sim800_ftp_download(struct cellular *modem, const char *filename, cellular_sink_t sink, void *ctx)
+{
+    if (sim800_ftp_get(modem, filename) == -1)
+        return -1;
+
+#ifdef AT_NO_MALLOC
+    void *bufs = ((struct cellular_sim800 *) modem)->download_buf;
+#else
+    void *bufs = NULL;
+#endif
+    return cellular_download(modem, &sim800_ftp_download_ops, bufs, sink, ctx);
+}
+
 static int sim800_ftp_close(struct cellular *modem)
 {
     /* Requires fairly recent SIM800 firmware. */
@@ -755,28 +1289,68 @@ static const struct cellular_ops sim800_ops = {
     .socket_recv = sim800_socket_recv,
     .socket_waitack = sim800_socket_waitack,
     .socket_close = sim800_socket_close,
+    .socket_poll = sim800_socket_poll,
+    .socket_set_send_buffer = sim800_socket_set_send_buffer,
+    .socket_flush = sim800_socket_flush,
+    .socket_stream_open = sim800_socket_stream_open,
+    .socket_stream_close = sim800_socket_stream_close,
     .ftp_open = sim800_ftp_open,
     .ftp_get = sim800_ftp_get,
+    .ftp_get_from = sim800_ftp_get_from,
+    .ftp_size = sim800_ftp_size,
     .ftp_getdata = sim800_ftp_getdata,
+    .ftp_download = sim800_ftp_download,
     .ftp_close = sim800_ftp_close,
 };
 
-struct cellular *cellular_sim800_alloc(void)
+size_t cellular_sim800_size(void)
 {
-    struct cellular_sim800 *modem = malloc(sizeof(struct cellular_sim800));
-    if (modem == NULL) {
+    return sizeof(struct cellular_sim800);
+}
+
+struct cellular *cellular_sim800_init(void *storage, size_t size, enum cellular_sim800_profile profile)
+{
+    if (size < sizeof(struct cellular_sim800)) {
+        errno = ENOMEM;
         return NULL;
     }
+
+    struct cellular_sim800 *modem = storage;
     memset(modem, 0, sizeof(*modem));
 
     modem->dev.ops = &sim800_ops;
+    modem->profile = profile;
+
+    at_prefix_matcher_init(&modem->urc_matcher, modem->urc_entries,
+                           sizeof(modem->urc_entries) / sizeof(*modem->urc_entries));
+    at_prefix_matcher_add(&modem->urc_matcher, sim800_urc_responses, AT_RESPONSE_URC);
 
     return (struct cellular *) modem;
 }
 
+unsigned int cellular_sim800_spp_dropped(struct cellular *modem)
+{
+    struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
+
+    return priv->spp_dropped;
+}
+
+#ifndef AT_NO_MALLOC
+struct cellular *cellular_sim800_alloc(enum cellular_sim800_profile profile)
+{
+    void *modem = malloc(sizeof(struct cellular_sim800));
+    if (modem == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return cellular_sim800_init(modem, sizeof(struct cellular_sim800), profile);
+}
+
 void cellular_sim800_free(struct cellular *modem)
 {
     free(modem);
 }
+#endif
 
 /* vim: set ts=4 sw=4 et: */
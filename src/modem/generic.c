@@ -8,6 +8,7 @@
 
 #include <attentive/cellular.h>
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -28,21 +29,42 @@ static const struct cellular_ops generic_ops = {
 };
 
 
-struct cellular *cellular_generic_alloc(void)
+size_t cellular_generic_size(void)
 {
-    struct cellular_generic *modem = malloc(sizeof(struct cellular_generic));
-    if (modem == NULL) {
+    return sizeof(struct cellular_generic);
+}
+
+struct cellular *cellular_generic_init(void *storage, size_t size)
+{
+    if (size < sizeof(struct cellular_generic)) {
+        errno = ENOMEM;
         return NULL;
     }
 
+    struct cellular_generic *modem = storage;
+    memset(modem, 0, sizeof(*modem));
+
     modem->dev.ops = &generic_ops;
 
     return (struct cellular *) modem;
 }
 
+#ifndef AT_NO_MALLOC
+struct cellular *cellular_generic_alloc(void)
+{
+    void *modem = malloc(sizeof(struct cellular_generic));
+    if (modem == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return cellular_generic_init(modem, sizeof(struct cellular_generic));
+}
+
 void cellular_generic_free(struct cellular *modem)
 {
     free(modem);
 }
+#endif
 
 /* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,796 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Several modems behind a single struct cellular. Sockets are spread over
+ * the members and moved when a member's data context goes away; FTP
+ * downloads can be split by range.
+ */
+
+#include <attentive/cellular.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "at-common.h"
+#define printf(...)
+
+/* Time slice for waiting on one member while polling several. */
+#define GROUP_POLL_SLICE_MS     50
+
+/* Files smaller than this aren't worth splitting. */
+#define GROUP_FTP_SPLIT_MIN     (16 * 1024)
+
+/* Read size for split downloads; what the modems return at once. */
+#define GROUP_FTP_CHUNK         1460
+
+struct cellular_group_member {
+    struct cellular *modem;
+    int connid_base;            /**< First connection id on the modem. */
+    int nsockets;
+    int sockets;                /**< Group sockets currently on it. */
+    bool ftp;                   /**< ftp_open() succeeded. */
+};
+
+struct cellular_group_socket {
+    int member;                 /**< Member carrying it, -1 if unused. */
+    int connid;                 /**< Connection id on the member. */
+    char host[CELLULAR_GROUP_HOST_LENGTH];
+    uint16_t port;
+
+    /* Send buffer setup, applied again after a failover. */
+    void *sendbuf;
+    size_t sendbuf_size;
+    int sendbuf_delay_ms;
+};
+
+struct cellular_group {
+    struct cellular dev;
+
+    struct cellular_group_member members[CELLULAR_GROUP_MEMBERS];
+    int nmembers;
+    struct cellular_group_socket sockets[CELLULAR_GROUP_NSOCKETS];
+    int ftp_member;             /**< Member doing undivided FTP work, -1 if none. */
+
+    char ftp_buf[GROUP_FTP_CHUNK];
+};
+
+/**
+ * Helper, looks up an open group socket.
+ */
+static struct cellular_group_socket *group_socket(struct cellular_group *priv, int connid)
+{
+    if (connid < 0 || connid >= CELLULAR_GROUP_NSOCKETS || priv->sockets[connid].member == -1) {
+        errno = EBADF;
+        return NULL;
+    }
+    return &priv->sockets[connid];
+}
+
+static struct cellular *group_modem(struct cellular_group *priv, const struct cellular_group_socket *sock)
+{
+    return priv->members[sock->member].modem;
+}
+
+/**
+ * Helper, signal strength for ranking members; -1 if unknown.
+ */
+static int group_rssi(struct cellular *modem)
+{
+    int rssi = modem->ops->rssi ? modem->ops->rssi(modem) : -1;
+    return rssi >= 0 && rssi <= 31 ? rssi : -1;
+}
+
+/**
+ * Pick the member a new socket should go to: one with a free connection,
+ * a usable data context, the fewest sockets and the best signal, in that
+ * order. Members marked in skip are left out.
+ *
+ * @returns Member index, -1 if there's none left.
+ */
+static int group_pick(struct cellular_group *priv, const bool *skip)
+{
+    int best = -1, best_rssi = -1;
+
+    for (int i=0; i<priv->nmembers; i++) {
+        struct cellular_group_member *member = &priv->members[i];
+        struct cellular *modem = member->modem;
+
+        if (skip[i] || !modem->ops->socket_connect || member->sockets >= member->nsockets)
+            continue;
+        /* Stuck contexts need a pdp_close() first; that's not ours to do. */
+        if (modem->pdp_state == CELLULAR_PDP_STUCK)
+            continue;
+
+        int rssi = group_rssi(modem);
+        if (best == -1 || member->sockets < priv->members[best].sockets ||
+            (member->sockets == priv->members[best].sockets && rssi > best_rssi)) {
+            best = i;
+            best_rssi = rssi;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Helper, finds a connection id on a member not taken by another socket.
+ */
+static int group_free_connid(struct cellular_group *priv, int index)
+{
+    const struct cellular_group_member *member = &priv->members[index];
+
+    for (int connid = member->connid_base; connid < member->connid_base + member->nsockets; connid++) {
+        bool taken = false;
+        for (int i=0; i<CELLULAR_GROUP_NSOCKETS; i++)
+            if (priv->sockets[i].member == index && priv->sockets[i].connid == connid)
+                taken = true;
+        if (!taken)
+            return connid;
+    }
+    return -1;
+}
+
+/**
+ * Connect a socket on the best member that manages to, skipping those
+ * marked in skip. The socket is left unused on failure.
+ */
+static int group_connect(struct cellular_group *priv, struct cellular_group_socket *sock, bool *skip)
+{
+    int error = ENETUNREACH;
+    int index;
+
+    while ((index = group_pick(priv, skip)) != -1) {
+        struct cellular_group_member *member = &priv->members[index];
+        struct cellular *modem = member->modem;
+        int connid = group_free_connid(priv, index);
+
+        skip[index] = true;
+        errno = 0;
+        if (modem->ops->socket_connect(modem, connid, sock->host, sock->port) == 0) {
+            printf("[group@%p] socket %d: member %d, connid %d\n",
+                   priv, (int) (sock - priv->sockets), index, connid);
+            sock->member = index;
+            sock->connid = connid;
+            member->sockets++;
+
+            if (sock->sendbuf && modem->ops->socket_set_send_buffer)
+                modem->ops->socket_set_send_buffer(modem, connid, sock->sendbuf,
+                                                   sock->sendbuf_size, sock->sendbuf_delay_ms);
+            return 0;
+        }
+        if (errno)
+            error = errno;
+    }
+
+    errno = error;
+    return -1;
+}
+
+/**
+ * Helper, forgets where a socket was.
+ */
+static void group_release(struct cellular_group *priv, struct cellular_group_socket *sock)
+{
+    priv->members[sock->member].sockets--;
+    sock->member = -1;
+}
+
+/**
+ * Stop the member using the socket's send buffer before its connid goes
+ * back to the pool; whoever gets the connid next must not write into it.
+ * Anything still buffered is dropped, so close the socket (which flushes)
+ * first.
+ */
+static void group_unbuffer(struct cellular *member, struct cellular_group_socket *sock)
+{
+    if (sock->sendbuf && member->ops->socket_set_send_buffer)
+        member->ops->socket_set_send_buffer(member, sock->connid, NULL, 0, 0);
+}
+
+/**
+ * Check a failed socket operation. If the member has lost its data
+ * context, reconnect the socket on another one. Whatever was in flight is
+ * gone either way, so the operation still fails, with ECONNRESET if the
+ * socket was moved.
+ *
+ * @returns -1 always.
+ */
+static int group_failed(struct cellular_group *priv, struct cellular_group_socket *sock)
+{
+    int error = errno;
+    struct cellular *modem = group_modem(priv, sock);
+
+    if (modem->pdp_state == CELLULAR_PDP_UP) {
+        errno = error;
+        return -1;
+    }
+
+    printf("[group@%p] socket %d: member %d lost its context\n",
+           priv, (int) (sock - priv->sockets), sock->member);
+
+    /* Tidy up the old connection; it's probably gone already. */
+    int old = sock->member;
+    if (modem->ops->socket_close)
+        modem->ops->socket_close(modem, sock->connid);
+    group_unbuffer(modem, sock);
+    group_release(priv, sock);
+
+    bool skip[CELLULAR_GROUP_MEMBERS] = { false };
+    skip[old] = true;
+    if (group_connect(priv, sock, skip) == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    /* Nowhere to go; stay on the old member and let pdp_open() bring it
+     * back eventually. */
+    sock->member = old;
+    priv->members[old].sockets++;
+    if (sock->sendbuf && modem->ops->socket_set_send_buffer)
+        modem->ops->socket_set_send_buffer(modem, sock->connid, sock->sendbuf,
+                                           sock->sendbuf_size, sock->sendbuf_delay_ms);
+    errno = error;
+    return -1;
+}
+
+static int group_pdp_open(struct cellular *modem, const char *apn)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    int result = -1, error = ENETDOWN;
+
+    /* Any member with a context is good enough. */
+    for (int i=0; i<priv->nmembers; i++) {
+        struct cellular *member = priv->members[i].modem;
+        if (!member->ops->pdp_open)
+            continue;
+        if (member->ops->pdp_open(member, apn) == 0)
+            result = 0;
+        else
+            error = errno;
+    }
+
+    if (result == -1)
+        errno = error;
+    return result;
+}
+
+static int group_pdp_close(struct cellular *modem)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    int result = 0, error = 0;
+
+    for (int i=0; i<priv->nmembers; i++) {
+        struct cellular *member = priv->members[i].modem;
+        if (member->ops->pdp_close && member->ops->pdp_close(member) != 0) {
+            error = errno;
+            result = -1;
+        }
+    }
+
+    if (result == -1)
+        errno = error;
+    return result;
+}
+
+static int group_creg(struct cellular *modem)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    int result = -1;
+
+    /* Registered anywhere beats everything else. */
+    for (int i=0; i<priv->nmembers; i++) {
+        struct cellular *member = priv->members[i].modem;
+        int creg = member->ops->creg ? member->ops->creg(member) : -1;
+        if (creg == CREG_REGISTERED_HOME || creg == CREG_REGISTERED_ROAMING)
+            return creg;
+        if (creg != -1)
+            result = creg;
+    }
+
+    if (result == -1)
+        errno = ENODEV;
+    return result;
+}
+
+static int group_rssi_op(struct cellular *modem)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    int result = -1;
+
+    for (int i=0; i<priv->nmembers; i++) {
+        int rssi = group_rssi(priv->members[i].modem);
+        if (rssi > result)
+            result = rssi;
+    }
+
+    if (result == -1)
+        errno = ENODEV;
+    return result;
+}
+
+static int group_socket_connect(struct cellular *modem, int connid, const char *host, uint16_t port)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+
+    if (connid < 0 || connid >= CELLULAR_GROUP_NSOCKETS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (strlen(host) >= CELLULAR_GROUP_HOST_LENGTH) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    /* Reconnecting an open socket starts over. */
+    struct cellular_group_socket *sock = &priv->sockets[connid];
+    if (sock->member != -1) {
+        struct cellular *old = group_modem(priv, sock);
+        if (old->ops->socket_close)
+            old->ops->socket_close(old, sock->connid);
+        group_release(priv, sock);
+    }
+
+    strcpy(sock->host, host);
+    sock->port = port;
+
+    bool skip[CELLULAR_GROUP_MEMBERS] = { false };
+    return group_connect(priv, sock, skip);
+}
+
+static ssize_t group_socket_send(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    struct cellular_group_socket *sock = group_socket(priv, connid);
+    if (!sock)
+        return -1;
+
+    struct cellular *member = group_modem(priv, sock);
+    ssize_t result = member->ops->socket_send(member, sock->connid, buffer, amount, flags);
+    return result == -1 ? group_failed(priv, sock) : result;
+}
+
+static ssize_t group_socket_recv(struct cellular *modem, int connid, void *buffer, size_t length, int flags)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    struct cellular_group_socket *sock = group_socket(priv, connid);
+    if (!sock)
+        return -1;
+
+    struct cellular *member = group_modem(priv, sock);
+    ssize_t result = member->ops->socket_recv(member, sock->connid, buffer, length, flags);
+    return result == -1 ? group_failed(priv, sock) : result;
+}
+
+static int group_socket_waitack(struct cellular *modem, int connid)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    struct cellular_group_socket *sock = group_socket(priv, connid);
+    if (!sock)
+        return -1;
+
+    struct cellular *member = group_modem(priv, sock);
+    if (!member->ops->socket_waitack)
+        return 0;
+    return member->ops->socket_waitack(member, sock->connid) == -1 ? group_failed(priv, sock) : 0;
+}
+
+static int group_socket_close(struct cellular *modem, int connid)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    struct cellular_group_socket *sock = group_socket(priv, connid);
+    if (!sock)
+        return -1;
+
+    struct cellular *member = group_modem(priv, sock);
+    int result = member->ops->socket_close ? member->ops->socket_close(member, sock->connid) : 0;
+    group_unbuffer(member, sock);
+    group_release(priv, sock);
+    sock->sendbuf = NULL;
+    return result;
+}
+
+static int group_socket_set_send_buffer(struct cellular *modem, int connid, void *buffer, size_t size, int delay_ms)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    struct cellular_group_socket *sock = group_socket(priv, connid);
+    if (!sock)
+        return -1;
+
+    struct cellular *member = group_modem(priv, sock);
+    if (!member->ops->socket_set_send_buffer) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (member->ops->socket_set_send_buffer(member, sock->connid, buffer, size, delay_ms) != 0)
+        return -1;
+
+    sock->sendbuf = buffer;
+    sock->sendbuf_size = size;
+    sock->sendbuf_delay_ms = delay_ms;
+    return 0;
+}
+
+static int group_socket_flush(struct cellular *modem, int connid)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    struct cellular_group_socket *sock = group_socket(priv, connid);
+    if (!sock)
+        return -1;
+
+    struct cellular *member = group_modem(priv, sock);
+    if (!member->ops->socket_flush)
+        return 0;
+    return member->ops->socket_flush(member, sock->connid) == -1 ? group_failed(priv, sock) : 0;
+}
+
+/**
+ * Poll the sockets on one member. Members that can't poll report every
+ * socket ready for whatever was asked; their recv() just comes back empty.
+ */
+static int group_poll_member(struct cellular_group *priv, int index,
+                             struct cellular_pollfd *fds, size_t nfds, int timeout_ms)
+{
+    struct cellular *modem = priv->members[index].modem;
+    struct cellular_pollfd mfds[CELLULAR_GROUP_NSOCKETS];
+    size_t map[CELLULAR_GROUP_NSOCKETS];
+    size_t count = 0;
+
+    for (size_t i=0; i<nfds && count<CELLULAR_GROUP_NSOCKETS; i++) {
+        int connid = fds[i].connid;
+        if (connid < 0 || connid >= CELLULAR_GROUP_NSOCKETS || priv->sockets[connid].member != index)
+            continue;
+        mfds[count] = (struct cellular_pollfd) {
+            .connid = priv->sockets[connid].connid,
+            .events = fds[i].events,
+        };
+        map[count++] = i;
+    }
+    if (!count)
+        return 0;
+
+    if (!modem->ops->socket_poll) {
+        for (size_t i=0; i<count; i++)
+            fds[map[i]].revents = fds[map[i]].events;
+        return count;
+    }
+
+    int result = modem->ops->socket_poll(modem, mfds, count, timeout_ms);
+    if (result <= 0)
+        return result;
+    for (size_t i=0; i<count; i++)
+        fds[map[i]].revents = mfds[i].revents;
+    return result;
+}
+
+static int group_socket_poll(struct cellular *modem, struct cellular_pollfd *fds, size_t nfds, int timeout_ms)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    uint32_t start = at_clock_ms();
+
+    for (;;) {
+        /* See what everyone has without waiting. Unused connids hang up. */
+        int count = 0;
+        for (size_t i=0; i<nfds; i++) {
+            int connid = fds[i].connid;
+            bool open = connid >= 0 && connid < CELLULAR_GROUP_NSOCKETS &&
+                        priv->sockets[connid].member != -1;
+            fds[i].revents = open ? 0 : CELLULAR_POLLHUP;
+            if (!open)
+                count++;
+        }
+        for (int i=0; i<priv->nmembers; i++) {
+            int result = group_poll_member(priv, i, fds, nfds, 0);
+            if (result == -1)
+                return -1;
+            count += result;
+        }
+        if (count || timeout_ms == 0)
+            return count;
+
+        /* Nothing yet. There's no waiting on several modems at once, so
+         * take turns sleeping on each, a slice at a time. */
+        int left = GROUP_POLL_SLICE_MS;
+        if (timeout_ms > 0) {
+            uint32_t elapsed = at_clock_ms() - start;
+            if (elapsed >= (uint32_t) timeout_ms)
+                return 0;
+            if (timeout_ms - (int) elapsed < left)
+                left = timeout_ms - (int) elapsed;
+        }
+        int slice = left / (priv->nmembers ? priv->nmembers : 1);
+        for (int i=0; i<priv->nmembers; i++)
+            if (group_poll_member(priv, i, fds, nfds, slice ? slice : 1) > 0)
+                break;
+    }
+}
+
+static int group_ftp_open(struct cellular *modem, const char *host, uint16_t port, const char *username, const char *password, bool passive)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    int result = -1, error = ENETUNREACH, best_rssi = -1;
+
+    /* Every member logs in, so that downloads can be split; the one with
+     * the best signal does the rest. */
+    priv->ftp_member = -1;
+    for (int i=0; i<priv->nmembers; i++) {
+        struct cellular_group_member *member = &priv->members[i];
+        struct cellular *m = member->modem;
+
+        member->ftp = false;
+        if (!m->ops->ftp_open)
+            continue;
+        if (m->ops->ftp_open(m, host, port, username, password, passive) != 0) {
+            error = errno;
+            continue;
+        }
+        member->ftp = true;
+        result = 0;
+
+        int rssi = group_rssi(m);
+        if (priv->ftp_member == -1 || rssi > best_rssi) {
+            priv->ftp_member = i;
+            best_rssi = rssi;
+        }
+    }
+
+    if (result == -1)
+        errno = error;
+    return result;
+}
+
+static struct cellular *group_ftp_modem(struct cellular_group *priv)
+{
+    if (priv->ftp_member == -1) {
+        errno = ENOTCONN;
+        return NULL;
+    }
+    return priv->members[priv->ftp_member].modem;
+}
+
+static int group_ftp_get(struct cellular *modem, const char *filename)
+{
+    struct cellular *member = group_ftp_modem((struct cellular_group *) modem);
+    return member ? member->ops->ftp_get(member, filename) : -1;
+}
+
+static int group_ftp_getdata(struct cellular *modem, char *buffer, size_t length)
+{
+    struct cellular *member = group_ftp_modem((struct cellular_group *) modem);
+    return member ? member->ops->ftp_getdata(member, buffer, length) : -1;
+}
+
+static int group_ftp_download(struct cellular *modem, const char *filename, cellular_sink_t sink, void *ctx)
+{
+    struct cellular *member = group_ftp_modem((struct cellular_group *) modem);
+    return member ? member->ops->ftp_download(member, filename, sink, ctx) : -1;
+}
+
+static int group_ftp_close(struct cellular *modem)
+{
+    struct cellular_group *priv = (struct cellular_group *) modem;
+    int result = 0, error = 0;
+
+    for (int i=0; i<priv->nmembers; i++) {
+        struct cellular_group_member *member = &priv->members[i];
+        if (!member->ftp)
+            continue;
+        member->ftp = false;
+        if (member->modem->ops->ftp_close(member->modem) != 0) {
+            error = errno;
+            result = -1;
+        }
+    }
+    priv->ftp_member = -1;
+
+    if (result == -1)
+        errno = error;
+    return result;
+}
+
+static const struct cellular_ops group_ops = {
+    .pdp_open = group_pdp_open,
+    .pdp_close = group_pdp_close,
+
+    .creg = group_creg,
+    .rssi = group_rssi_op,
+
+    .socket_connect = group_socket_connect,
+    .socket_send = group_socket_send,
+    .socket_recv = group_socket_recv,
+    .socket_waitack = group_socket_waitack,
+    .socket_close = group_socket_close,
+    .socket_poll = group_socket_poll,
+    .socket_set_send_buffer = group_socket_set_send_buffer,
+    .socket_flush = group_socket_flush,
+    .ftp_open = group_ftp_open,
+    .ftp_get = group_ftp_get,
+    .ftp_getdata = group_ftp_getdata,
+    .ftp_download = group_ftp_download,
+    .ftp_close = group_ftp_close,
+};
+
+int cellular_group_add(struct cellular *group, struct cellular *modem, int connid_base, int nsockets)
+{
+    struct cellular_group *priv = (struct cellular_group *) group;
+
+    if (priv->nmembers == CELLULAR_GROUP_MEMBERS) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    priv->members[priv->nmembers++] = (struct cellular_group_member) {
+        .modem = modem,
+        .connid_base = connid_base,
+        .nsockets = nsockets,
+    };
+
+    return 0;
+}
+
+/** One member's share of a split download. */
+struct group_range {
+    struct cellular_group_member *member;
+    struct cellular *modem;
+    size_t offset;              /**< Where the next byte goes. */
+    size_t left;                /**< Bytes still to come. */
+};
+
+/**
+ * Sink adapter for downloads that aren't split.
+ */
+struct group_whole {
+    cellular_range_sink_t sink;
+    void *ctx;
+    size_t offset;
+};
+
+static int group_whole_sink(const void *data, size_t len, void *ctx)
+{
+    struct group_whole *whole = ctx;
+    int result = whole->sink(whole->offset, data, len, whole->ctx);
+    whole->offset += len;
+    return result;
+}
+
+int cellular_group_ftp_download(struct cellular *group, const char *filename,
+                                cellular_range_sink_t sink, void *ctx)
+{
+    struct cellular_group *priv = (struct cellular_group *) group;
+
+    struct cellular *first = group_ftp_modem(priv);
+    if (!first)
+        return -1;
+
+    /* Line up the members that can start mid-file, the best one first. */
+    struct group_range ranges[CELLULAR_GROUP_MEMBERS];
+    int count = 0;
+    if (first->ops->ftp_size && first->ops->ftp_get_from) {
+        ranges[count].member = &priv->members[priv->ftp_member];
+        ranges[count++].modem = first;
+    }
+    for (int i=0; i<priv->nmembers && count; i++) {
+        struct cellular *m = priv->members[i].modem;
+        if (priv->members[i].ftp && m != first && m->ops->ftp_get_from) {
+            ranges[count].member = &priv->members[i];
+            ranges[count++].modem = m;
+        }
+    }
+    ssize_t size = count > 1 ? first->ops->ftp_size(first, filename) : -1;
+
+    /* Split the file evenly; the first member takes the remainder too. */
+    if (size >= GROUP_FTP_SPLIT_MIN) {
+        size_t share = size / count;
+        for (int i=count-1; i>=0; i--) {
+            ranges[i].offset = i * share;
+            ranges[i].left = i == count-1 ? size - i * share : share;
+            /* No REST support on the server means no splitting at all. */
+            if (ranges[i].modem->ops->ftp_get_from(ranges[i].modem, filename, ranges[i].offset) != 0) {
+                printf("[group@%p] ftp: can't start at %zu, not splitting\n", priv, ranges[i].offset);
+                size = -1;
+                break;
+            }
+        }
+    }
+
+    if (size < GROUP_FTP_SPLIT_MIN) {
+        /* Members that got going are stopped by the close below. */
+        struct group_whole whole = { .sink = sink, .ctx = ctx };
+        int result = first->ops->ftp_download(first, filename, group_whole_sink, &whole);
+        int error = errno;
+        group_ftp_close(group);
+        errno = error;
+        return result;
+    }
+
+    /* Take turns reading. The modems keep fetching in the background, so
+     * as long as the ports are faster than the radios the transfer runs at
+     * their combined speed. Each one fetches to the end of the file, though:
+     * FTP has no way to ask for a range, only for a starting point. A member
+     * is stopped as soon as its range is in, which keeps the overshoot down
+     * to whatever it fetched ahead by then. */
+    int result = 0, error = 0, active = count;
+    while (active && result == 0) {
+        for (int i=0; i<count && result == 0; i++) {
+            struct group_range *range = &ranges[i];
+            if (!range->left)
+                continue;
+
+            size_t length = range->left < sizeof(priv->ftp_buf) ? range->left : sizeof(priv->ftp_buf);
+            int len = range->modem->ops->ftp_getdata(range->modem, priv->ftp_buf, length);
+            if (len <= 0) {
+                /* End of file before the end of the range: the file shrank. */
+                error = len ? errno : EPROTO;
+                result = -1;
+            } else if (sink(range->offset, priv->ftp_buf, len, ctx) != 0) {
+                error = ECANCELED;
+                result = -1;
+            } else {
+                range->offset += len;
+                range->left -= len;
+                if (!range->left) {
+                    range->member->ftp = false;
+                    range->modem->ops->ftp_close(range->modem);
+                    active--;
+                }
+            }
+        }
+    }
+
+    /* Transfers stopped short of the end can only be abandoned. */
+    group_ftp_close(group);
+
+    if (result == -1)
+        errno = error;
+    return result;
+}
+
+size_t cellular_group_size(void)
+{
+    return sizeof(struct cellular_group);
+}
+
+struct cellular *cellular_group_init(void *storage, size_t size)
+{
+    if (size < sizeof(struct cellular_group)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct cellular_group *group = storage;
+    memset(group, 0, sizeof(*group));
+
+    group->dev.ops = &group_ops;
+    group->ftp_member = -1;
+    for (int i=0; i<CELLULAR_GROUP_NSOCKETS; i++)
+        group->sockets[i].member = -1;
+
+    return (struct cellular *) group;
+}
+
+#ifndef AT_NO_MALLOC
+struct cellular *cellular_group_alloc(void)
+{
+    void *group = malloc(sizeof(struct cellular_group));
+    if (group == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return cellular_group_init(group, sizeof(struct cellular_group));
+}
+
+void cellular_group_free(struct cellular *group)
+{
+    free(group);
+}
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -8,16 +8,21 @@
 
 #include <attentive/cellular.h>
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include "common.h"
+#include "at-common.h"
 
 
 #define TELIT2_WAITACK_TIMEOUT 60
 #define TELIT2_FTP_TIMEOUT 60
 #define TELIT2_LOCATE_TIMEOUT 150
+#define TELIT2_MAX_RECV 1500
+#define TELIT2_STREAM_CONNID 1
+#define TELIT2_NSOCKETS 6           /* Connection ids 1 to 6. */
 
 static const char *const telit2_urc_responses[] = {
     "SRING: ",
@@ -28,19 +33,33 @@ static const char *const telit2_urc_responses[] = {
 struct cellular_telit2 {
     struct cellular dev;
 
+    struct at_prefix_matcher urc_matcher;
+    struct at_prefix_entry urc_entries[sizeof(telit2_urc_responses) / sizeof(*telit2_urc_responses)];
+
     int locate_status;
     float latitude, longitude, altitude;
+
+    struct cellular_sendbuf sendbuf[TELIT2_NSOCKETS];
+    bool ftp_rest;              /**< A restart offset is set. */
+#ifdef AT_NO_MALLOC
+    char download_buf[2 * TELIT2_MAX_RECV];
+#endif
 };
 
-static enum at_response_type scan_line(const char *line, size_t len, void *arg)
+static struct cellular_sendbuf *telit2_sendbuf(struct cellular *modem, int connid)
 {
-    (void) line;
-    (void) len;
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
 
+    if (connid < 1 || connid > TELIT2_NSOCKETS)
+        return NULL;
+    return &priv->sendbuf[connid - 1];
+}
+
+static enum at_response_type scan_line(const char *line, size_t len, void *arg)
+{
     struct cellular_telit2 *priv = arg;
-    (void) priv;
 
-    if (at_prefix_in_table(line, telit2_urc_responses))
+    if (at_prefix_match(&priv->urc_matcher, line, len) || cellular_state_scan(line, len))
         return AT_RESPONSE_URC;
 
     return AT_RESPONSE_UNKNOWN;
@@ -54,9 +73,13 @@ static void handle_urc(const char *line, size_t len, void *arg)
     if (sscanf(line, "#AGPSRING: %d", &status) == 1) {
         priv->locate_status = status;
         sscanf(line, "#AGPSRING: %*d,%f,%f,%f", &priv->latitude, &priv->longitude, &priv->altitude);
+        at_notify(priv->dev.at);
         return;
     }
 
+    if (cellular_state_urc(&priv->dev, line, len))
+        return;
+
     printf("[telit2@%p] urc: %.*s\n", priv, (int) len, line);
 }
 
@@ -83,6 +106,10 @@ static int telit2_attach(struct cellular *modem)
     for (const char *const *command=init_strings; *command; command++)
         at_command_simple(modem->at, "%s", *command);
 
+    /* Registration changes are reported; signal strength only comes in
+     * bars (+CIEV), so it's polled. */
+    cellular_state_subscribe(modem, "AT+CREG=2", NULL);
+
     return 0;
 }
 
@@ -114,6 +141,8 @@ static int telit2_pdp_open(struct cellular *modem, const char *apn)
 
 static int telit2_pdp_close(struct cellular *modem)
 {
+    cellular_pdp_lost(modem);
+
     at_set_timeout(modem->at, 150);
     at_command_simple(modem->at, "AT#SGACT=1,0");
 
@@ -122,76 +151,114 @@ static int telit2_pdp_close(struct cellular *modem)
 
 static int telit2_op_iccid(struct cellular *modem, char *buf, size_t len)
 {
+    if (cellular_state_copy(modem->state.iccid, buf, len) == 0)
+        return 0;
+
     char fmt[24];
-    if (snprintf(fmt, sizeof(fmt), "#CCID: %%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
-        errno = ENOSPC;
-        return -1;
-    }
+    snprintf(fmt, sizeof(fmt), "#CCID: %%%d[0-9]", (int) sizeof(modem->state.iccid)-1);
 
     at_set_timeout(modem->at, 5);
     const char *response = at_command(modem->at, "AT#CCID");
-    at_simple_scanf(response, fmt, buf);
-    buf[len-1] = '\0';
+    at_simple_scanf(response, fmt, modem->state.iccid);
 
-    return 0;
+    return cellular_state_copy(modem->state.iccid, buf, len);
 }
 
-static int telit2_op_clock_gettime(struct cellular *modem, struct timespec *ts)
+//static int telit2_op_clock_gettime(struct cellular *modem, struct timespec *ts)
+//{
+//    struct tm tm;
+//    int offset;
+
+//    at_set_timeout(modem->at, 1);
+//    const char *response = at_command(modem->at, "AT+CCLK?");
+//    memset(&tm, 0, sizeof(struct tm));
+//    at_simple_scanf(response, "+CCLK: \"%d/%d/%d,%d:%d:%d%d\"",
+//            &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+//            &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
+//            &offset);
+
+//    /* Most modems report some starting date way in the past when they have
+//     * no date/time estimation. */
+//    if (tm.tm_year < 14) {
+//        errno = EINVAL;
+//        return 1;
+//    }
+
+//    /* Adjust values and perform conversion. */
+//    tm.tm_year += 2000 - 1900;
+//    tm.tm_mon -= 1;
+//    time_t unix_time = timegm(&tm);
+//    if (unix_time == -1) {
+//        errno = EINVAL;
+//        return -1;
+//    }
+
+//    /* Telit modems return local date/time instead of UTC (as defined in 3GPP
+//     * 27.007). Remove the timezone shift. */
+//    unix_time -= 15*60*offset;
+
+//    /* All good. Return the result. */
+//    ts->tv_sec = unix_time;
+//    ts->tv_nsec = 0;
+//    return 0;
+//}
+
+static int telit2_socket_connect(struct cellular *modem, int connid, const char *host, uint16_t port)
 {
-    struct tm tm;
-    int offset;
+    /* Reset socket configuration to default. */
+    at_set_timeout(modem->at, 5);
+    at_command_simple(modem->at, "AT#SCFGEXT=%d,0,0,0,0,0", connid);
+    at_command_simple(modem->at, "AT#SCFGEXT2=%d,0,0,0,0,0", connid);
 
-    at_set_timeout(modem->at, 1);
-    const char *response = at_command(modem->at, "AT+CCLK?");
-    memset(&tm, 0, sizeof(struct tm));
-    at_simple_scanf(response, "+CCLK: \"%d/%d/%d,%d:%d:%d%d\"",
-            &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
-            &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
-            &offset);
-
-    /* Most modems report some starting date way in the past when they have
-     * no date/time estimation. */
-    if (tm.tm_year < 14) {
-        errno = EINVAL;
-        return 1;
-    }
+    /* Open connection. */
+    cellular_command_simple_pdp(modem, "AT#SD=%d,0,%d,%s,0,0,1", connid, port, host);
 
-    /* Adjust values and perform conversion. */
-    tm.tm_year += 2000 - 1900;
-    tm.tm_mon -= 1;
-    time_t unix_time = timegm(&tm);
-    if (unix_time == -1) {
-        errno = EINVAL;
-        return -1;
-    }
+    return 0;
+}
 
-    /* Telit modems return local date/time instead of UTC (as defined in 3GPP
-     * 27.007). Remove the timezone shift. */
-    unix_time -= 15*60*offset;
+static enum at_response_type scanner_sd_online(const char *line, size_t len, void *arg)
+{
+    (void) len;
+    (void) arg;
 
-    /* All good. Return the result. */
-    ts->tv_sec = unix_time;
-    ts->tv_nsec = 0;
-    return 0;
+    if (!strcmp(line, "CONNECT"))
+        return AT_RESPONSE_FINAL_OK;
+    return AT_RESPONSE_UNKNOWN;
 }
 
-static int telit2_socket_connect(struct cellular *modem, int connid, const char *host, uint16_t port)
+static int telit2_socket_stream_open(struct cellular *modem, const char *host, uint16_t port, at_data_handler_t handler, void *arg)
 {
+    int connid = TELIT2_STREAM_CONNID;
+
     /* Reset socket configuration to default. */
     at_set_timeout(modem->at, 5);
     at_command_simple(modem->at, "AT#SCFGEXT=%d,0,0,0,0,0", connid);
     at_command_simple(modem->at, "AT#SCFGEXT2=%d,0,0,0,0,0", connid);
 
-    /* Open connection. */
-    cellular_command_simple_pdp(modem, "AT#SD=%d,0,%d,%s,0,0,1", connid, port, host);
+    /* Open connection in online mode; CONNECT starts the stream. */
+    at_set_data_handler(modem->at, handler, arg);
+    at_set_timeout(modem->at, 150);
+    at_set_command_scanner(modem->at, scanner_sd_online);
+    at_expect_datamode(modem->at);
+    cellular_command_simple_pdp(modem, "AT#SD=%d,0,%d,%s,0,0,0", connid, port, host);
 
     return 0;
 }
 
-static ssize_t telit2_socket_send(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags)
+static int telit2_socket_stream_close(struct cellular *modem)
 {
-    (void) flags;
+    int result = at_leave_datamode(modem->at);
+    at_set_data_handler(modem->at, NULL, NULL);
+
+    /* The socket survives the escape; close it for good. */
+    at_set_timeout(modem->at, 150);
+    at_command_simple(modem->at, "AT#SH=%d", TELIT2_STREAM_CONNID);
+
+    return result;
+}
 
+static ssize_t telit2_ssendext(struct cellular *modem, int connid, const void *buffer, size_t amount)
+{
     /* Request transmission. */
     at_set_timeout(modem->at, 150);
     at_expect_dataprompt(modem->at);
@@ -203,13 +270,60 @@ static ssize_t telit2_socket_send(struct cellular *modem, int connid, const void
     return amount;
 }
 
+static ssize_t telit2_socket_send(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags)
+{
+    (void) flags;
+
+    struct cellular_sendbuf *sb = telit2_sendbuf(modem, connid);
+    if (!sb)
+        return telit2_ssendext(modem, connid, buffer, amount);
+
+    return cellular_sendbuf_write(sb, modem, connid, buffer, amount, telit2_ssendext);
+}
+
+static int telit2_socket_set_send_buffer(struct cellular *modem, int connid, void *buffer, size_t size, int delay_ms)
+{
+    struct cellular_sendbuf *sb = telit2_sendbuf(modem, connid);
+    if (!sb) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    cellular_sendbuf_init(sb, buffer, size, delay_ms);
+
+    return 0;
+}
+
+static int telit2_socket_flush(struct cellular *modem, int connid)
+{
+    struct cellular_sendbuf *sb = telit2_sendbuf(modem, connid);
+    if (!sb)
+        return 0;
+
+    return cellular_sendbuf_flush(sb, modem, connid, telit2_ssendext);
+}
+
+/**
+ * Get the payload length from a "#SRECV: <connid>,<recData>" line.
+ *
+ * @returns Payload length, -1 if it's some other line.
+ */
+static int telit2_srecv_length(const char *line, size_t len)
+{
+    struct at_fields fields;
+    int chunk;
+    if (at_fields_parse(&fields, "#SRECV: ", line, len) >= 2 &&
+        at_field_int(&fields, 1, &chunk))
+        return chunk;
+    return -1;
+}
+
 static enum at_response_type scanner_srecv(const char *line, size_t len, void *arg)
 {
-    (void) len;
     (void) arg;
 
-    int chunk;
-    if (sscanf(line, "#SRECV: %*d,%d", &chunk) == 1)
+    int chunk = telit2_srecv_length(line, len);
+    if (chunk >= 0)
         return AT_RESPONSE_RAWDATA_FOLLOWS(chunk);
 
     return AT_RESPONSE_UNKNOWN;
@@ -222,37 +336,33 @@ static ssize_t telit2_socket_recv(struct cellular *modem, int connid, void *buff
     int cnt = 0;
     while (cnt < (int) length) {
         int chunk = (int) length - cnt;
-        /* Limit read size to avoid overflowing AT response buffer. */
-        if (chunk > 128)
-            chunk = 128;
+        /* Limit read size to what the modem can return at once. */
+        if (chunk > TELIT2_MAX_RECV)
+            chunk = TELIT2_MAX_RECV;
 
-        /* Perform the read. */
+        /* Perform the read. Payload goes straight to the result buffer. */
         at_set_timeout(modem->at, 150);
         at_set_command_scanner(modem->at, scanner_srecv);
+        at_set_data_buffer(modem->at, (char *) buffer + cnt, chunk);
+        at_set_priority(modem->at, AT_PRIORITY_BULK);
         const char *response = at_command(modem->at, "AT#SRECV=%d,%d", connid, chunk);
         if (response == NULL)
             return -1;
 
-        /* Find the header line. */
-        int bytes;
-        at_simple_scanf(response, "#SRECV: %*d,%d", &bytes);
-
         /* Bail out if we're out of data. Message is misleading. */
         /* FIXME: We should maybe block until we receive something? */
         if (!strcmp(response, "+CME ERROR: activation failed"))
             break;
 
-        /* Locate the payload. */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
+        /* Find the header line. */
+        int bytes = telit2_srecv_length(response, strcspn(response, "\n"));
+        if (bytes < 0) {
             errno = EPROTO;
             return -1;
         }
-        data += 1;
 
-        /* Copy payload to result buffer. */
-        memcpy((char *)buffer + cnt, data, bytes);
-        cnt += bytes;
+        /* Anything beyond the chunk size was discarded by the parser. */
+        cnt += bytes > chunk ? chunk : bytes;
     }
 
     return cnt;
@@ -262,6 +372,10 @@ static int telit2_socket_waitack(struct cellular *modem, int connid)
 {
     const char *response;
 
+    /* Buffered data has to go out before it can be acknowledged. */
+    if (telit2_socket_flush(modem, connid) != 0)
+        return -1;
+
     at_set_timeout(modem->at, 5);
     for (int i=0; i<TELIT2_WAITACK_TIMEOUT; i++) {
         /* Read number of bytes waiting. */
@@ -291,6 +405,13 @@ static int telit2_socket_waitack(struct cellular *modem, int connid)
 
 static int telit2_socket_close(struct cellular *modem, int connid)
 {
+    /* Don't lose buffered data, then let go of the caller's buffer. */
+    struct cellular_sendbuf *sb = telit2_sendbuf(modem, connid);
+    if (sb) {
+        telit2_socket_flush(modem, connid);
+        cellular_sendbuf_init(sb, NULL, 0, 0);
+    }
+
     at_set_timeout(modem->at, 150);
     at_command_simple(modem->at, "AT#SH=%d", connid);
 
@@ -299,30 +420,126 @@ static int telit2_socket_close(struct cellular *modem, int connid)
 
 static int telit2_ftp_open(struct cellular *modem, const char *host, uint16_t port, const char *username, const char *password, bool passive)
 {
-    cellular_command_simple_pdp(modem, "AT#FTPOPEN=%s:%d,%s,%s,%d", host, port, username, password, passive);
+    /* Host and credentials can be long; send them straight from the
+     * caller's strings. */
+    char port_str[8], mode[8];
+    snprintf(port_str, sizeof(port_str), ":%d,", port);
+    snprintf(mode, sizeof(mode), ",%d\r", (int) passive);
+    const struct iovec iov[] = {
+        { (void *) "AT#FTPOPEN=", 11 },
+        { (void *) host, strlen(host) },
+        { port_str, strlen(port_str) },
+        { (void *) username, strlen(username) },
+        { (void *) ",", 1 },
+        { (void *) password, strlen(password) },
+        { mode, strlen(mode) },
+    };
+
+    if (cellular_pdp_request(modem) != 0)
+        return -1;
+    const char *response = at_command_iov(modem->at, iov, sizeof(iov) / sizeof(*iov));
+    if (!response || strcmp(response, "")) {
+        cellular_pdp_failure(modem);
+        return -1;
+    }
+    cellular_pdp_success(modem);
 
     return 0;
 }
 
-static int telit2_ftp_get(struct cellular *modem, const char *filename)
+static int telit2_ftp_get_from(struct cellular *modem, const char *filename, size_t offset)
 {
+    struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
+
+    /* The offset sticks, so only bother when it changes. */
+    if (offset || priv->ftp_rest) {
+        at_set_timeout(modem->at, 90);
+        at_command_simple(modem->at, "AT#FTPREST=%zu", offset);
+        priv->ftp_rest = offset != 0;
+    }
+
     at_set_timeout(modem->at, 90);
     at_command_simple(modem->at, "AT#FTPGETPKT=\"%s\",0", filename);
 
     return 0;
 }
 
+static int telit2_ftp_get(struct cellular *modem, const char *filename)
+{
+    return telit2_ftp_get_from(modem, filename, 0);
+}
+
+static ssize_t telit2_ftp_size(struct cellular *modem, const char *filename)
+{
+    at_set_timeout(modem->at, 90);
+    const char *response = at_command(modem->at, "AT#FTPFSIZE=\"%s\"", filename);
+    if (response == NULL)
+        return -1;
+
+    /* Expected response: #FTPFSIZE: <size> */
+    struct at_fields fields;
+    int size;
+    if (at_fields_parse(&fields, "#FTPFSIZE: ", response, strcspn(response, "\n")) < 1 ||
+        !at_field_int(&fields, 0, &size) || size < 0) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return size;
+}
+
+/**
+ * Get the payload length from a "#FTPRECV: <recData>" line.
+ *
+ * @returns Payload length, -1 if it's some other line.
+ */
+static int telit2_ftprecv_length(const char *line, size_t len)
+{
+    struct at_fields fields;
+    int bytes;
+    if (at_fields_parse(&fields, "#FTPRECV: ", line, len) >= 1 && at_field_int(&fields, 0, &bytes))
+        return bytes;
+    return -1;
+}
+
 static enum at_response_type scanner_ftprecv(const char *line, size_t len, void *arg)
 {
-    (void) len;
     (void) arg;
 
-    int bytes;
-    if (sscanf(line, "#FTPRECV: %d", &bytes) == 1)
+    int bytes = telit2_ftprecv_length(line, len);
+    if (bytes >= 0)
         return AT_RESPONSE_RAWDATA_FOLLOWS(bytes);
     return AT_RESPONSE_UNKNOWN;
 }
 
+static int telit2_ftp_parse(const char *response)
+{
+    return telit2_ftprecv_length(response, strcspn(response, "\n"));
+}
+
+/**
+ * Ask the modem whether the download has reached the end of file.
+ *
+ * @returns 1 at end of file, 0 if not, -1 on error.
+ */
+static int telit2_ftp_eof(struct cellular *modem)
+{
+    const char *response = at_command(modem->at, "AT#FTPGETPKT?");
+    if (response == NULL)
+        return -1;
+
+    /* Expected response: #FTPGETPKT: <remotefile>,<viewMode>,<eof> */
+    struct at_fields fields;
+    int eof;
+    if (at_fields_parse(&fields, "#FTPGETPKT: ", response, strcspn(response, "\n")) < 3 ||
+        !at_field_int(&fields, 2, &eof)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return eof == 1;
+}
+
 static int telit2_ftp_getdata(struct cellular *modem, char *buffer, size_t length)
 {
     /* FIXME: This function's flow is really ugly. */
@@ -330,13 +547,15 @@ static int telit2_ftp_getdata(struct cellular *modem, char *buffer, size_t lengt
 retry:
     at_set_timeout(modem->at, 150);
     at_set_command_scanner(modem->at, scanner_ftprecv);
+    at_set_data_buffer(modem->at, buffer, length);
+    at_set_priority(modem->at, AT_PRIORITY_BULK);
     const char *response = at_command(modem->at, "AT#FTPRECV=%zu", length);
 
     if (response == NULL)
         return -1;
 
-    int bytes;
-    if (sscanf(response, "#FTPRECV: %d", &bytes) == 1) {
+    int bytes = telit2_ftp_parse(response);
+    if (bytes >= 0) {
         /* Zero means no data is available. Wait for it. */
         if (bytes == 0) {
             /* Bail out on timeout. */
@@ -348,48 +567,64 @@ retry:
             goto retry;
         }
 
-        /* Locate the payload. */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
-            errno = EPROTO;
-            return -1;
-        }
-        data += 1;
-
-        /* Copy payload to result buffer. */
-        memcpy(buffer, data, bytes);
-        return bytes;
+        /* Payload was stored in the result buffer by the parser. */
+        return bytes > (int) length ? (int) length : bytes;
     }
 
     /* Error or EOF? */
-    int eof;
-    response = at_command(modem->at, "AT#FTPGETPKT?");
-    /* Expected response: #FTPGETPKT: <remotefile>,<viewMode>,<eof> */
-#if 0
-    /* The %[] specifier is not supported on some embedded systems. */
-    at_simple_scanf(response, "#FTPGETPKT: %*[^,],%*d,%d", &eof);
-#else
-    /* Parse manually. */
-    if (response == NULL)
-        return -1;
-    errno = EPROTO;
-    /* Check the initial part of the response. */
-    if (strncmp(response, "#FTPGETPKT: ", 12))
-        return -1;
-    /* Skip the filename. */
-    response = strchr(response, ',');
-    if (response == NULL)
-        return -1;
-    response++;
-    at_simple_scanf(response, "%*d,%d", &eof);
-#endif
-
-    if (eof == 1)
+    if (telit2_ftp_eof(modem) == 1)
         return 0;
 
     return -1;
 }
 
+static bool telit2_never(void *arg)
+{
+    (void) arg;
+    return false;
+}
+
+static void telit2_ftp_wait(struct cellular *modem)
+{
+    /* The modem doesn't tell when more data arrives; just pause. */
+    at_wait(modem->at, telit2_never, NULL, 1000);
+}
+
+static bool telit2_ftp_finished(struct cellular *modem)
+{
+    return telit2_ftp_eof(modem) == 1;
+}
+
+static const struct cellular_download_ops telit2_ftp_download_ops = {
+    .command = "AT#FTPRECV=%d",
+    .scanner = scanner_ftprecv,
+    .chunk = TELIT2_MAX_RECV,
+    .timeout_ms = 150 * 1000,
+    .retries = TELIT2_FTP_TIMEOUT,
+    .parse = telit2_ftp_parse,
+    .wait = telit2_ftp_wait,
+    .finished = telit2_ftp_finished,
+};
+
+static int telit2_ftp_download(struct cellular *modem, const char *filename, cellular_sink_t sink, void *ctx)
+{
+    if (telit2_ftp_get(modem, filename) == -1)
+        return -1;
+
+#ifdef AT_NO_MALLOC
+    void *bufs = ((struct cellular_telit2 *) modem)->download_buf;
+#else
+    void *bufs = NULL;
+#endif
+    return cellular_download(modem, &telit2_ftp_download_ops, bufs, sink, ctx);
+}
+
+static bool telit2_locate_done(void *arg)
+{
+    const struct cellular_telit2 *priv = arg;
+    return priv->locate_status != -1;
+}
+
 static int telit2_locate(struct cellular *modem, float *latitude, float *longitude, float *altitude)
 {
     struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
@@ -398,22 +633,19 @@ static int telit2_locate(struct cellular *modem, float *latitude, float *longitu
     at_set_timeout(modem->at, 150);
     cellular_command_simple_pdp(modem, "AT#AGPSSND");
 
-    for (int i=0; i<TELIT2_LOCATE_TIMEOUT; i++) {
-        sleep(1);
-        if (priv->locate_status == 200) {
-            *latitude = priv->latitude;
-            *longitude = priv->longitude;
-            *altitude = priv->altitude;
-            return 0;
-        }
-        if (priv->locate_status != -1) {
-            errno = ECONNABORTED;
-            return -1;
-        }
+    /* Wait for the #AGPSRING URC. */
+    if (at_wait(modem->at, telit2_locate_done, priv, TELIT2_LOCATE_TIMEOUT * 1000) == -1)
+        return -1;
+
+    if (priv->locate_status != 200) {
+        errno = ECONNABORTED;
+        return -1;
     }
 
-    errno = ETIMEDOUT;
-    return -1;
+    *latitude = priv->latitude;
+    *longitude = priv->longitude;
+    *altitude = priv->altitude;
+    return 0;
 }
 
 static int telit2_ftp_close(struct cellular *modem)
@@ -435,37 +667,67 @@ static const struct cellular_ops telit2_ops = {
     .iccid = telit2_op_iccid,
     .creg = cellular_op_creg,
     .rssi = cellular_op_rssi,
-    .clock_gettime = telit2_op_clock_gettime,
-    .clock_settime = cellular_op_clock_settime,
+//    .clock_gettime = telit2_op_clock_gettime,
+//    .clock_settime = cellular_op_clock_settime,
     .socket_connect = telit2_socket_connect,
     .socket_send = telit2_socket_send,
     .socket_recv = telit2_socket_recv,
     .socket_waitack = telit2_socket_waitack,
     .socket_close = telit2_socket_close,
+    .socket_set_send_buffer = telit2_socket_set_send_buffer,
+    .socket_flush = telit2_socket_flush,
+    .socket_stream_open = telit2_socket_stream_open,
+    .socket_stream_close = telit2_socket_stream_close,
     .ftp_open = telit2_ftp_open,
     .ftp_get = telit2_ftp_get,
+    .ftp_get_from = telit2_ftp_get_from,
+    .ftp_size = telit2_ftp_size,
     .ftp_getdata = telit2_ftp_getdata,
+    .ftp_download = telit2_ftp_download,
     .ftp_close = telit2_ftp_close,
     .locate = telit2_locate,
 };
 
-struct cellular *cellular_telit2_alloc(void)
+size_t cellular_telit2_size(void)
 {
-    struct cellular_telit2 *modem = malloc(sizeof(struct cellular_telit2));
-    if (modem == NULL) {
+    return sizeof(struct cellular_telit2);
+}
+
+struct cellular *cellular_telit2_init(void *storage, size_t size)
+{
+    if (size < sizeof(struct cellular_telit2)) {
         errno = ENOMEM;
         return NULL;
     }
+
+    struct cellular_telit2 *modem = storage;
     memset(modem, 0, sizeof(*modem));
 
     modem->dev.ops = &telit2_ops;
 
+    at_prefix_matcher_init(&modem->urc_matcher, modem->urc_entries,
+                           sizeof(modem->urc_entries) / sizeof(*modem->urc_entries));
+    at_prefix_matcher_add(&modem->urc_matcher, telit2_urc_responses, AT_RESPONSE_URC);
+
     return (struct cellular *) modem;
 }
 
+#ifndef AT_NO_MALLOC
+struct cellular *cellular_telit2_alloc(void)
+{
+    void *modem = malloc(sizeof(struct cellular_telit2));
+    if (modem == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return cellular_telit2_init(modem, sizeof(struct cellular_telit2));
+}
+
 void cellular_telit2_free(struct cellular *modem)
 {
     free(modem);
 }
+#endif
 
 /* vim: set ts=4 sw=4 et: */
@@ -8,16 +8,22 @@
 
 #include <attentive/parser.h>
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #define printf(...)
 
+/* Room needed past a held response for collecting URC lines. */
+#define HOLD_MIN_ROOM 16
+
 enum at_parser_state {
     STATE_IDLE,
     STATE_READLINE,
     STATE_DATAPROMPT,
     STATE_RAWDATA,
     STATE_HEXDATA,
+    STATE_DATAMODE,
 };
 
 struct at_parser {
@@ -27,13 +33,27 @@ struct at_parser {
 
     enum at_parser_state state;
     bool expect_dataprompt;
+    bool expect_datamode;
     size_t data_left;
     int nibble;
 
+    char *data_buf;         /**< Caller-supplied buffer for data blocks. */
+    size_t data_size;
+    size_t data_used;
+
     char *buf;
     size_t buf_used;
     size_t buf_size;
     size_t buf_current;
+    size_t buf_start;       /**< Start of line collection; the last response lives below. */
+    size_t buf_limit;       /**< Size the buffer is allowed to grow to. */
+
+    bool overflow;          /**< Data was dropped since the last await_response. */
+    unsigned int overflows; /**< Number of truncated responses and URCs. */
+    bool allocated;         /**< Parser and buffer are ours to free and grow. */
+
+    struct at_prefix_matcher matcher;   /**< Generic response tables. */
+    struct at_prefix_entry matcher_entries[8];
 };
 
 static const char *const final_ok_responses[] = {
@@ -55,6 +75,30 @@ static const char *const urc_responses[] = {
     NULL
 };
 
+static void parser_setup(struct at_parser *parser, const struct at_parser_callbacks *cbs,
+                         char *buf, size_t bufsize, void *priv)
+{
+    parser->buf = buf;
+    parser->cbs = cbs;
+    parser->buf_size = bufsize;
+    parser->buf_limit = bufsize;
+    parser->priv = priv;
+    parser->overflow = false;
+    parser->overflows = 0;
+    parser->allocated = false;
+
+    /* Compile the generic tables. */
+    at_prefix_matcher_init(&parser->matcher, parser->matcher_entries,
+                           sizeof(parser->matcher_entries) / sizeof(*parser->matcher_entries));
+    at_prefix_matcher_add(&parser->matcher, urc_responses, AT_RESPONSE_URC);
+    at_prefix_matcher_add(&parser->matcher, final_ok_responses, AT_RESPONSE_FINAL_OK);
+    at_prefix_matcher_add(&parser->matcher, final_responses, AT_RESPONSE_FINAL);
+
+    /* Prepare instance. */
+    at_parser_reset(parser);
+}
+
+#ifndef AT_NO_MALLOC
 struct at_parser *at_parser_alloc(const struct at_parser_callbacks *cbs, size_t bufsize, void *priv)
 {
     /* Allocate parser struct. */
@@ -63,18 +107,36 @@ struct at_parser *at_parser_alloc(const struct at_parser_callbacks *cbs, size_t
         return NULL;
     }
 
-    /* Allocate response buffer. */
-    parser->buf = malloc(bufsize);
-    if (parser->buf == NULL) {
+    /* Allocate response buffer separately, so that it can grow. */
+    char *buf = malloc(bufsize);
+    if (buf == NULL) {
         free(parser);
         return NULL;
     }
-    parser->cbs = cbs;
-    parser->buf_size = bufsize;
-    parser->priv = priv;
 
-    /* Prepare instance. */
-    at_parser_reset(parser);
+    parser_setup(parser, cbs, buf, bufsize, priv);
+    parser->allocated = true;
+
+    return parser;
+}
+#endif
+
+size_t at_parser_size(size_t bufsize)
+{
+    return sizeof(struct at_parser) + bufsize;
+}
+
+struct at_parser *at_parser_init(void *storage, size_t size, const struct at_parser_callbacks *cbs,
+                                 size_t bufsize, void *priv)
+{
+    if (size < at_parser_size(bufsize)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* The response buffer lives right behind the struct. */
+    struct at_parser *parser = storage;
+    parser_setup(parser, cbs, (char *) (parser + 1), bufsize, priv);
 
     return parser;
 }
@@ -83,9 +145,14 @@ void at_parser_reset(struct at_parser *parser)
 {
     parser->state = STATE_IDLE;
     parser->expect_dataprompt = false;
+    parser->expect_datamode = false;
     parser->buf_used = 0;
     parser->buf_current = 0;
+    parser->buf_start = 0;
     parser->data_left = 0;
+    parser->data_buf = NULL;
+    parser->data_size = 0;
+    parser->data_used = 0;
     parser->character_handler = NULL;
 }
 
@@ -94,13 +161,55 @@ void at_parser_set_character_handler(struct at_parser *parser, at_character_hand
     parser->character_handler = handler;
 }
 
+void at_parser_set_data_buffer(struct at_parser *parser, void *buf, size_t size)
+{
+    parser->data_buf = buf;
+    parser->data_size = size;
+    parser->data_used = 0;
+}
+
+void at_parser_set_buffer_limit(struct at_parser *parser, size_t limit)
+{
+    parser->buf_limit = limit;
+}
+
+bool at_parser_overflowed(struct at_parser *parser)
+{
+    return parser->overflow;
+}
+
+unsigned int at_parser_overflow_count(struct at_parser *parser)
+{
+    return parser->overflows;
+}
+
 void at_parser_expect_dataprompt(struct at_parser *parser)
 {
     parser->expect_dataprompt = true;
 }
 
+void at_parser_expect_datamode(struct at_parser *parser)
+{
+    parser->expect_datamode = true;
+}
+
+bool at_parser_in_datamode(struct at_parser *parser)
+{
+    return parser->state == STATE_DATAMODE;
+}
+
 void at_parser_await_response(struct at_parser *parser)
 {
+    /* Release the previous response, keeping any partial URC line. */
+    if (parser->buf_start > 0) {
+        memmove(parser->buf, parser->buf + parser->buf_start,
+                parser->buf_used - parser->buf_start);
+        parser->buf_used -= parser->buf_start;
+        parser->buf_current -= parser->buf_start;
+        parser->buf_start = 0;
+    }
+
+    parser->overflow = false;
     parser->state = (parser->expect_dataprompt ? STATE_DATAPROMPT : STATE_READLINE);
 }
 
@@ -113,28 +222,243 @@ bool at_prefix_in_table(const char *line, const char *const table[])
     return false;
 }
 
-static enum at_response_type generic_line_scanner(const char *line, size_t len, struct at_parser *parser)
+void at_prefix_matcher_init(struct at_prefix_matcher *matcher, struct at_prefix_entry *entries, size_t size)
+{
+    memset(matcher->head, 0, sizeof(matcher->head));
+    matcher->entries = entries;
+    matcher->count = 0;
+    matcher->size = size < 255 ? size : 255;
+}
+
+int at_prefix_matcher_add(struct at_prefix_matcher *matcher, const char *const table[], uint8_t value)
+{
+    for (int i=0; table[i] != NULL; i++) {
+        unsigned char first = table[i][0];
+        size_t len = strlen(table[i]);
+        if (matcher->count == matcher->size || len > 255 ||
+            first < _AT_PREFIX_FIRST || first > _AT_PREFIX_LAST)
+            return -1;
+
+        struct at_prefix_entry *entry = &matcher->entries[matcher->count++];
+        entry->prefix = table[i];
+        entry->len = len;
+        entry->next = 0;
+        entry->value = value;
+
+        /* Append to the chain so that earlier prefixes are tried first. */
+        uint8_t *link = &matcher->head[first - _AT_PREFIX_FIRST];
+        while (*link)
+            link = &matcher->entries[*link - 1].next;
+        *link = matcher->count;
+    }
+
+    return 0;
+}
+
+int at_prefix_match(const struct at_prefix_matcher *matcher, const char *line, size_t len)
+{
+    unsigned char first = len ? line[0] : 0;
+    if (first < _AT_PREFIX_FIRST || first > _AT_PREFIX_LAST)
+        return 0;
+
+    for (uint8_t i = matcher->head[first - _AT_PREFIX_FIRST]; i; ) {
+        const struct at_prefix_entry *entry = &matcher->entries[i - 1];
+        if (entry->len <= len && !memcmp(line, entry->prefix, entry->len))
+            return entry->value;
+        i = entry->next;
+    }
+
+    return 0;
+}
+
+/**
+ * Helper, fills in the integer value if the whole field is a decimal number
+ * that fits in an int. Longer digit runs (ICCIDs, line noise) aren't
+ * integers.
+ */
+static void field_convert(struct at_field *field)
+{
+    const char *p = field->str, *end = field->str + field->len;
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+'))
+        p++;
+
+    unsigned long limit = (unsigned long) INT_MAX + negative;
+    unsigned long value = 0;
+
+    field->value = 0;
+    field->integer = false;
+    if (p == end)
+        return;
+    for (; p < end; p++) {
+        unsigned int digit = *p - '0';
+        if (digit > 9 || value > (limit - digit) / 10)
+            return;
+        value = value * 10 + digit;
+    }
+
+    field->value = negative ? -(long) (value - 1) - 1 : (long) value;
+    field->integer = true;
+}
+
+int at_fields_parse(struct at_fields *fields, const char *prefix, const char *line, size_t len)
+{
+    size_t prefix_len = strlen(prefix);
+    if (len < prefix_len || memcmp(line, prefix, prefix_len))
+        return -1;
+
+    const char *p = line + prefix_len, *end = line + len;
+    while (p < end && *p == ' ')
+        p++;
+
+    fields->count = 0;
+    if (p == end)
+        return 0;
+
+    for (;;) {
+        while (p < end && *p == ' ')
+            p++;
+
+        const char *comma;
+        struct at_field field = { .str = p };
+        if (p < end && *p == '"') {
+            const char *quote = memchr(p + 1, '"', end - (p + 1));
+            field.str = p + 1;
+            field.len = (quote ? quote : end) - field.str;
+            field.quoted = true;
+            comma = memchr(field.str + field.len, ',', end - (field.str + field.len));
+        } else {
+            comma = memchr(p, ',', end - p);
+            field.len = (comma ? comma : end) - p;
+            while (field.len && field.str[field.len-1] == ' ')
+                field.len--;
+            field_convert(&field);
+        }
+
+        fields->field[fields->count++] = field;
+        if (!comma || fields->count == AT_FIELDS_MAX)
+            break;
+        p = comma + 1;
+    }
+
+    return fields->count;
+}
+
+bool at_field_int(const struct at_fields *fields, int index, int *value)
 {
-    (void) len;
+    if (index < 0 || index >= fields->count || !fields->field[index].integer)
+        return false;
 
+    *value = fields->field[index].value;
+    return true;
+}
+
+static enum at_response_type generic_line_scanner(const char *line, size_t len, struct at_parser *parser)
+{
     if (parser->state == STATE_DATAPROMPT)
         if (len == 2 && !memcmp(line, "> ", 2))
             return AT_RESPONSE_FINAL_OK;
 
-    if (at_prefix_in_table(line, urc_responses))
-        return AT_RESPONSE_URC;
-    else if (at_prefix_in_table(line, final_ok_responses))
-        return AT_RESPONSE_FINAL_OK;
-    else if (at_prefix_in_table(line, final_responses))
-        return AT_RESPONSE_FINAL;
-    else
-        return AT_RESPONSE_INTERMEDIATE;
+    enum at_response_type type = at_prefix_match(&parser->matcher, line, len);
+    return type ? type : AT_RESPONSE_INTERMEDIATE;
+}
+
+/**
+ * Helper, returns the room left in the response buffer, growing it first if
+ * len bytes don't fit and the limit allows.
+ */
+static size_t parser_space(struct at_parser *parser, size_t len)
+{
+    size_t space = parser->buf_size - 1 - parser->buf_used;
+    if (len <= space || parser->buf_size >= parser->buf_limit)
+        return space;
+
+    /* A held response must not move; see parser_hold_response(). An
+     * in-place buffer can't move at all. */
+    if (parser->buf_start > 0 || !parser->allocated)
+        return space;
+
+#ifndef AT_NO_MALLOC
+    size_t size = parser->buf_size;
+    while (size - 1 - parser->buf_used < len && size < parser->buf_limit)
+        size *= 2;
+    if (size > parser->buf_limit)
+        size = parser->buf_limit;
+
+    char *buf = realloc(parser->buf, size);
+    if (buf == NULL)
+        return space;
+
+    parser->buf = buf;
+    parser->buf_size = size;
+
+    return size - 1 - parser->buf_used;
+#else
+    return space;
+#endif
+}
+
+/**
+ * Helper, called whenever data has to be dropped.
+ */
+static void parser_mark_overflow(struct at_parser *parser)
+{
+    if (!parser->overflow) {
+        parser->overflow = true;
+        parser->overflows++;
+    }
+}
+
+static void parser_append_block(struct at_parser *parser, const void *data, size_t len)
+{
+    size_t space = parser_space(parser, len);
+    if (len > space) {
+        parser_mark_overflow(parser);
+
+        /* Sacrifice the lines collected so far so that the current one (most
+         * likely the final response) can still be recognized. */
+        if (parser->buf_current > parser->buf_start) {
+            memmove(parser->buf + parser->buf_start,
+                    parser->buf + parser->buf_current,
+                    parser->buf_used - parser->buf_current);
+            parser->buf_used -= parser->buf_current - parser->buf_start;
+            parser->buf_current = parser->buf_start;
+            space = parser->buf_size - 1 - parser->buf_used;
+        }
+
+        if (len > space)
+            len = space;
+    }
+
+    memcpy(parser->buf + parser->buf_used, data, len);
+    parser->buf_used += len;
 }
 
 static void parser_append(struct at_parser *parser, char ch)
 {
     if (parser->buf_used < parser->buf_size-1)
         parser->buf[parser->buf_used++] = ch;
+    else
+        parser_append_block(parser, &ch, 1);
+}
+
+/**
+ * Helper, stores decoded data block contents.
+ */
+static void parser_append_data(struct at_parser *parser, const void *data, size_t len)
+{
+    if (!parser->data_buf) {
+        parser_append_block(parser, data, len);
+        return;
+    }
+
+    size_t space = parser->data_size - parser->data_used;
+    if (len > space) {
+        parser_mark_overflow(parser);
+        len = space;
+    }
+    memcpy(parser->data_buf + parser->data_used, data, len);
+    parser->data_used += len;
 }
 
 static void parser_include_line(struct at_parser *parser)
@@ -146,6 +470,18 @@ static void parser_include_line(struct at_parser *parser)
     parser->buf_current = parser->buf_used;
 }
 
+/**
+ * Helper, called whenever a raw or hex data block is complete.
+ */
+static void parser_finish_data(struct at_parser *parser)
+{
+    /* Blocks stored in the response buffer make up a line of their own. */
+    if (!parser->data_buf)
+        parser_include_line(parser);
+
+    parser->state = STATE_READLINE;
+}
+
 static void parser_discard_line(struct at_parser *parser)
 {
     /* Rewind the end pointer back to the previous position. */
@@ -162,6 +498,25 @@ static void parser_finalize(struct at_parser *parser)
     parser->buf[parser->buf_used] = '\0';
 }
 
+/**
+ * Helper, goes back to idle state after a response has been delivered.
+ *
+ * The response stays in the buffer until the next at_parser_await_response(),
+ * so that URCs arriving right behind it don't overwrite it before the caller
+ * got to look at it. Lines are collected past it in the meantime; if the
+ * buffer couldn't grow to make room for them, they're truncated instead.
+ */
+static void parser_hold_response(struct at_parser *parser)
+{
+    size_t held = parser->buf_used + 1;
+    if (held > parser->buf_size - 1)
+        held = parser->buf_size - 1;
+
+    at_parser_reset(parser);
+
+    parser->buf_start = parser->buf_current = parser->buf_used = held;
+}
+
 /**
  * Helper, called whenever a full response line is collected.
  */
@@ -199,6 +554,10 @@ static void parser_handle_line(struct at_parser *parser)
         /* Discard the URC line from the buffer. */
         parser_discard_line(parser);
 
+        /* A truncated URC outside of a command has been dealt with now. */
+        if (parser->state == STATE_IDLE)
+            parser->overflow = false;
+
         return;
     }
 
@@ -216,12 +575,20 @@ static void parser_handle_line(struct at_parser *parser)
         case AT_RESPONSE_FINAL_OK:
         case AT_RESPONSE_FINAL:
         {
-            /* Fire the response callback. */
+            bool datamode = parser->expect_datamode && type == AT_RESPONSE_FINAL_OK;
+
+            /* Fire the response callback. The buffer can't move while
+             * the response is held, so make room for URCs first. */
             parser_finalize(parser);
+            parser_space(parser, HOLD_MIN_ROOM + 1);
             parser->cbs->handle_response(parser->buf, parser->buf_used, parser->priv);
 
             /* Go back to idle state. */
-            at_parser_reset(parser);
+            parser_hold_response(parser);
+
+            /* Everything from here on is the data stream. */
+            if (datamode)
+                parser->state = STATE_DATAMODE;
         }
         break;
 
@@ -250,15 +617,89 @@ static void parser_handle_line(struct at_parser *parser)
     }
 }
 
-static int hex2int(char c)
+/* Hex digit values, offset by one so that anything else maps to zero. */
+static const uint8_t hex_table[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+/**
+ * Helper, decodes hex-escaped data until the block is complete or the input
+ * runs out. Non-hex characters are skipped.
+ *
+ * @returns Number of bytes consumed.
+ */
+static size_t parser_feed_hexdata(struct at_parser *parser, const uint8_t *buf, size_t len)
 {
-    if (c >= '0' && c <= '9')
-        return c - '0';
-    if (c >= 'A' && c <= 'F')
-        return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f')
-        return c - 'a' + 10;
-    return -1;
+    const uint8_t *p = buf, *end = buf + len;
+    size_t left = parser->data_left;
+    int nibble = parser->nibble;
+
+    /* Decode in chunks to keep the destination handling out of the loop. */
+    uint8_t chunk[64];
+    uint8_t *out = chunk, *out_end = chunk + sizeof(chunk);
+
+    while (left > 0 && p < end) {
+        /* Common case: two adjacent digits make up a whole byte. */
+        if (nibble == -1 && end - p >= 2 && hex_table[p[0]] && hex_table[p[1]]) {
+            *out++ = ((hex_table[p[0]] - 1) << 4) | (hex_table[p[1]] - 1);
+            left--;
+            p += 2;
+        } else {
+            /* Otherwise go one character at a time. */
+            int value = hex_table[*p++] - 1;
+            if (value == -1)
+                continue;
+            if (nibble == -1) {
+                nibble = value;
+                continue;
+            }
+            *out++ = (nibble << 4) | value;
+            nibble = -1;
+            left--;
+        }
+
+        if (out == out_end) {
+            parser_append_data(parser, chunk, out - chunk);
+            out = chunk;
+        }
+    }
+    parser_append_data(parser, chunk, out - chunk);
+
+    parser->data_left = left;
+    parser->nibble = nibble;
+
+    return p - buf;
+}
+
+/**
+ * Helper, consumes line data up to and including the first newline character.
+ * Used when no per-character handler is installed; otherwise lines are
+ * collected byte by byte in at_parser_feed().
+ *
+ * @returns Number of bytes consumed.
+ */
+static size_t parser_feed_line(struct at_parser *parser, const uint8_t *buf, size_t len)
+{
+    /* Find the first of '\r' or '\n'; the line ends strictly before it. */
+    const uint8_t *lf = memchr(buf, '\n', len);
+    size_t run = lf ? (size_t) (lf - buf) : len;
+    const uint8_t *cr = memchr(buf, '\r', run);
+    if (cr)
+        run = cr - buf;
+
+    /* Append the entire run at once. */
+    parser_append_block(parser, buf, run);
+    if (run == len)
+        return len;
+
+    /* Handle full lines. */
+    if (buf[run] == '\n')
+        parser_handle_line(parser);
+
+    return run + 1;
 }
 
 void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
@@ -267,15 +708,25 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
 
     while (len > 0)
     {
-        /* Fetch next character. */
-        uint8_t ch = *buf++; len--;
-
         switch (parser->state)
         {
             case STATE_IDLE:
             case STATE_READLINE:
+            {
+                /* Collect whole runs of line data unless we have to look at
+                 * every single character. */
+                if (!parser->character_handler) {
+                    size_t used = parser_feed_line(parser, buf, len);
+                    buf += used; len -= used;
+                    break;
+                }
+            }
+            /* fall through */
             case STATE_DATAPROMPT:
             {
+                /* Fetch next character. */
+                uint8_t ch = *buf++; len--;
+
                 if ((ch != '\r') && (ch != '\n')) {
                     /* Append the character if it's not a newline. */
                     parser_append(parser, ch);
@@ -300,36 +751,30 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
             break;
 
             case STATE_RAWDATA: {
-                if (parser->data_left > 0) {
-                    parser_append(parser, ch);
-                    parser->data_left--;
-                }
-
-                if (parser->data_left == 0) {
-                    parser_include_line(parser);
-                    parser->state = STATE_READLINE;
-                }
+                /* Copy as much of the block as we've got in one go. */
+                size_t used = parser->data_left < len ? parser->data_left : len;
+                parser_append_data(parser, buf, used);
+                parser->data_left -= used;
+                buf += used; len -= used;
+
+                if (parser->data_left == 0)
+                    parser_finish_data(parser);
             } break;
 
             case STATE_HEXDATA: {
-                if (parser->data_left > 0) {
-                    int value = hex2int(ch);
-                    if (value != -1) {
-                        if (parser->nibble == -1) {
-                            parser->nibble = value;
-                        } else {
-                            value |= (parser->nibble << 4);
-                            parser->nibble = -1;
-                            parser_append(parser, value);
-                            parser->data_left--;
-                        }
-                    }
-                }
+                /* Decode as much of the block as we've got in one go. */
+                size_t used = parser_feed_hexdata(parser, buf, len);
+                buf += used; len -= used;
 
-                if (parser->data_left == 0) {
-                    parser_include_line(parser);
-                    parser->state = STATE_READLINE;
-                }
+                if (parser->data_left == 0)
+                    parser_finish_data(parser);
+            } break;
+
+            case STATE_DATAMODE: {
+                /* Pass everything through untouched. */
+                if (parser->cbs->handle_data)
+                    parser->cbs->handle_data(buf, len, parser->priv);
+                len = 0;
             } break;
         }
     }
@@ -337,8 +782,14 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
 
 void at_parser_free(struct at_parser *parser)
 {
-    free(parser->buf);
-    free(parser);
+#ifndef AT_NO_MALLOC
+    if (parser->allocated) {
+        free(parser->buf);
+        free(parser);
+    }
+#else
+    (void) parser;
+#endif
 }
 
 /* vim: set ts=4 sw=4 et: */
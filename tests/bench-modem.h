@@ -0,0 +1,39 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef BENCH_MODEM_H
+#define BENCH_MODEM_H
+
+#include <attentive/cellular.h>
+
+/**
+ * A command-specific scanner, picked when a replayed command starts with
+ * the given prefix.
+ */
+struct bench_command {
+    const char *prefix;
+    at_line_scanner_t scanner;
+};
+
+/**
+ * Driver internals exposed to the parser benchmark.
+ */
+struct bench_modem {
+    const char *name;
+    struct cellular *(*alloc)(void);
+    void (*free)(struct cellular *modem);
+    at_line_scanner_t scan_line;            /**< Takes the modem as argument. */
+    const struct bench_command *commands;   /**< Terminated by a NULL prefix. */
+};
+
+extern const struct bench_modem bench_sim800;
+extern const struct bench_modem bench_telit2;
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,648 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <attentive/parser.h>
+
+#include "bench-modem.h"
+
+#define HEXDATA_SIZE    1460
+#define ITERATIONS      20000
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t bytes, double elapsed)
+{
+    printf("%-24s %8.2f MB/s\n", name, bytes / elapsed / 1e6);
+}
+
+/*
+ * Allocation counting; the benchmark is linked with --wrap=malloc etc.
+ */
+
+static size_t allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    allocations++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+/*
+ * Hex decoding.
+ */
+
+static size_t responses;
+
+static void handle_response(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+    responses++;
+}
+
+static void handle_urc(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+}
+
+static enum at_response_type scan_line(const char *line, size_t len, void *priv)
+{
+    (void) len;
+    (void) priv;
+
+    int bytes;
+    if (sscanf(line, "+HEXDATA: %d", &bytes) == 1)
+        return AT_RESPONSE_HEXDATA_FOLLOWS(bytes);
+
+    return AT_RESPONSE_UNKNOWN;
+}
+
+/* The per-nibble decoder used by the parser before the table-driven one. */
+static int hex2int(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static size_t legacy_hexdata(char *out, size_t size, const char *in, size_t len)
+{
+    size_t used = 0;
+    int nibble = -1;
+
+    while (len--) {
+        int value = hex2int(*in++);
+        if (value != -1) {
+            if (nibble == -1) {
+                nibble = value;
+            } else {
+                value |= (nibble << 4);
+                nibble = -1;
+                if (used < size-1)
+                    out[used++] = value;
+            }
+        }
+    }
+
+    return used;
+}
+
+static void bench_hexdata(void)
+{
+    static const char digits[] = "0123456789abcdef";
+    static char input[64 + 2*HEXDATA_SIZE + 16];
+    static char output[HEXDATA_SIZE + 1];
+
+    /* Build a response carrying a hex-encoded block of random data. */
+    int header = sprintf(input, "\r\n+HEXDATA: %d\r\n", HEXDATA_SIZE);
+    char *payload = input + header;
+    for (int i=0; i<HEXDATA_SIZE; i++) {
+        int byte = rand() & 0xff;
+        payload[2*i] = digits[byte >> 4];
+        payload[2*i+1] = digits[byte & 0xf];
+    }
+    size_t len = header + 2*HEXDATA_SIZE;
+    len += sprintf(input + len, "\r\nOK\r\n");
+
+    /* Reference: the per-nibble loop. */
+    double start = now();
+    for (int i=0; i<ITERATIONS; i++)
+        legacy_hexdata(output, sizeof(output), payload, 2*HEXDATA_SIZE);
+    report("hexdata (per-nibble)", (size_t) ITERATIONS * 2*HEXDATA_SIZE, now() - start);
+
+    /* The full parser, including header and final response handling. */
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = scan_line,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 2*HEXDATA_SIZE, NULL);
+
+    responses = 0;
+    start = now();
+    for (int i=0; i<ITERATIONS; i++) {
+        at_parser_await_response(parser);
+        at_parser_feed(parser, input, len);
+    }
+    report("hexdata (parser)", (size_t) ITERATIONS * 2*HEXDATA_SIZE, now() - start);
+
+    if (responses != ITERATIONS)
+        printf("warning: %zu responses, expected %d\n", responses, ITERATIONS);
+
+    at_parser_free(parser);
+}
+
+/*
+ * Line classification.
+ */
+
+static const char *const urc_table[] = {
+    "=>", "+BTPAIRING: ", "+BTPAIR: ", "+BTCONNECTING: ", "+BTCONNECT: ",
+    "+BTDISCONN: ", "+BTSPPMAN: ", "+CIPRXGET: 1,", "+FTPGET: 1,",
+    "+PDP: DEACT", "+SAPBR 1: DEACT", "*PSNWID: ", "*PSUTTZ: ", "+CTZV: ",
+    "DST: ", "+CIEV: ", "RDY", "+CPIN: READY", "Call Ready", "SMS Ready",
+    "NORMAL POWER DOWN", "UNDER-VOLTAGE POWER DOWN", "UNDER-VOLTAGE WARNNING",
+    "OVER-VOLTAGE POWER DOWN", "OVER-VOLTAGE WARNNING",
+    NULL
+};
+
+static const char *const lines[] = {
+    "+CIPRXGET: 2,0,1460,0", "OK", "+CSQ: 17,0", "+CIPRXGET: 1,0",
+    "0, CONNECT OK", "DATA ACCEPT:0,100", "SEND OK", "+CREG: 0,1",
+};
+#define NLINES (sizeof(lines) / sizeof(*lines))
+
+static void bench_classify(void)
+{
+    size_t lens[NLINES];
+    for (size_t i=0; i<NLINES; i++)
+        lens[i] = strlen(lines[i]);
+
+    volatile int found = 0;
+
+    double start = now();
+    for (int i=0; i<ITERATIONS * 10; i++)
+        for (size_t j=0; j<NLINES; j++)
+            found += at_prefix_in_table(lines[j], urc_table);
+    double elapsed = now() - start;
+    printf("%-24s %8.2f Mlines/s\n", "classify (table)", ITERATIONS * 10.0 * NLINES / elapsed / 1e6);
+
+    struct at_prefix_entry entries[32];
+    struct at_prefix_matcher matcher;
+    at_prefix_matcher_init(&matcher, entries, 32);
+    at_prefix_matcher_add(&matcher, urc_table, 1);
+
+    start = now();
+    for (int i=0; i<ITERATIONS * 10; i++)
+        for (size_t j=0; j<NLINES; j++)
+            found += at_prefix_match(&matcher, lines[j], lens[j]);
+    elapsed = now() - start;
+    printf("%-24s %8.2f Mlines/s\n", "classify (matcher)", ITERATIONS * 10.0 * NLINES / elapsed / 1e6);
+}
+
+static void bench_fields(void)
+{
+    static const char line[] = "+CIPRXGET: 2,0,1460,0";
+    volatile int sum = 0;
+
+    double start = now();
+    for (int i=0; i<ITERATIONS * 10; i++) {
+        int requested, confirmed;
+        if (sscanf(line, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed) == 2)
+            sum += requested + confirmed;
+    }
+    double elapsed = now() - start;
+    printf("%-24s %8.2f Mlines/s\n", "fields (sscanf)", ITERATIONS * 10.0 / elapsed / 1e6);
+
+    start = now();
+    for (int i=0; i<ITERATIONS * 10; i++) {
+        struct at_fields fields;
+        int requested, confirmed;
+        if (at_fields_parse(&fields, "+CIPRXGET: 2,", line, sizeof(line) - 1) >= 3 &&
+            at_field_int(&fields, 1, &requested) && at_field_int(&fields, 2, &confirmed))
+            sum += requested + confirmed;
+    }
+    elapsed = now() - start;
+    printf("%-24s %8.2f Mlines/s\n", "fields (tokenizer)", ITERATIONS * 10.0 / elapsed / 1e6);
+}
+
+/*
+ * Trace replay.
+ *
+ * Traces use the at_set_trace_unix() format: a "<time> RX|TX <length>" line,
+ * the raw bytes and a newline. RX chunks are fed to the parser; TX chunks
+ * start a new command and pick its scanner, just like at-unix does.
+ */
+
+struct trace_event {
+    bool tx;
+    const char *data;
+    size_t len;
+};
+
+struct trace {
+    const char *name;
+    const struct bench_modem *modem;
+    char *buf;
+    size_t len, size;
+    struct trace_event *events;
+    size_t nevents;
+    size_t rx_bytes;
+    bool synthetic;         /**< Every command gets a response. */
+};
+
+static void trace_append(struct trace *trace, const void *data, size_t len)
+{
+    if (trace->len + len > trace->size) {
+        trace->size = 2 * (trace->len + len);
+        trace->buf = realloc(trace->buf, trace->size);
+    }
+    memcpy(trace->buf + trace->len, data, len);
+    trace->len += len;
+}
+
+static void trace_record(struct trace *trace, const char *dir, const void *data, size_t len)
+{
+    char header[48];
+    int n = snprintf(header, sizeof(header), "0.000000 %s %zu\n", dir, len);
+    trace_append(trace, header, n);
+    trace_append(trace, data, len);
+    trace_append(trace, "\n", 1);
+}
+
+static void trace_printf(struct trace *trace, const char *dir, const char *format, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+static void trace_printf(struct trace *trace, const char *dir, const char *format, ...)
+{
+    char line[256];
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    trace_record(trace, dir, line, n);
+}
+
+static void trace_random(struct trace *trace, size_t len)
+{
+    char data[4096];
+    for (size_t i=0; i<len; i++)
+        data[i] = rand() & 0xff;
+    trace_record(trace, "RX", data, len);
+}
+
+/** Split a trace into events. Returns false if it's malformed. */
+static bool trace_parse(struct trace *trace)
+{
+    const char *p = trace->buf, *end = trace->buf + trace->len;
+
+    trace->nevents = 0;
+    trace->rx_bytes = 0;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        char dir[3];
+        size_t len;
+        if (!eol || sscanf(p, "%*s %2s %zu", dir, &len) != 2)
+            return false;
+        p = eol + 1;
+        if (len > (size_t) (end - p))
+            return false;
+
+        trace->events = realloc(trace->events, (trace->nevents + 1) * sizeof(*trace->events));
+        trace->events[trace->nevents++] = (struct trace_event) {
+            .tx = !strcmp(dir, "TX"),
+            .data = p,
+            .len = len,
+        };
+        if (strcmp(dir, "TX"))
+            trace->rx_bytes += len;
+        p += len + 1;
+    }
+
+    return true;
+}
+
+static bool trace_load(struct trace *trace, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return false;
+
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        trace_append(trace, buf, n);
+    fclose(f);
+
+    return trace_parse(trace);
+}
+
+static void trace_free(struct trace *trace)
+{
+    free(trace->buf);
+    free(trace->events);
+}
+
+/*
+ * Synthetic traces.
+ */
+
+static const char *const sim800_urcs[] = {
+    "+CIPRXGET: 1,0", "+FTPGET: 1,1", "*PSUTTZ: 2016,1,1,12,0,0,\"+4\",0",
+    "+CIEV: 10,\"26003\",\"Orange\",\"Orange\",0,0", "DST: 0", "0, CLOSED",
+    "1, CONNECT OK", "+BTSPPMAN: 1",
+};
+#define SIM800_NURCS (sizeof(sim800_urcs) / sizeof(*sim800_urcs))
+
+static void trace_sim800_urc_storm(struct trace *trace)
+{
+    trace_printf(trace, "TX", "AT+CSQ\r");
+    for (int i=0; i<1000; i++)
+        trace_printf(trace, "RX", "\r\n%s\r\n", sim800_urcs[i % SIM800_NURCS]);
+    trace_printf(trace, "RX", "\r\n+CSQ: 17,0\r\n\r\nOK\r\n");
+}
+
+static void trace_sim800_ciprxget(struct trace *trace)
+{
+    for (int i=0; i<50; i++) {
+        trace_printf(trace, "TX", "AT+CIPRXGET=2,0,1460\r");
+        trace_printf(trace, "RX", "\r\n+CIPRXGET: 2,0,1460,1460\r\n");
+        trace_random(trace, 1460);
+        trace_printf(trace, "RX", "\r\nOK\r\n");
+        trace_printf(trace, "RX", "\r\n+CIPRXGET: 1,0\r\n");
+    }
+}
+
+static void trace_sim800_ftpget(struct trace *trace)
+{
+    for (int i=0; i<50; i++) {
+        trace_printf(trace, "TX", "AT+FTPGET=2,1360\r");
+        trace_printf(trace, "RX", "\r\n+FTPGET: 2,1360\r\n");
+        trace_random(trace, 1360);
+        trace_printf(trace, "RX", "\r\nOK\r\n");
+        if (i % 4 == 0)
+            trace_printf(trace, "RX", "\r\n+FTPGET: 1,1\r\n");
+    }
+}
+
+static void trace_telit2_srecv(struct trace *trace)
+{
+    for (int i=0; i<50; i++) {
+        trace_printf(trace, "RX", "\r\nSRING: 1\r\n");
+        trace_printf(trace, "TX", "AT#SRECV=1,1500\r");
+        trace_printf(trace, "RX", "\r\n#SRECV: 1,1500\r\n");
+        trace_random(trace, 1500);
+        trace_printf(trace, "RX", "\r\nOK\r\n");
+    }
+}
+
+static void trace_telit2_ftprecv(struct trace *trace)
+{
+    for (int i=0; i<50; i++) {
+        trace_printf(trace, "TX", "AT#FTPRECV=1500\r");
+        trace_printf(trace, "RX", "\r\n#FTPRECV: 1500\r\n");
+        trace_random(trace, 1500);
+        trace_printf(trace, "RX", "\r\nOK\r\n");
+    }
+}
+
+/* Neither driver reads hex data yet; use the scanner from above. */
+static const struct bench_command hexdata_commands[] = {
+    { "AT+HEXDATA", scan_line },
+    { NULL, NULL }
+};
+
+static const struct bench_modem bench_hexmodem = {
+    .name = "hexdata",
+    .commands = hexdata_commands,
+};
+
+static void trace_hexdata(struct trace *trace)
+{
+    static const char digits[] = "0123456789abcdef";
+    char payload[2*HEXDATA_SIZE];
+
+    for (int i=0; i<20; i++) {
+        for (int j=0; j<HEXDATA_SIZE; j++) {
+            int byte = rand() & 0xff;
+            payload[2*j] = digits[byte >> 4];
+            payload[2*j+1] = digits[byte & 0xf];
+        }
+        trace_printf(trace, "TX", "AT+HEXDATA\r");
+        trace_printf(trace, "RX", "\r\n+HEXDATA: %d\r\n", HEXDATA_SIZE);
+        trace_record(trace, "RX", payload, sizeof(payload));
+        trace_printf(trace, "RX", "\r\nOK\r\n");
+    }
+}
+
+/*
+ * Replay.
+ */
+
+struct replay {
+    const struct bench_modem *modem;
+    struct cellular *dev;
+    at_line_scanner_t scanner;
+    size_t lines;
+    size_t responses;
+    size_t urcs;
+};
+
+static enum at_response_type replay_scan_line(const char *line, size_t len, void *priv)
+{
+    struct replay *replay = priv;
+    enum at_response_type type = AT_RESPONSE_UNKNOWN;
+
+    replay->lines++;
+    if (replay->scanner)
+        type = replay->scanner(line, len, replay->dev);
+    if (type == AT_RESPONSE_UNKNOWN && replay->modem->scan_line)
+        type = replay->modem->scan_line(line, len, replay->dev);
+    return type;
+}
+
+static void replay_handle_response(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    struct replay *replay = priv;
+    replay->responses++;
+}
+
+static void replay_handle_urc(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    struct replay *replay = priv;
+    replay->urcs++;
+}
+
+static at_line_scanner_t replay_scanner(const struct bench_modem *modem, const struct trace_event *event)
+{
+    for (const struct bench_command *cmd=modem->commands; cmd->prefix; cmd++) {
+        size_t len = strlen(cmd->prefix);
+        if (event->len >= len && !memcmp(event->data, cmd->prefix, len))
+            return cmd->scanner;
+    }
+    return NULL;
+}
+
+static void replay(struct trace *trace, size_t chunk, int iterations)
+{
+    static char data[4096];
+
+    struct replay replay = {
+        .modem = trace->modem,
+        .dev = trace->modem->alloc ? trace->modem->alloc() : NULL,
+    };
+    struct at_parser_callbacks cbs = {
+        .handle_response = replay_handle_response,
+        .handle_urc = replay_handle_urc,
+        .scan_line = replay_scan_line,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 2*HEXDATA_SIZE + 64, &replay);
+
+    size_t commands = 0;
+    size_t allocated = allocations;
+    double start = now();
+    for (int i=0; i<iterations; i++) {
+        for (size_t j=0; j<trace->nevents; j++) {
+            const struct trace_event *event = &trace->events[j];
+            if (event->tx) {
+                /* Raw data goes straight to a caller-supplied buffer. */
+                commands++;
+                replay.scanner = replay_scanner(trace->modem, event);
+                at_parser_set_data_buffer(parser, data, sizeof(data));
+                at_parser_await_response(parser);
+                continue;
+            }
+            for (size_t k=0; k<event->len; k+=chunk)
+                at_parser_feed(parser, event->data + k,
+                               event->len - k < chunk ? event->len - k : chunk);
+        }
+    }
+    double elapsed = now() - start;
+    allocated = allocations - allocated;
+
+    printf("%-24s %5zu %8.2f MB/s %8.1f ns/line %6zu allocs\n",
+           trace->name, chunk, (double) trace->rx_bytes * iterations / elapsed / 1e6,
+           replay.lines ? elapsed * 1e9 / replay.lines : 0.0, allocated);
+
+    /* A scanner mistaking data for lines would show up here. */
+    if (trace->synthetic && replay.responses != commands)
+        printf("warning: %zu responses, expected %zu\n", replay.responses, commands);
+
+    at_parser_free(parser);
+    if (replay.dev)
+        trace->modem->free(replay.dev);
+}
+
+static void bench_trace(struct trace *trace)
+{
+    static const size_t chunks[] = { 1, 16, 64, 256, 1024, 4096 };
+
+    /* Replay around a few megabytes per measurement. */
+    int iterations = trace->rx_bytes ? 4000000 / trace->rx_bytes + 1 : 1;
+    for (size_t i=0; i<sizeof(chunks)/sizeof(*chunks); i++)
+        replay(trace, chunks[i], iterations);
+}
+
+static const struct {
+    const char *name;
+    const struct bench_modem *modem;
+    void (*generate)(struct trace *trace);
+} synthetic_traces[] = {
+    { "sim800 urc storm", &bench_sim800, trace_sim800_urc_storm },
+    { "sim800 ciprxget", &bench_sim800, trace_sim800_ciprxget },
+    { "sim800 ftpget", &bench_sim800, trace_sim800_ftpget },
+    { "telit2 srecv", &bench_telit2, trace_telit2_srecv },
+    { "telit2 ftprecv", &bench_telit2, trace_telit2_ftprecv },
+    { "hexdata", &bench_hexmodem, trace_hexdata },
+};
+
+static void bench_traces(void)
+{
+    printf("%-24s %5s\n", "trace", "chunk");
+    for (size_t i=0; i<sizeof(synthetic_traces)/sizeof(*synthetic_traces); i++) {
+        struct trace trace = {
+            .name = synthetic_traces[i].name,
+            .modem = synthetic_traces[i].modem,
+            .synthetic = true,
+        };
+        synthetic_traces[i].generate(&trace);
+        trace_parse(&trace);
+        bench_trace(&trace);
+        trace_free(&trace);
+    }
+}
+
+/**
+ * Replay a recorded trace, given as "<modem>:<path>".
+ */
+static int bench_file(const char *arg)
+{
+    static const struct bench_modem *const modems[] = { &bench_sim800, &bench_telit2, NULL };
+
+    const char *path = strchr(arg, ':');
+    const struct bench_modem *const *modem = modems;
+    while (path && *modem && strncmp(arg, (*modem)->name, path - arg))
+        modem++;
+    if (!path || !*modem) {
+        fprintf(stderr, "usage: bench-parser [sim800|telit2:trace]...\n");
+        return -1;
+    }
+
+    struct trace trace = {
+        .name = path + 1,
+        .modem = *modem,
+    };
+    if (!trace_load(&trace, path + 1)) {
+        fprintf(stderr, "%s: can't load trace\n", path + 1);
+        trace_free(&trace);
+        return -1;
+    }
+    bench_trace(&trace);
+    trace_free(&trace);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        for (int i=1; i<argc; i++)
+            if (bench_file(argv[i]) == -1)
+                return 1;
+        return 0;
+    }
+
+    bench_hexdata();
+    bench_classify();
+    bench_fields();
+    bench_traces();
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
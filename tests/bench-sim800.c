@@ -0,0 +1,41 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * The scanners are static, so pull in the whole driver.
+ */
+
+#include "../src/modem/at-sim800.c"
+
+#include "bench-modem.h"
+
+static struct cellular *bench_sim800_alloc(void)
+{
+    return cellular_sim800_alloc(CELLULAR_SIM800_PROFILE_DEFAULT);
+}
+
+static const struct bench_command bench_sim800_commands[] = {
+    { "AT+CIPRXGET=2", scanner_ciprxget },
+    { "AT+FTPGET=2", scanner_ftpget2 },
+    { "AT+CIPSTATUS", scanner_cipstatus },
+    { "AT+CIFSR", scanner_cifsr },
+    { "AT+CIPSHUT", scanner_cipshut },
+    { "AT+CIPSEND", scanner_cipsend },
+    { "AT+CIPCLOSE", scanner_cipclose },
+    { NULL, NULL }
+};
+
+const struct bench_modem bench_sim800 = {
+    .name = "sim800",
+    .alloc = bench_sim800_alloc,
+    .free = cellular_sim800_free,
+    .scan_line = scan_line,
+    .commands = bench_sim800_commands,
+};
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,32 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * The scanners are static, so pull in the whole driver.
+ */
+
+#include "../src/modem/telit2.c"
+
+#include "bench-modem.h"
+
+static const struct bench_command bench_telit2_commands[] = {
+    { "AT#SRECV", scanner_srecv },
+    { "AT#FTPRECV", scanner_ftprecv },
+    { "AT#SD=", scanner_sd_online },
+    { NULL, NULL }
+};
+
+const struct bench_modem bench_telit2 = {
+    .name = "telit2",
+    .alloc = cellular_telit2_alloc,
+    .free = cellular_telit2_free,
+    .scan_line = scan_line,
+    .commands = bench_telit2_commands,
+};
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,564 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * End-to-end benchmarks of at-unix and the drivers against a fake modem.
+ * Results go to stderr; at-unix logs commands on stdout.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <attentive/at-unix.h>
+#include <attentive/cellular.h>
+
+#include "modem-sim.h"
+
+#define COMMANDS        2000
+#define CONNID          1
+#define SEND_CHUNK      1460
+#define QUERIES         100
+#define CMUX_FRAME_SIZE 127
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+#ifdef AT_STATS
+static void print_stats(struct at *at)
+{
+    struct at_stats stats;
+    at_stats_snapshot(at, &stats);
+
+    fprintf(stderr, "    %u commands, %u timeouts, %u urcs, %u truncated, %u wakeups, "
+                    "rx %lu bytes, tx %lu bytes\n",
+            stats.commands, stats.timeouts, stats.urcs, stats.truncations, stats.wakeups,
+            stats.rx_bytes, stats.tx_bytes);
+    for (int i=0; i<AT_STATS_PREFIXES && stats.command[i].count; i++) {
+        const struct at_stats_command *command = &stats.command[i];
+        fprintf(stderr, "    %-12s %8u", *command->prefix ? command->prefix : "(other)", command->count);
+        for (int j=0; j<AT_STATS_BUCKETS; j++)
+            if (command->latency[j])
+                fprintf(stderr, "  %uus:%u", 1u << j, command->latency[j]);
+        fprintf(stderr, "\n");
+    }
+}
+#else
+#define print_stats(at) ((void) 0)
+#endif
+
+static struct at *open_channel(struct modem_sim *sim)
+{
+    struct at *at = at_alloc_unix(modem_sim_path(sim), 0, 0);
+    if (!at || at_open(at) != 0) {
+        perror("at_open");
+        exit(1);
+    }
+    at_set_timeout(at, 10);
+    return at;
+}
+
+/*
+ * Command round-trips.
+ */
+
+struct async_state {
+    struct at *at;
+    int pending;
+    int failed;
+};
+
+static void async_done(const char *response, size_t len, void *ctx)
+{
+    (void) len;
+    struct async_state *state = ctx;
+
+    if (!response)
+        state->failed++;
+    state->pending--;
+    at_notify(state->at);
+}
+
+static bool async_finished(void *arg)
+{
+    const struct async_state *state = arg;
+    return state->pending == 0;
+}
+
+static void bench_commands(const char *name, const struct modem_sim_config *config)
+{
+    static double latency[COMMANDS];
+
+    struct modem_sim *sim = modem_sim_alloc(config);
+    struct at *at = open_channel(sim);
+
+    /* Let the reader thread settle. */
+    at_command(at, "AT");
+
+    double start = now();
+    for (int i=0; i<COMMANDS; i++) {
+        double t = now();
+        if (!at_command(at, "AT")) {
+            fprintf(stderr, "%s: command failed: %s\n", name, strerror(errno));
+            break;
+        }
+        latency[i] = now() - t;
+    }
+    double elapsed = now() - start;
+
+    qsort(latency, COMMANDS, sizeof(*latency), compare_double);
+    fprintf(stderr, "%-28s %8.0f cmd/s  p50 %6.0f us  p99 %6.0f us  p99.9 %6.0f us  max %6.0f us\n",
+            name, COMMANDS / elapsed,
+            latency[COMMANDS / 2] * 1e6, latency[COMMANDS * 99 / 100] * 1e6,
+            latency[COMMANDS * 999 / 1000] * 1e6, latency[COMMANDS - 1] * 1e6);
+
+    /* The same, queued up front. */
+    struct async_state state = { .at = at, .pending = COMMANDS };
+    start = now();
+    for (int i=0; i<COMMANDS; i++)
+        if (at_command_async(at, async_done, &state, "AT") == -1)
+            state.pending--, state.failed++;
+    at_wait(at, async_finished, &state, 60000);
+    elapsed = now() - start;
+    fprintf(stderr, "%-28s %8.0f cmd/s  (%d failed)\n", "  async", COMMANDS / elapsed, state.failed);
+    print_stats(at);
+
+    at_close(at);
+    at_free(at);
+    modem_sim_free(sim);
+}
+
+/*
+ * Socket goodput.
+ */
+
+static void bench_socket(const char *name, const struct modem_sim_config *config, size_t amount)
+{
+    static char buf[4096];
+
+    struct modem_sim *sim = modem_sim_alloc(config);
+    struct at *at = open_channel(sim);
+    struct cellular *modem = config->type == MODEM_SIM_TELIT2 ?
+        cellular_telit2_alloc() : cellular_sim800_alloc(CELLULAR_SIM800_PROFILE_DEFAULT);
+
+    if (cellular_attach(modem, at, "internet") != 0 ||
+        modem->ops->socket_connect(modem, CONNID, "example.com", 80) != 0) {
+        fprintf(stderr, "%s: connect failed: %s\n", name, strerror(errno));
+        goto out;
+    }
+
+    /* Receive. */
+    size_t received = 0;
+    double start = now();
+    while (received < amount) {
+        ssize_t n = modem->ops->socket_recv(modem, CONNID, buf, sizeof(buf), 0);
+        if (n < 0) {
+            fprintf(stderr, "%s: recv failed: %s\n", name, strerror(errno));
+            goto out;
+        }
+        if (n == 0 && modem->ops->socket_poll) {
+            struct cellular_pollfd fd = { .connid = CONNID, .events = CELLULAR_POLLIN };
+            modem->ops->socket_poll(modem, &fd, 1, 1000);
+        }
+        received += n;
+    }
+    double elapsed = now() - start;
+    fprintf(stderr, "%-28s recv %8.1f kB/s", name, received / elapsed / 1e3);
+
+    /* Send. */
+    memset(buf, 'x', sizeof(buf));
+    size_t sent = 0;
+    start = now();
+    while (sent < amount) {
+        ssize_t n = modem->ops->socket_send(modem, CONNID, buf, SEND_CHUNK, 0);
+        if (n <= 0) {
+            fprintf(stderr, "\n%s: send failed: %s\n", name, strerror(errno));
+            goto out;
+        }
+        sent += n;
+    }
+    elapsed = now() - start;
+    fprintf(stderr, "  send %8.1f kB/s\n", sent / elapsed / 1e3);
+
+    if (modem_sim_received(sim) != sent)
+        fprintf(stderr, "warning: modem got %zu bytes, sent %zu\n", modem_sim_received(sim), sent);
+
+    modem->ops->socket_close(modem, CONNID);
+    print_stats(at);
+
+out:
+    cellular_detach(modem);
+    if (config->type == MODEM_SIM_TELIT2)
+        cellular_telit2_free(modem);
+    else
+        cellular_sim800_free(modem);
+    at_close(at);
+    at_free(at);
+    modem_sim_free(sim);
+}
+
+/*
+ * Control queries during a transfer.
+ */
+
+struct transfer {
+    struct cellular *modem;
+    volatile bool stop;
+    size_t received;
+};
+
+static void *transfer_thread(void *arg)
+{
+    struct transfer *transfer = arg;
+    char buf[4096];
+
+    while (!transfer->stop) {
+        ssize_t n = transfer->modem->ops->socket_recv(transfer->modem, CONNID, buf, sizeof(buf), 0);
+        if (n < 0)
+            break;
+        transfer->received += n;
+    }
+
+    return NULL;
+}
+
+static void bench_control(const char *name, const struct modem_sim_config *config, bool cmux)
+{
+    static double latency[QUERIES];
+
+    struct modem_sim *sim = modem_sim_alloc(config);
+    struct at_cmux *mux = NULL;
+    struct at *data, *control;
+    if (cmux) {
+        /* Data on one channel, queries on another. */
+        mux = at_cmux_alloc(modem_sim_path(sim), 0, CMUX_FRAME_SIZE);
+        if (!mux || at_cmux_open(mux, "AT+CMUX=0,0,5,127") != 0) {
+            perror("at_cmux_open");
+            exit(1);
+        }
+        data = at_alloc_unix_cmux(mux, 1, 0);
+        control = at_alloc_unix_cmux(mux, 2, 0);
+        if (!data || !control || at_open(data) != 0 || at_open(control) != 0) {
+            perror("at_open");
+            exit(1);
+        }
+        at_set_timeout(data, 10);
+        at_set_timeout(control, 10);
+    } else {
+        data = control = open_channel(sim);
+    }
+
+    struct cellular *modem = cellular_sim800_alloc(CELLULAR_SIM800_PROFILE_DEFAULT);
+    struct transfer transfer = { .modem = modem };
+    pthread_t thread;
+    if (cellular_attach(modem, data, "internet") != 0 ||
+        modem->ops->socket_connect(modem, CONNID, "example.com", 80) != 0) {
+        fprintf(stderr, "%s: connect failed: %s\n", name, strerror(errno));
+        goto out;
+    }
+
+    /* Poll the signal quality while the transfer runs flat out. */
+    pthread_create(&thread, NULL, transfer_thread, &transfer);
+    double start = now();
+    int failed = 0;
+    for (int i=0; i<QUERIES; i++) {
+        double t = now();
+        if (!at_command(control, "AT+CSQ"))
+            failed++;
+        latency[i] = now() - t;
+        nanosleep(&(struct timespec) { .tv_nsec = 2000000 }, NULL);
+    }
+    double elapsed = now() - start;
+    transfer.stop = true;
+    pthread_join(thread, NULL);
+
+    qsort(latency, QUERIES, sizeof(*latency), compare_double);
+    fprintf(stderr, "%-28s AT+CSQ p50 %6.0f us  max %6.0f us  (%d failed)  recv %8.1f kB/s\n",
+            name, latency[QUERIES / 2] * 1e6, latency[QUERIES - 1] * 1e6, failed,
+            transfer.received / elapsed / 1e3);
+
+    modem->ops->socket_close(modem, CONNID);
+
+out:
+    cellular_detach(modem);
+    cellular_sim800_free(modem);
+    if (cmux) {
+        at_close(control);
+        at_free(control);
+    }
+    at_close(data);
+    at_free(data);
+    if (mux)
+        at_cmux_free(mux);
+    modem_sim_free(sim);
+}
+
+/*
+ * Modem groups: several receive streams spread over the members.
+ */
+
+#define GROUP_MODEMS 2
+#define GROUP_STREAMS 2
+
+struct group_stream {
+    struct cellular *group;
+    int connid;
+    size_t amount;
+    size_t received;
+};
+
+static void *group_stream_thread(void *arg)
+{
+    struct group_stream *stream = arg;
+    struct cellular *group = stream->group;
+    char buf[4096];
+
+    while (stream->received < stream->amount) {
+        ssize_t n = group->ops->socket_recv(group, stream->connid, buf, sizeof(buf), 0);
+        if (n < 0)
+            break;
+        stream->received += n;
+    }
+
+    return NULL;
+}
+
+static void bench_group(const char *name, const struct modem_sim_config *config, int count, size_t amount)
+{
+    struct modem_sim *sims[GROUP_MODEMS];
+    struct at *ats[GROUP_MODEMS];
+    struct cellular *modems[GROUP_MODEMS];
+    struct cellular *group = cellular_group_alloc();
+
+    for (int i=0; i<count; i++) {
+        sims[i] = modem_sim_alloc(config);
+        ats[i] = open_channel(sims[i]);
+        modems[i] = cellular_sim800_alloc(CELLULAR_SIM800_PROFILE_DEFAULT);
+        if (cellular_attach(modems[i], ats[i], "internet") != 0) {
+            fprintf(stderr, "%s: attach failed: %s\n", name, strerror(errno));
+            exit(1);
+        }
+        cellular_group_add(group, modems[i], 0, 6);
+    }
+
+    struct group_stream streams[GROUP_STREAMS];
+    pthread_t threads[GROUP_STREAMS];
+    for (int i=0; i<GROUP_STREAMS; i++) {
+        streams[i] = (struct group_stream) {
+            .group = group,
+            .connid = i,
+            .amount = amount / GROUP_STREAMS,
+        };
+        if (group->ops->socket_connect(group, i, "example.com", 80) != 0) {
+            fprintf(stderr, "%s: connect failed: %s\n", name, strerror(errno));
+            exit(1);
+        }
+    }
+
+    double start = now();
+    for (int i=0; i<GROUP_STREAMS; i++)
+        pthread_create(&threads[i], NULL, group_stream_thread, &streams[i]);
+    size_t received = 0;
+    for (int i=0; i<GROUP_STREAMS; i++) {
+        pthread_join(threads[i], NULL);
+        received += streams[i].received;
+    }
+    double elapsed = now() - start;
+    fprintf(stderr, "%-28s recv %8.1f kB/s  (%d streams)\n", name, received / elapsed / 1e3, GROUP_STREAMS);
+
+    for (int i=0; i<GROUP_STREAMS; i++)
+        group->ops->socket_close(group, i);
+    cellular_group_free(group);
+    for (int i=0; i<count; i++) {
+        cellular_detach(modems[i]);
+        cellular_sim800_free(modems[i]);
+        at_close(ats[i]);
+        at_free(ats[i]);
+        modem_sim_free(sims[i]);
+    }
+}
+
+/*
+ * Cold start: baud rate detection, then attach.
+ */
+
+#define BRINGUP_MODEMS 4
+
+static const speed_t bringup_candidates[] = { B921600, B460800, B230400, B115200, B57600, B9600, 0 };
+
+/** Open a channel at a rate the modem doesn't use. */
+static struct at *bringup_open(struct modem_sim *sim)
+{
+    struct at *at = at_alloc_unix(modem_sim_path(sim), B9600, 0);
+    if (!at || at_open(at) != 0) {
+        perror("at_open");
+        exit(1);
+    }
+    at_set_timeout(at, 10);
+    return at;
+}
+
+/** Open a channel, then find the right rate. */
+static struct at *bringup_channel(struct modem_sim *sim, const char *cache)
+{
+    struct at *at = bringup_open(sim);
+    if (!at_autobaud_unix(at, bringup_candidates, cache)) {
+        perror("at_autobaud_unix");
+        exit(1);
+    }
+    return at;
+}
+
+static void bringup_free(struct modem_sim *sims[], struct at *ats[], struct cellular *modems[])
+{
+    for (int i=0; i<BRINGUP_MODEMS; i++) {
+        cellular_detach(modems[i]);
+        cellular_sim800_free(modems[i]);
+        at_close(ats[i]);
+        at_free(ats[i]);
+        modem_sim_free(sims[i]);
+    }
+}
+
+static void bench_bringup(const char *name, const struct modem_sim_config *config)
+{
+    struct modem_sim *sims[BRINGUP_MODEMS];
+    struct at *ats[BRINGUP_MODEMS];
+    struct cellular *modems[BRINGUP_MODEMS];
+    char cache[64];
+    snprintf(cache, sizeof(cache), "/tmp/bench-unix-%d.baud", (int) getpid());
+
+    for (int i=0; i<BRINGUP_MODEMS; i++) {
+        sims[i] = modem_sim_alloc(config);
+        modems[i] = cellular_sim800_alloc(CELLULAR_SIM800_PROFILE_DEFAULT);
+    }
+
+    /* First boot probes; the next one starts at the cached rate. */
+    double start = now();
+    for (int i=0; i<BRINGUP_MODEMS; i++)
+        ats[i] = bringup_channel(sims[i], cache);
+    double cold = (now() - start) / BRINGUP_MODEMS;
+
+    for (int i=0; i<BRINGUP_MODEMS; i++) {
+        at_close(ats[i]);
+        at_free(ats[i]);
+    }
+    start = now();
+    for (int i=0; i<BRINGUP_MODEMS; i++)
+        ats[i] = bringup_channel(sims[i], cache);
+    double warm = (now() - start) / BRINGUP_MODEMS;
+
+    start = now();
+    for (int i=0; i<BRINGUP_MODEMS; i++) {
+        if (cellular_attach(modems[i], ats[i], "internet") != 0) {
+            fprintf(stderr, "%s: attach failed: %s\n", name, strerror(errno));
+            exit(1);
+        }
+    }
+    double serial = now() - start;
+
+    for (int i=0; i<BRINGUP_MODEMS; i++)
+        cellular_detach(modems[i]);
+    start = now();
+    if (cellular_attach_many(modems, ats, "internet", BRINGUP_MODEMS, NULL, NULL, NULL) != 0) {
+        fprintf(stderr, "%s: attach failed: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    double concurrent = now() - start;
+    bringup_free(sims, ats, modems);
+
+    /* Fresh modems and no cache: probe and attach all of them at once. */
+    unlink(cache);
+    for (int i=0; i<BRINGUP_MODEMS; i++) {
+        sims[i] = modem_sim_alloc(config);
+        modems[i] = cellular_sim800_alloc(CELLULAR_SIM800_PROFILE_DEFAULT);
+        ats[i] = bringup_open(sims[i]);
+    }
+    struct at_autobaud autobaud = { .candidates = bringup_candidates, .cache = cache };
+    start = now();
+    if (cellular_attach_many(modems, ats, "internet", BRINGUP_MODEMS,
+                             at_autobaud_probe_unix, &autobaud, NULL) != 0) {
+        fprintf(stderr, "%s: bring-up failed: %s\n", name, strerror(errno));
+        exit(1);
+    }
+    double pooled = now() - start;
+    bringup_free(sims, ats, modems);
+
+    fprintf(stderr, "%-28s probe %6.1f ms cold, %5.1f ms cached; attach x%d %6.1f ms serial, %6.1f ms concurrent; "
+            "cold probe+attach x%d %6.1f ms\n",
+            name, cold * 1e3, warm * 1e3, BRINGUP_MODEMS, serial * 1e3, concurrent * 1e3,
+            BRINGUP_MODEMS, pooled * 1e3);
+
+    unlink(cache);
+}
+
+int main()
+{
+    bench_commands("AT (unpaced)", &(struct modem_sim_config) {
+        .type = MODEM_SIM_SIM800,
+    });
+    bench_commands("AT (115200 baud)", &(struct modem_sim_config) {
+        .type = MODEM_SIM_SIM800,
+        .baudrate = 115200,
+    });
+    bench_commands("AT (1 ms latency)", &(struct modem_sim_config) {
+        .type = MODEM_SIM_SIM800,
+        .latency_us = 1000,
+    });
+
+    bench_socket("sim800 (unpaced)", &(struct modem_sim_config) {
+        .type = MODEM_SIM_SIM800,
+    }, 1024 * 1024);
+    bench_socket("sim800 (921600 baud)", &(struct modem_sim_config) {
+        .type = MODEM_SIM_SIM800,
+        .baudrate = 921600,
+    }, 128 * 1024);
+    bench_socket("telit2 (unpaced)", &(struct modem_sim_config) {
+        .type = MODEM_SIM_TELIT2,
+    }, 1024 * 1024);
+    bench_socket("telit2 (921600 baud)", &(struct modem_sim_config) {
+        .type = MODEM_SIM_TELIT2,
+        .baudrate = 921600,
+    }, 128 * 1024);
+
+    struct modem_sim_config paced = {
+        .type = MODEM_SIM_SIM800,
+        .baudrate = 921600,
+    };
+    bench_control("shared channel (921600)", &paced, false);
+    bench_control("cmux channels (921600)", &paced, true);
+
+    bench_group("group of 1 (921600)", &paced, 1, 128 * 1024);
+    bench_group("group of 2 (921600)", &paced, 2, 128 * 1024);
+
+    bench_bringup("bring-up (115200, 1 ms)", &(struct modem_sim_config) {
+        .type = MODEM_SIM_SIM800,
+        .latency_us = 1000,
+        .speed = B115200,
+    });
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
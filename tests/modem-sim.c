@@ -0,0 +1,571 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * A fake modem: the responder thread owns the pty master, the AT channel
+ * opens the slave. Only what the drivers need is emulated, quirks included:
+ * "SHUT OK" instead of OK, AT+CIFSR answering with a bare IP address, raw
+ * payload after the +CIPRXGET: 2 / #SRECV header. Sockets have an endless
+ * supply of incoming data.
+ *
+ * AT+CMUX switches to 27.010 framing. Every channel then gets its own
+ * command session, and output is interleaved frame by frame like a real
+ * modem does.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <attentive/cmux.h>
+
+#include "modem-sim.h"
+
+#define MODEM_SIM_LINE_LENGTH   256
+#define MODEM_SIM_SCRIPTS       16
+#define MODEM_SIM_MAX_RECV      1500
+#define MODEM_SIM_CHANNELS      8
+#define MODEM_SIM_FRAME_SIZE    127
+
+struct modem_sim_entry {
+    const char *prefix;
+    const char *response;
+};
+
+/** Command interpreter state; one per multiplexer channel. */
+struct modem_sim_session {
+    char line[MODEM_SIM_LINE_LENGTH];
+    size_t line_len;
+    size_t raw_pending;     /**< Payload bytes still expected after a prompt. */
+    int raw_connid;
+    size_t raw_amount;
+
+    char *out;              /**< Output waiting for its frames. */
+    size_t out_len;
+    size_t out_size;
+};
+
+struct modem_sim {
+    struct modem_sim_config config;
+
+    int master;             /**< Pty master; the slave is the modem's port. */
+    int slave;              /**< Keeps the slave configured between users. */
+    char path[64];
+
+    pthread_t thread;
+    volatile bool running;
+
+    struct modem_sim_session sessions[MODEM_SIM_CHANNELS];
+    struct modem_sim_session *session;  /**< Session being served. */
+    bool cmux;              /**< Multiplexer mode. */
+    struct cmux_decoder decoder;
+    uint8_t frame[MODEM_SIM_LINE_LENGTH * 2];
+
+    struct timespec rx_done;    /**< When the last received byte finished arriving. */
+    struct timespec tx_free;    /**< When the line is free for sending again. */
+
+    struct modem_sim_entry scripts[MODEM_SIM_SCRIPTS];
+    int nscripts;
+
+    unsigned char next_byte;    /**< Incoming data is a counting pattern. */
+    volatile size_t received;
+};
+
+/*
+ * Timing.
+ */
+
+static void timespec_add_ns(struct timespec *ts, long long ns)
+{
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/** Account for bytes on a paced line; returns when they're through. */
+static void sim_line_time(const struct modem_sim *sim, struct timespec *line, size_t bytes)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_before(line, &now))
+        *line = now;
+    /* Start bit, eight data bits, stop bit. */
+    timespec_add_ns(line, bytes * 10 * 1000000000LL / sim->config.baudrate);
+}
+
+static void sim_sleep_until(const struct timespec *ts)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, ts, NULL) == EINTR) {}
+}
+
+/*
+ * Output.
+ */
+
+static void sim_write_raw(struct modem_sim *sim, const void *data, size_t len)
+{
+    const char *p = data;
+
+    while (len > 0) {
+        size_t n = len;
+        if (sim->config.baudrate) {
+            /* Roughly a millisecond's worth at a time. */
+            size_t slice = sim->config.baudrate / 10000 + 1;
+            if (n > slice)
+                n = slice;
+            sim_line_time(sim, &sim->tx_free, n);
+            sim_sleep_until(&sim->tx_free);
+        }
+
+        ssize_t result = write(sim->master, p, n);
+        if (result == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return;
+        }
+        p += result;
+        len -= result;
+    }
+}
+
+static void sim_write(struct modem_sim *sim, const void *data, size_t len)
+{
+    struct modem_sim_session *session = sim->session;
+
+    if (!sim->cmux) {
+        sim_write_raw(sim, data, len);
+        return;
+    }
+
+    /* Queue it up for sim_flush(). */
+    if (session->out_len + len > session->out_size) {
+        size_t size = (session->out_len + len) * 2;
+        char *out = realloc(session->out, size);
+        if (!out)
+            return;
+        session->out = out;
+        session->out_size = size;
+    }
+    memcpy(session->out + session->out_len, data, len);
+    session->out_len += len;
+}
+
+static void sim_frame(struct modem_sim *sim, int dlci, uint8_t control, const void *data, size_t len)
+{
+    uint8_t frame[MODEM_SIM_FRAME_SIZE + CMUX_HEADER_MAX + CMUX_TRAILER_SIZE];
+    sim_write_raw(sim, frame, cmux_encode(frame, dlci, control, data, len));
+}
+
+/** Send a frame's worth of every channel's output. Returns true if more is left. */
+static bool sim_flush(struct modem_sim *sim)
+{
+    bool more = false;
+
+    for (int dlci=1; dlci<MODEM_SIM_CHANNELS && sim->cmux; dlci++) {
+        struct modem_sim_session *session = &sim->sessions[dlci];
+        if (!session->out_len)
+            continue;
+
+        size_t n = session->out_len < MODEM_SIM_FRAME_SIZE ? session->out_len : MODEM_SIM_FRAME_SIZE;
+        sim_frame(sim, dlci, CMUX_UIH, session->out, n);
+        memmove(session->out, session->out + n, session->out_len - n);
+        session->out_len -= n;
+        more |= session->out_len > 0;
+    }
+
+    return more;
+}
+
+static void sim_printf(struct modem_sim *sim, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+static void sim_printf(struct modem_sim *sim, const char *format, ...)
+{
+    char buf[MODEM_SIM_LINE_LENGTH * 2];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    if (len > (int) sizeof(buf) - 1)
+        len = sizeof(buf) - 1;
+    sim_write(sim, buf, len);
+}
+
+/** Wait until the command has arrived and the modem has "thought" about it. */
+static void sim_respond(struct modem_sim *sim)
+{
+    struct timespec when = sim->rx_done;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_before(&when, &now))
+        when = now;
+    timespec_add_ns(&when, sim->config.latency_us * 1000LL);
+    sim_sleep_until(&when);
+}
+
+static void sim_payload(struct modem_sim *sim, size_t len)
+{
+    char data[MODEM_SIM_MAX_RECV];
+    for (size_t i=0; i<len; i++)
+        data[i] = sim->next_byte++;
+    sim_write(sim, data, len);
+}
+
+/*
+ * Command handling.
+ */
+
+static void sim800_command(struct modem_sim *sim, const char *line)
+{
+    int connid, amount;
+
+    if (!strcmp(line, "AT+CIPSHUT")) {
+        sim_printf(sim, "\r\nSHUT OK\r\n");
+    } else if (!strcmp(line, "AT+CIFSR")) {
+        /* No final OK. */
+        sim_printf(sim, "\r\n10.0.0.2\r\n");
+    } else if (!strcmp(line, "AT+CIPSTATUS")) {
+        /* The connection list follows the OK. */
+        sim_printf(sim, "\r\nOK\r\n\r\nSTATE: IP STATUS\r\n\r\n");
+        for (int i=0; i<6; i++)
+            sim_printf(sim, "C: %d,,\"\",\"\",\"\",\"INITIAL\"\r\n", i);
+    } else if (!strncmp(line, "AT+CMUX=", 8)) {
+        sim_printf(sim, "\r\nOK\r\n");
+        sim->cmux = true;
+    } else if (sscanf(line, "AT+CIPSTART=%d,", &connid) == 1) {
+        sim_printf(sim, "\r\nOK\r\n\r\n%d, CONNECT OK\r\n\r\n+CIPRXGET: 1,%d\r\n", connid, connid);
+    } else if (sscanf(line, "AT+CIPSEND=%d,%d", &connid, &amount) == 2) {
+        sim->session->raw_connid = connid;
+        sim->session->raw_amount = sim->session->raw_pending = amount;
+        sim_printf(sim, "\r\n> ");
+    } else if (sscanf(line, "AT+CIPRXGET=2,%d,%d", &connid, &amount) == 2) {
+        /* The driver takes the last field as the payload length. */
+        if (amount > MODEM_SIM_MAX_RECV)
+            amount = MODEM_SIM_MAX_RECV;
+        sim_printf(sim, "\r\n+CIPRXGET: 2,%d,%d,%d\r\n", connid, amount, amount);
+        sim_payload(sim, amount);
+        /* There's always more. */
+        sim_printf(sim, "\r\nOK\r\n\r\n+CIPRXGET: 1,%d\r\n", connid);
+    } else if (sscanf(line, "AT+CIPACK=%d", &connid) == 1) {
+        sim_printf(sim, "\r\n+CIPACK: %zu,%zu,0\r\n\r\nOK\r\n", sim->received, sim->received);
+    } else if (sscanf(line, "AT+CIPCLOSE=%d", &connid) == 1) {
+        sim_printf(sim, "\r\n%d, CLOSE OK\r\n", connid);
+    } else {
+        sim_printf(sim, "\r\nOK\r\n");
+    }
+}
+
+static void telit2_command(struct modem_sim *sim, const char *line)
+{
+    int connid, amount;
+
+    if (!strncmp(line, "AT+CMUX=", 8)) {
+        sim_printf(sim, "\r\nOK\r\n");
+        sim->cmux = true;
+    } else if (!strcmp(line, "AT#SGACT=1,1")) {
+        sim_printf(sim, "\r\n#SGACT: 10.0.0.2\r\n\r\nOK\r\n");
+    } else if (sscanf(line, "AT#SD=%d,", &connid) == 1) {
+        sim_printf(sim, "\r\nOK\r\n\r\nSRING: %d\r\n", connid);
+    } else if (sscanf(line, "AT#SSENDEXT=%d,%d", &connid, &amount) == 2) {
+        sim->session->raw_connid = connid;
+        sim->session->raw_amount = sim->session->raw_pending = amount;
+        sim_printf(sim, "\r\n> ");
+    } else if (sscanf(line, "AT#SRECV=%d,%d", &connid, &amount) == 2) {
+        if (amount > MODEM_SIM_MAX_RECV)
+            amount = MODEM_SIM_MAX_RECV;
+        sim_printf(sim, "\r\n#SRECV: %d,%d\r\n", connid, amount);
+        sim_payload(sim, amount);
+        sim_printf(sim, "\r\nOK\r\n");
+    } else if (sscanf(line, "AT#SI=%d", &connid) == 1) {
+        sim_printf(sim, "\r\n#SI: %d,%zu,0,0,0\r\n\r\nOK\r\n", connid, sim->received);
+    } else if (sscanf(line, "AT#SS=%d", &connid) == 1) {
+        sim_printf(sim, "\r\n#SS: %d,2\r\n\r\nOK\r\n", connid);
+    } else {
+        sim_printf(sim, "\r\nOK\r\n");
+    }
+}
+
+static void sim_command(struct modem_sim *sim, const char *line)
+{
+    /* Blank lines get no answer, just like on a real modem. */
+    if (!*line)
+        return;
+
+    sim_respond(sim);
+
+    for (int i=0; i<sim->nscripts; i++) {
+        const struct modem_sim_entry *entry = &sim->scripts[i];
+        if (!strncmp(line, entry->prefix, strlen(entry->prefix))) {
+            sim_write(sim, entry->response, strlen(entry->response));
+            return;
+        }
+    }
+
+    if (sim->config.type == MODEM_SIM_TELIT2)
+        telit2_command(sim, line);
+    else
+        sim800_command(sim, line);
+}
+
+static void sim_payload_done(struct modem_sim *sim)
+{
+    sim->received += sim->session->raw_amount;
+
+    sim_respond(sim);
+    if (sim->config.type == MODEM_SIM_TELIT2)
+        sim_printf(sim, "\r\nOK\r\n");
+    else
+        sim_printf(sim, "\r\n%d, SEND OK\r\n", sim->session->raw_connid);
+}
+
+static void sim_feed(struct modem_sim *sim, const char *buf, size_t len)
+{
+    struct modem_sim_session *session = sim->session;
+
+    while (len > 0) {
+        if (session->raw_pending) {
+            size_t n = len < session->raw_pending ? len : session->raw_pending;
+            session->raw_pending -= n;
+            buf += n;
+            len -= n;
+            if (!session->raw_pending)
+                sim_payload_done(sim);
+            continue;
+        }
+
+        char ch = *buf++;
+        len--;
+        if (ch == '\r') {
+            session->line[session->line_len] = '\0';
+            session->line_len = 0;
+            sim_command(sim, session->line);
+        } else if (ch != '\n' && session->line_len < sizeof(session->line) - 1) {
+            session->line[session->line_len++] = ch;
+        }
+    }
+}
+
+/*
+ * Multiplexer.
+ */
+
+static void sim_leave_cmux(struct modem_sim *sim)
+{
+    sim->cmux = false;
+    sim->session = &sim->sessions[0];
+    for (int dlci=0; dlci<MODEM_SIM_CHANNELS; dlci++)
+        sim->sessions[dlci].out_len = 0;
+}
+
+static void sim_control(struct modem_sim *sim, const uint8_t *data, size_t len)
+{
+    if (len < 2 || !(data[0] & CMUX_MSG_CR) || len > MODEM_SIM_FRAME_SIZE)
+        return;
+
+    /* Answer commands with a copy. */
+    uint8_t reply[MODEM_SIM_FRAME_SIZE];
+    memcpy(reply, data, len);
+    reply[0] &= ~CMUX_MSG_CR;
+    sim_frame(sim, 0, CMUX_UIH, reply, len);
+
+    if (reply[0] == CMUX_MSG_CLD)
+        sim_leave_cmux(sim);
+}
+
+static void sim_handle_frame(int dlci, uint8_t control, const uint8_t *data, size_t len, void *priv)
+{
+    struct modem_sim *sim = priv;
+
+    if (dlci >= MODEM_SIM_CHANNELS)
+        return;
+
+    switch (control & ~CMUX_PF) {
+        case CMUX_SABM: {
+            sim_frame(sim, dlci, CMUX_UA | CMUX_PF, NULL, 0);
+        } break;
+
+        case CMUX_DISC: {
+            sim_frame(sim, dlci, CMUX_UA | CMUX_PF, NULL, 0);
+            if (dlci == 0)
+                sim_leave_cmux(sim);
+        } break;
+
+        case CMUX_UIH: {
+            if (dlci == 0) {
+                sim_control(sim, data, len);
+            } else {
+                sim->session = &sim->sessions[dlci];
+                sim_feed(sim, (const char *) data, len);
+                sim->session = &sim->sessions[0];
+            }
+        } break;
+    }
+}
+
+static void sim_input(struct modem_sim *sim, const char *buf, size_t len)
+{
+    if (sim->cmux) {
+        cmux_decode(&sim->decoder, buf, len);
+        return;
+    }
+
+    /* Command mode, a line at a time: whatever follows AT+CMUX is framed. */
+    while (len > 0) {
+        const char *cr = memchr(buf, '\r', len);
+        size_t n = cr ? (size_t) (cr - buf) + 1 : len;
+        sim_feed(sim, buf, n);
+        buf += n;
+        len -= n;
+
+        if (sim->cmux) {
+            cmux_decoder_init(&sim->decoder, sim->frame, sizeof(sim->frame), sim_handle_frame, sim);
+            cmux_decode(&sim->decoder, buf, len);
+            return;
+        }
+    }
+}
+
+/**
+ * At the wrong speed a real modem only sees garbage; here it sees nothing.
+ */
+static bool sim_speed_matches(struct modem_sim *sim)
+{
+    struct termios attr;
+    if (!sim->config.speed || tcgetattr(sim->slave, &attr) == -1)
+        return true;
+    return cfgetospeed(&attr) == sim->config.speed;
+}
+
+static void *sim_thread(void *arg)
+{
+    struct modem_sim *sim = arg;
+    char buf[4096];
+
+    bool pending = false;
+    while (sim->running) {
+        /* Don't sit on queued output. */
+        struct pollfd fds = { .fd = sim->master, .events = POLLIN };
+        int ready = poll(&fds, 1, pending ? 0 : 100);
+        if (ready > 0) {
+            ssize_t result = read(sim->master, buf, sizeof(buf));
+            if (result > 0 && sim_speed_matches(sim)) {
+                if (sim->config.baudrate)
+                    sim_line_time(sim, &sim->rx_done, result);
+                sim_input(sim, buf, result);
+            }
+        }
+
+        pending = sim_flush(sim);
+    }
+
+    return NULL;
+}
+
+/*
+ * Public interface.
+ */
+
+struct modem_sim *modem_sim_alloc(const struct modem_sim_config *config)
+{
+    struct modem_sim *sim = calloc(1, sizeof(struct modem_sim));
+    if (!sim) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    sim->config = *config;
+    sim->session = &sim->sessions[0];
+
+    sim->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim->master == -1 || grantpt(sim->master) == -1 || unlockpt(sim->master) == -1 ||
+        ptsname_r(sim->master, sim->path, sizeof(sim->path)) != 0) {
+        int error = errno;
+        if (sim->master != -1)
+            close(sim->master);
+        free(sim);
+        errno = error;
+        return NULL;
+    }
+
+    /* A real serial port would be set up like this by the application. */
+    struct termios attr;
+    sim->slave = open(sim->path, O_RDWR | O_NOCTTY);
+    if (sim->slave == -1 || tcgetattr(sim->slave, &attr) == -1) {
+        int error = errno;
+        if (sim->slave != -1)
+            close(sim->slave);
+        close(sim->master);
+        free(sim);
+        errno = error;
+        return NULL;
+    }
+    cfmakeraw(&attr);
+    tcsetattr(sim->slave, TCSANOW, &attr);
+
+    sim->running = true;
+    if ((errno = pthread_create(&sim->thread, NULL, sim_thread, sim)) != 0) {
+        close(sim->slave);
+        close(sim->master);
+        free(sim);
+        return NULL;
+    }
+
+    return sim;
+}
+
+void modem_sim_free(struct modem_sim *sim)
+{
+    sim->running = false;
+    pthread_join(sim->thread, NULL);
+    close(sim->slave);
+    close(sim->master);
+    for (int dlci=0; dlci<MODEM_SIM_CHANNELS; dlci++)
+        free(sim->sessions[dlci].out);
+    free(sim);
+}
+
+const char *modem_sim_path(struct modem_sim *sim)
+{
+    return sim->path;
+}
+
+int modem_sim_script(struct modem_sim *sim, const char *prefix, const char *response)
+{
+    if (sim->nscripts == MODEM_SIM_SCRIPTS) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    sim->scripts[sim->nscripts++] = (struct modem_sim_entry) {
+        .prefix = prefix,
+        .response = response,
+    };
+    return 0;
+}
+
+size_t modem_sim_received(struct modem_sim *sim)
+{
+    return sim->received;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,67 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef MODEM_SIM_H
+#define MODEM_SIM_H
+
+#include <stddef.h>
+#include <termios.h>
+
+/**
+ * Fake modem on a pty pair, for benchmarking without hardware.
+ */
+struct modem_sim;
+
+enum modem_sim_type {
+    MODEM_SIM_SIM800,
+    MODEM_SIM_TELIT2,
+};
+
+struct modem_sim_config {
+    enum modem_sim_type type;
+    int baudrate;       /**< Pace both directions to this many bits/s; zero doesn't. */
+    int latency_us;     /**< Extra delay before each response. */
+    speed_t speed;      /**< Ignore input unless the port is set to this (see
+                             termios.h), like a modem locked with AT+IPR;
+                             zero takes any. */
+};
+
+/**
+ * Create a fake modem and start its responder thread.
+ *
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct modem_sim *modem_sim_alloc(const struct modem_sim_config *config);
+
+/**
+ * Stop the responder thread and free the fake modem.
+ */
+void modem_sim_free(struct modem_sim *sim);
+
+/**
+ * Device path to pass to at_alloc_unix().
+ */
+const char *modem_sim_path(struct modem_sim *sim);
+
+/**
+ * Answer commands starting with a prefix with a canned response, sent
+ * verbatim. Takes precedence over the built-in responses. Must be called
+ * before the port is opened.
+ *
+ * @returns Zero on success, -1 if the script table is full.
+ */
+int modem_sim_script(struct modem_sim *sim, const char *prefix, const char *response);
+
+/**
+ * Socket payload bytes the modem has accepted so far.
+ */
+size_t modem_sim_received(struct modem_sim *sim);
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
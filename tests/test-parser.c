@@ -14,6 +14,7 @@
 #include <check.h>
 #include <glib.h>
 
+#include <attentive/cmux.h>
 #include <attentive/parser.h>
 
 
@@ -83,6 +84,41 @@ START_TEST(test_parser_alloc)
 }
 END_TEST
 
+START_TEST(test_parser_init)
+{
+    printf(":: test_parser_init\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+    };
+    static long long storage[64];
+
+    /* too small */
+    ck_assert(at_parser_init(storage, at_parser_size(16) - 1, &cbs, 16, NULL) == NULL);
+
+    struct at_parser *parser = at_parser_init(storage, sizeof(storage), &cbs, 16, NULL);
+    ck_assert(parser != NULL);
+    at_parser_set_buffer_limit(parser, 64);
+
+    expect_prepare();
+
+    expect_response("0123456789");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("0123456789\r\nOK\r\n"));
+    expect_nothing();
+
+    /* the buffer is the caller's; it doesn't grow. */
+    expect_response("abcdefghij");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("0123456789\r\nabcdefghij\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(at_parser_overflowed(parser));
+
+    at_parser_free(parser);
+}
+END_TEST
+
 START_TEST(test_parser_response)
 {
     printf(":: test_parser_response\n");
@@ -200,16 +236,126 @@ START_TEST(test_parser_overflow)
     at_parser_feed(parser, STR_LEN("1234\r\nOK\r\n"));
     expect_nothing();
 
-    /* this one doesn't. */
-    /* TODO: We could be better behaved when it comes to overflows. Not crashing is enough for now. */
+    ck_assert(!at_parser_overflowed(parser));
+
+    /* this one doesn't; the final response is still recognized. */
+    expect_response("");
     at_parser_await_response(parser);
     at_parser_feed(parser, STR_LEN("12345\r\nOK\r\n"));
     expect_nothing();
+    ck_assert(at_parser_overflowed(parser));
+
+    /* and neither does this one. */
+    expect_response("ERROR");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("123\r\n456\r\nERROR\r\n"));
+    expect_nothing();
+    ck_assert(at_parser_overflowed(parser));
+    ck_assert_int_eq(at_parser_overflow_count(parser), 2);
+
+    /* the flag is per-response. */
+    expect_response("12");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("12\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(!at_parser_overflowed(parser));
 
     at_parser_free(parser);
 }
 END_TEST
 
+START_TEST(test_parser_grow)
+{
+    printf(":: test_parser_grow\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 8, NULL);
+    ck_assert(parser != NULL);
+    at_parser_set_buffer_limit(parser, 32);
+
+    expect_prepare();
+
+    /* the buffer grows to fit... */
+    expect_response("0123456789\nabcdefghij");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("0123456789\r\nabcdefghij\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(!at_parser_overflowed(parser));
+
+    /* ...up to the limit. */
+    expect_response("0123456789");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("0123456789\r\nabcdefghij\r\n0123456789\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(at_parser_overflowed(parser));
+
+    at_parser_free(parser);
+}
+END_TEST
+
+static const char *held_response;
+
+static void handle_response_hold(const char *line, size_t len, void *priv)
+{
+    (void) len;
+    (void) priv;
+    held_response = line;
+}
+
+START_TEST(test_parser_hold)
+{
+    printf(":: test_parser_hold\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response_hold,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* URCs right behind the response don't overwrite it. */
+    expect_urc("+CIPRXGET: 1,0");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("1234\r\nOK\r\n+CIPRXGET: 1,0\r\nRI"));
+    expect_nothing();
+    ck_assert_str_eq(held_response, "1234");
+
+    /* Partial lines survive the next command. */
+    expect_urc("RING");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("NG\r\n5678\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert_str_eq(held_response, "5678");
+
+    at_parser_free(parser);
+
+    /* A response filling the buffer is held too: it grows for the URCs... */
+    parser = at_parser_alloc(&cbs, 16, NULL);
+    ck_assert(parser != NULL);
+    at_parser_set_buffer_limit(parser, 64);
+    expect_urc("RING");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("0123456789ab\r\nOK\r\nRING\r\n"));
+    expect_nothing();
+    ck_assert_str_eq(held_response, "0123456789ab");
+    at_parser_free(parser);
+
+    /* ...or, if it can't, they're cut short. */
+    parser = at_parser_alloc(&cbs, 16, NULL);
+    ck_assert(parser != NULL);
+    expect_urc("RI");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("0123456789ab\r\nOK\r\nRING\r\n"));
+    ck_assert_str_eq(held_response, "0123456789ab");
+    at_parser_free(parser);
+}
+END_TEST
+
 static enum at_response_type line_scanner(const char *line, size_t len, void *priv)
 {
     (void) len;
@@ -270,6 +416,87 @@ START_TEST(test_parser_hexdata)
     at_parser_feed(parser, STR_LEN("\r\n+HEXDATA: 10\r\n61 62 6364 01 ff 78797a70\r\nOK\r\n"));
     expect_nothing();
 
+    /* Digit pairs split across feeds. */
+    expect_response("+HEXDATA: 4\nAbCd");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+HEXDATA: 4\r\n4"));
+    at_parser_feed(parser, STR_LEN("16"));
+    at_parser_feed(parser, STR_LEN("2 4"));
+    at_parser_feed(parser, STR_LEN("364\r\nOK\r\n"));
+    expect_nothing();
+
+    at_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_parser_data_buffer)
+{
+    printf(":: test_parser_data_buffer\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 24, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* Payload bigger than the response buffer goes to the data buffer... */
+    char data[32];
+    expect_response("+RAWDATA: 30");
+    at_parser_set_data_buffer(parser, data, sizeof(data));
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+RAWDATA: 30\r\n0123456789\r\nabcdefghij\r\nABCDEF\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(!memcmp(data, "0123456789\r\nabcdefghij\r\nABCDEF", 30));
+
+    /* ...and so does decoded hex data, truncated to the buffer size. */
+    memset(data, 0, sizeof(data));
+    expect_response("+HEXDATA: 4");
+    at_parser_set_data_buffer(parser, data, 3);
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+HEXDATA: 4\r\n41424344\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert_str_eq(data, "ABC");
+    ck_assert(at_parser_overflowed(parser));
+
+    /* The setting only applies to a single response. */
+    expect_response("+RAWDATA: 4\nwxyz");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+RAWDATA: 4\r\nwxyz\r\nOK\r\n"));
+    expect_nothing();
+
+    at_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_parser_bytewise)
+{
+    printf(":: test_parser_bytewise\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* Same as above, but every byte arrives on its own. */
+    expect_response("+RAWDATA: 16\nRING\r\nabcd\x01\xffxyzp\n12345");
+    expect_urc("RING");
+    expect_urc("RING");
+    expect_urc("RING");
+    at_parser_await_response(parser);
+    const char *input = "\r\nRING\r\n+RAWDATA: 16\r\nRING\r\nabcd\x01\xFFxyzp\r\nRING\r\n12345\r\nOK\r\nRING\r\n";
+    for (const char *p = input; *p; p++)
+        at_parser_feed(parser, p, 1);
+    expect_nothing();
+
     at_parser_free(parser);
 }
 END_TEST
@@ -304,6 +531,244 @@ START_TEST(test_parser_dataprompt)
 }
 END_TEST
 
+static char datamode_buf[64];
+static size_t datamode_len;
+
+static void handle_data(const void *data, size_t len, void *priv)
+{
+    (void) priv;
+    ck_assert(datamode_len + len <= sizeof(datamode_buf));
+    memcpy(datamode_buf + datamode_len, data, len);
+    datamode_len += len;
+}
+
+static enum at_response_type scan_connect(const char *line, size_t len, void *priv)
+{
+    (void) len;
+    (void) priv;
+    if (!strcmp(line, "CONNECT"))
+        return AT_RESPONSE_FINAL_OK;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+START_TEST(test_parser_datamode)
+{
+    printf(":: test_parser_datamode\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .handle_data = handle_data,
+        .scan_line = scan_connect,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+    datamode_len = 0;
+
+    /* A failed command doesn't switch modes. */
+    at_parser_expect_datamode(parser);
+    at_parser_await_response(parser);
+    expect_response("ERROR");
+    expect_urc("RING");
+    at_parser_feed(parser, STR_LEN("\r\nERROR\r\n\r\nRING\r\n"));
+    expect_nothing();
+    ck_assert(!at_parser_in_datamode(parser));
+
+    /* Everything after CONNECT is passed through, even in the same chunk. */
+    at_parser_expect_datamode(parser);
+    at_parser_await_response(parser);
+    expect_response("");
+    at_parser_feed(parser, STR_LEN("\r\nCONNECT\r\nhello\r\nRING\r\n"));
+    at_parser_feed(parser, "\x00\xff", 2);
+    expect_nothing();
+    ck_assert(at_parser_in_datamode(parser));
+    ck_assert_int_eq(datamode_len, 15);
+    ck_assert(!memcmp(datamode_buf, "hello\r\nRING\r\n\x00\xff", 15));
+
+    /* The next command (the escape) goes back to parsing lines. */
+    at_parser_await_response(parser);
+    ck_assert(!at_parser_in_datamode(parser));
+    expect_response("");
+    at_parser_feed(parser, STR_LEN("\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert_int_eq(datamode_len, 15);
+
+    at_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_prefix_matcher)
+{
+    printf(":: test_prefix_matcher\n");
+
+    static const char *const urcs[] = { "+CIPRXGET: 1,", "RING", "+CIEV: ", NULL };
+    static const char *const finals[] = { "+CIPRXGET:", "OK", "ERROR", NULL };
+
+    struct at_prefix_entry entries[6];
+    struct at_prefix_matcher matcher;
+    at_prefix_matcher_init(&matcher, entries, 6);
+    ck_assert_int_eq(at_prefix_matcher_add(&matcher, urcs, 1), 0);
+    ck_assert_int_eq(at_prefix_matcher_add(&matcher, finals, 2), 0);
+
+    /* Earlier tables take precedence... */
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("+CIPRXGET: 1,0")), 1);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("+CIPRXGET: 2,0,8,0")), 2);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("+CIEV: 10")), 1);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("OK")), 2);
+
+    /* ...and the line has to be long enough. */
+    ck_assert_int_eq(at_prefix_match(&matcher, "RING", 3), 0);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("+CIP")), 0);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("NO CARRIER")), 0);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("")), 0);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("\xffOK")), 0);
+
+    /* Running out of entries is reported. */
+    static const char *const more[] = { "+CME ERROR:", NULL };
+    ck_assert_int_eq(at_prefix_matcher_add(&matcher, more, 3), -1);
+}
+END_TEST
+
+START_TEST(test_fields)
+{
+    printf(":: test_fields\n");
+
+    struct at_fields fields;
+
+    /* Integers, strings with commas and empty fields. */
+    ck_assert_int_eq(at_fields_parse(&fields, "+CMD:", STR_LEN("+CMD: 12, -3,\"a,b\",,x1 ")), 5);
+    ck_assert(fields.field[0].integer);
+    ck_assert_int_eq(fields.field[0].value, 12);
+    ck_assert(fields.field[1].integer);
+    ck_assert_int_eq(fields.field[1].value, -3);
+    ck_assert(fields.field[2].quoted);
+    ck_assert(!fields.field[2].integer);
+    ck_assert_int_eq(fields.field[2].len, 3);
+    ck_assert(!strncmp(fields.field[2].str, "a,b", 3));
+    ck_assert_int_eq(fields.field[3].len, 0);
+    ck_assert(!fields.field[3].integer);
+    ck_assert_int_eq(fields.field[4].len, 2);
+    ck_assert(!fields.field[4].integer);
+
+    int value = 0;
+    ck_assert(at_field_int(&fields, 1, &value));
+    ck_assert_int_eq(value, -3);
+    ck_assert(!at_field_int(&fields, 2, &value));
+    ck_assert(!at_field_int(&fields, 5, &value));
+
+    /* Only len bytes are looked at. */
+    ck_assert_int_eq(at_fields_parse(&fields, "+CIPRXGET: 2,", "+CIPRXGET: 2,0,1460,0\nOK", 21), 3);
+    ck_assert_int_eq(fields.field[1].value, 1460);
+    ck_assert_int_eq(fields.field[2].value, 0);
+
+    /* A mismatch leaves the fields alone. */
+    ck_assert_int_eq(at_fields_parse(&fields, "+CSQ: ", STR_LEN("+CSQN: 17")), -1);
+    ck_assert_int_eq(fields.count, 3);
+    ck_assert_int_eq(at_fields_parse(&fields, "+CSQ: ", STR_LEN("+CSQ")), -1);
+    ck_assert_int_eq(at_fields_parse(&fields, "+CSQ: ", STR_LEN("+CSQ: ")), 0);
+
+    /* Unterminated strings run to the end; extra fields are dropped. */
+    ck_assert_int_eq(at_fields_parse(&fields, "", STR_LEN("\"abc")), 1);
+    ck_assert_int_eq(fields.field[0].len, 3);
+    ck_assert_int_eq(at_fields_parse(&fields, "", STR_LEN("0,1,2,3,4,5,6,7,8,9")), AT_FIELDS_MAX);
+    ck_assert_int_eq(fields.field[AT_FIELDS_MAX-1].value, AT_FIELDS_MAX-1);
+
+    /* Whatever doesn't fit in an int isn't an integer. */
+    ck_assert_int_eq(at_fields_parse(&fields, "", STR_LEN("2147483647,-2147483648,2147483648,89014103211118510720")), 4);
+    ck_assert(at_field_int(&fields, 0, &value));
+    ck_assert_int_eq(value, 2147483647);
+    ck_assert(at_field_int(&fields, 1, &value));
+    ck_assert_int_eq(value, -2147483647 - 1);
+    ck_assert(!fields.field[2].integer);
+    ck_assert_int_eq(fields.field[2].value, 0);
+    ck_assert(!at_field_int(&fields, 3, &value));
+}
+END_TEST
+
+struct cmux_frame_record {
+    int frames;
+    int dlci;
+    uint8_t control;
+    uint8_t data[256];
+    size_t len;
+};
+
+void handle_cmux_frame(int dlci, uint8_t control, const uint8_t *data, size_t len, void *priv)
+{
+    struct cmux_frame_record *record = priv;
+    record->frames++;
+    record->dlci = dlci;
+    record->control = control;
+    memcpy(record->data, data, len);
+    record->len = len;
+}
+
+START_TEST(test_cmux)
+{
+    printf(":: test_cmux\n");
+
+    uint8_t frame[256 + CMUX_HEADER_MAX + CMUX_TRAILER_SIZE];
+    uint8_t buf[256];
+    struct cmux_frame_record record = {0};
+    struct cmux_decoder decoder;
+    cmux_decoder_init(&decoder, buf, sizeof(buf), handle_cmux_frame, &record);
+
+    /* SABM on the control channel, as sent by every 27.010 initiator. */
+    static const uint8_t sabm[] = { 0xF9, 0x03, 0x3F, 0x01, 0x1C, 0xF9 };
+    ck_assert_int_eq(cmux_encode(frame, 0, CMUX_SABM | CMUX_PF, NULL, 0), sizeof(sabm));
+    ck_assert(!memcmp(frame, sabm, sizeof(sabm)));
+
+    /* Data frames survive being fed bytewise. */
+    size_t n = cmux_encode(frame, 2, CMUX_UIH, STR_LEN("AT+CSQ\r"));
+    for (size_t i=0; i<n; i++)
+        cmux_decode(&decoder, frame + i, 1);
+    ck_assert_int_eq(record.frames, 1);
+    ck_assert_int_eq(record.dlci, 2);
+    ck_assert_int_eq(record.control, CMUX_UIH);
+    ck_assert_int_eq(record.len, 7);
+    ck_assert(!memcmp(record.data, "AT+CSQ\r", 7));
+
+    /* Long frames use two length bytes. */
+    uint8_t data[200];
+    for (size_t i=0; i<sizeof(data); i++)
+        data[i] = i;
+    n = cmux_encode(frame, 1, CMUX_UIH, data, sizeof(data));
+    ck_assert_int_eq(n, sizeof(data) + CMUX_HEADER_MAX + CMUX_TRAILER_SIZE);
+    cmux_decode(&decoder, frame, n);
+    ck_assert_int_eq(record.frames, 2);
+    ck_assert_int_eq(record.len, sizeof(data));
+    ck_assert(!memcmp(record.data, data, sizeof(data)));
+
+    /* Corrupted frames are dropped, and the decoder resynchronizes. */
+    n = cmux_encode(frame, 1, CMUX_UIH, STR_LEN("OK"));
+    frame[n-2] ^= 0x01;
+    cmux_decode(&decoder, frame, n);
+    ck_assert_int_eq(record.frames, 2);
+    ck_assert_int_eq(decoder.errors, 1);
+
+    /* Shared and repeated flags between frames are fine. */
+    n = cmux_encode(frame, 0, CMUX_UA | CMUX_PF, NULL, 0);
+    static const uint8_t flags[] = { 0xF9, 0xF9 };
+    cmux_decode(&decoder, flags, sizeof(flags));
+    cmux_decode(&decoder, frame, n);
+    cmux_decode(&decoder, frame + 1, n - 1);
+    ck_assert_int_eq(record.frames, 4);
+    ck_assert_int_eq(record.dlci, 0);
+    ck_assert_int_eq(record.control, CMUX_UA | CMUX_PF);
+    ck_assert_int_eq(decoder.errors, 1);
+
+    /* Frames that don't fit the buffer are dropped. */
+    struct cmux_decoder small;
+    cmux_decoder_init(&small, buf, 16, handle_cmux_frame, &record);
+    n = cmux_encode(frame, 1, CMUX_UIH, data, 17);
+    cmux_decode(&small, frame, n);
+    ck_assert_int_eq(record.frames, 4);
+    ck_assert_int_eq(small.errors, 1);
+}
+END_TEST
+
 Suite *attentive_suite(void)
 {
     Suite *s = suite_create("attentive");
@@ -311,13 +776,22 @@ Suite *attentive_suite(void)
   
     tc = tcase_create("parser");
     tcase_add_test(tc, test_parser_alloc);
+    tcase_add_test(tc, test_parser_init);
     tcase_add_test(tc, test_parser_response);
     tcase_add_test(tc, test_parser_urc);
     tcase_add_test(tc, test_parser_mixed);
     tcase_add_test(tc, test_parser_overflow);
+    tcase_add_test(tc, test_parser_grow);
+    tcase_add_test(tc, test_parser_hold);
     tcase_add_test(tc, test_parser_rawdata);
     tcase_add_test(tc, test_parser_hexdata);
+    tcase_add_test(tc, test_parser_data_buffer);
+    tcase_add_test(tc, test_parser_bytewise);
     tcase_add_test(tc, test_parser_dataprompt);
+    tcase_add_test(tc, test_parser_datamode);
+    tcase_add_test(tc, test_prefix_matcher);
+    tcase_add_test(tc, test_fields);
+    tcase_add_test(tc, test_cmux);
     suite_add_tcase(s, tc);
 
     return s;